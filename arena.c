@@ -0,0 +1,100 @@
+/*-
+ * Copyright (c) 2026  Peter Pentchev
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <err.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_CHUNK_SIZE	(64 * 1024)
+
+union arena_align {
+	long double	ld;
+	long long	ll;
+	void		*p;
+	void		(*fp)(void);
+};
+
+struct arena_chunk {
+	struct arena_chunk	*next;
+	union arena_align	 data[];
+};
+
+#define ARENA_ALIGN	(sizeof(union arena_align))
+
+void *
+arena_alloc(struct arena * const a, const size_t len)
+{
+	const size_t need = (len + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+	if (need < len)
+		errx(1, "Out of memory");
+
+	if (a->head == NULL || a->size - a->used < need) {
+		/* Large requests get a chunk of their own. */
+		const size_t size = need > ARENA_CHUNK_SIZE / 4 ? need : ARENA_CHUNK_SIZE;
+		struct arena_chunk * const chunk = malloc(sizeof(*chunk) + size);
+		if (chunk == NULL)
+			errx(1, "Out of memory");
+
+		if (a->head != NULL && size == need) {
+			/* Keep allocating from the current chunk afterwards. */
+			chunk->next = a->head->next;
+			a->head->next = chunk;
+			return (chunk->data);
+		}
+		chunk->next = a->head;
+		a->head = chunk;
+		a->used = 0;
+		a->size = size;
+	}
+
+	void * const res = (char *)a->head->data + a->used;
+	a->used += need;
+	return (res);
+}
+
+char *
+arena_strndup(struct arena * const a, const char * const s, const size_t len)
+{
+	char * const res = arena_alloc(a, len + 1);
+	memcpy(res, s, len);
+	res[len] = '\0';
+	return (res);
+}
+
+void
+arena_free(struct arena * const a)
+{
+	struct arena_chunk *chunk = a->head;
+	while (chunk != NULL) {
+		struct arena_chunk * const next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	*a = ARENA_INIT;
+}
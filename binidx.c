@@ -0,0 +1,221 @@
+/*-
+ * Copyright (c) 2026  Peter Pentchev
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "binidx.h"
+
+/*
+ * All the integers are stored in little-endian byte order.
+ *
+ * Header: magic[8], version u32, flags u32, entry count u64, next serial
+ * number u64, end of the records u64, offset of the last module definition
+ * u64, module count u32, reserved u32.
+ *
+ * Records: size u32 (of the whole record), type u8, and then either
+ * - module: reserved[3], id u32, previous module definition offset u64,
+ *   name; or
+ * - entry: status u8, action u8, reserved u8, module id u32, serial
+ *   number u64, filename.
+ *
+ * Pack location records, one for each serial number, all zeroes if there
+ * is no packed artifact for it: flags u32 (bit 0 set), segment u32,
+ * offset u64, length u64, CRC-32 of the stored data u32, reserved u32.
+ */
+
+static void
+put32(unsigned char * const p, const uint32_t v)
+{
+	for (size_t i = 0; i < 4; i++)
+		p[i] = (v >> (8 * i)) & 0xff;
+}
+
+static void
+put64(unsigned char * const p, const uint64_t v)
+{
+	for (size_t i = 0; i < 8; i++)
+		p[i] = (v >> (8 * i)) & 0xff;
+}
+
+static uint32_t
+get32(const unsigned char * const p)
+{
+	uint32_t v = 0;
+	for (size_t i = 4; i > 0; i--)
+		v = (v << 8) | p[i - 1];
+	return (v);
+}
+
+static uint64_t
+get64(const unsigned char * const p)
+{
+	uint64_t v = 0;
+	for (size_t i = 8; i > 0; i--)
+		v = (v << 8) | p[i - 1];
+	return (v);
+}
+
+void
+binidx_encode_header(unsigned char * const buf, const struct binidx_header * const h)
+{
+	memcpy(buf, BINIDX_MAGIC, BINIDX_MAGIC_SIZE);
+	put32(buf + 8, h->version);
+	put32(buf + 12, h->flags);
+	put64(buf + 16, h->count);
+	put64(buf + 24, h->next_idx);
+	put64(buf + 32, h->end);
+	put64(buf + 40, h->last_module);
+	put32(buf + 48, h->module_count);
+	put32(buf + 52, 0);
+}
+
+bool
+binidx_decode_header(const unsigned char * const buf, const size_t len, struct binidx_header * const h)
+{
+	if (len < BINIDX_HEADER_SIZE || memcmp(buf, BINIDX_MAGIC, BINIDX_MAGIC_SIZE) != 0)
+		return (false);
+	*h = (struct binidx_header){
+		.version = get32(buf + 8),
+		.flags = get32(buf + 12),
+		.count = get64(buf + 16),
+		.next_idx = get64(buf + 24),
+		.end = get64(buf + 32),
+		.last_module = get64(buf + 40),
+		.module_count = get32(buf + 48),
+	};
+	return (h->version == BINIDX_VERSION && h->end >= BINIDX_HEADER_SIZE);
+}
+
+size_t
+binidx_encode_module(unsigned char * const buf, const uint32_t id, const uint64_t prev, const char * const name, const size_t name_len)
+{
+	if (name_len > UINT32_MAX - BINIDX_MODULE_SIZE)
+		return (0);
+	const size_t size = BINIDX_MODULE_SIZE + name_len;
+	put32(buf, size);
+	buf[4] = BINIDX_MODULE;
+	buf[5] = buf[6] = buf[7] = 0;
+	put32(buf + 8, id);
+	put64(buf + 12, prev);
+	memcpy(buf + BINIDX_MODULE_SIZE, name, name_len);
+	return (size);
+}
+
+size_t
+binidx_encode_entry(unsigned char * const buf, const unsigned status, const unsigned action, const uint32_t module, const uint64_t idx, const char * const filename, const size_t filename_len)
+{
+	if (filename_len > UINT32_MAX - BINIDX_ENTRY_SIZE)
+		return (0);
+	const size_t size = BINIDX_ENTRY_SIZE + filename_len;
+	put32(buf, size);
+	buf[4] = BINIDX_ENTRY;
+	buf[BINIDX_STATUS_OFFSET] = status;
+	buf[6] = action;
+	buf[7] = 0;
+	put32(buf + 8, module);
+	put64(buf + 12, idx);
+	memcpy(buf + BINIDX_ENTRY_SIZE, filename, filename_len);
+	return (size);
+}
+
+size_t
+binidx_record_size(const unsigned char * const data)
+{
+	return (get32(data));
+}
+
+bool
+binidx_decode_record(const unsigned char * const data, const size_t avail, struct binidx_record * const rec)
+{
+	if (avail < 8)
+		return (false);
+	const size_t size = get32(data);
+	if (size > avail)
+		return (false);
+
+	switch (data[4]) {
+		case BINIDX_MODULE:
+			if (size < BINIDX_MODULE_SIZE)
+				return (false);
+			*rec = (struct binidx_record){
+				.type = BINIDX_MODULE,
+				.size = size,
+				.module = get32(data + 8),
+				.prev = get64(data + 12),
+				.name = (const char *)data + BINIDX_MODULE_SIZE,
+				.name_len = size - BINIDX_MODULE_SIZE,
+			};
+			return (true);
+
+		case BINIDX_ENTRY:
+			if (size < BINIDX_ENTRY_SIZE ||
+			    data[BINIDX_STATUS_OFFSET] > BINIDX_STATUS_UNDONE ||
+			    data[6] > BINIDX_MAX_ACTION)
+				return (false);
+			*rec = (struct binidx_record){
+				.type = BINIDX_ENTRY,
+				.size = size,
+				.status = data[BINIDX_STATUS_OFFSET],
+				.action = data[6],
+				.module = get32(data + 8),
+				.idx = get64(data + 12),
+				.name = (const char *)data + BINIDX_ENTRY_SIZE,
+				.name_len = size - BINIDX_ENTRY_SIZE,
+			};
+			return (true);
+
+		default:
+			return (false);
+	}
+}
+
+void
+binidx_encode_location(unsigned char * const buf, const struct binidx_location * const loc)
+{
+	put32(buf, 1);
+	put32(buf + 4, loc->segment);
+	put64(buf + 8, loc->offset);
+	put64(buf + 16, loc->length);
+	put32(buf + 24, loc->crc);
+	put32(buf + 28, 0);
+}
+
+bool
+binidx_decode_location(const unsigned char * const buf, struct binidx_location * const loc)
+{
+	if ((get32(buf) & 1) == 0)
+		return (false);
+	*loc = (struct binidx_location){
+		.segment = get32(buf + 4),
+		.offset = get64(buf + 8),
+		.length = get64(buf + 16),
+		.crc = get32(buf + 24),
+	};
+	return (true);
+}
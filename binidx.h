@@ -0,0 +1,100 @@
+#ifndef INCLUDED_BINIDX_H
+#define INCLUDED_BINIDX_H
+
+/*-
+ * Copyright (c) 2026  Peter Pentchev
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * binidx - encode and decode the header and the records of the binary
+ * database index, as well as the records of the pack location table
+ */
+
+#define BINIDX_MAGIC		"TXN-IDX\n"
+#define BINIDX_MAGIC_SIZE	8
+#define BINIDX_VERSION		1
+
+#define BINIDX_HEADER_SIZE	56
+#define BINIDX_MODULE_SIZE	20
+#define BINIDX_ENTRY_SIZE	20
+
+/* The offset of the status byte within an entry record. */
+#define BINIDX_STATUS_OFFSET	5
+
+#define BINIDX_STATUS_LIVE	0
+#define BINIDX_STATUS_UNDONE	1
+
+#define BINIDX_MAX_ACTION	2
+
+#define BINIDX_LOCATION_SIZE	32
+
+enum binidx_type {
+	BINIDX_MODULE = 1,
+	BINIDX_ENTRY = 2,
+};
+
+struct binidx_header {
+	uint32_t	version;
+	uint32_t	flags;
+	uint64_t	count;
+	uint64_t	next_idx;
+	uint64_t	end;
+	uint64_t	last_module;
+	uint32_t	module_count;
+};
+
+/*
+ * A decoded record: a module definition (id, the offset of the previous
+ * one or zero, name) or an entry (status, action, module id, serial
+ * number, filename).  The name points into the encoded data.
+ */
+struct binidx_record {
+	enum binidx_type	type;
+	size_t			size;
+	unsigned		status;
+	unsigned		action;
+	uint32_t		module;
+	uint64_t		idx;
+	uint64_t		prev;
+	const char		*name;
+	size_t			name_len;
+};
+
+/* Where a packed artifact is stored: a part of a pack segment. */
+struct binidx_location {
+	uint32_t	segment;
+	uint64_t	offset;
+	uint64_t	length;
+	uint32_t	crc;
+};
+
+void	binidx_encode_header(unsigned char *buf, const struct binidx_header *h);
+bool	binidx_decode_header(const unsigned char *buf, size_t len, struct binidx_header *h);
+size_t	binidx_encode_module(unsigned char *buf, uint32_t id, uint64_t prev, const char *name, size_t name_len);
+size_t	binidx_encode_entry(unsigned char *buf, unsigned status, unsigned action, uint32_t module, uint64_t idx, const char *filename, size_t filename_len);
+size_t	binidx_record_size(const unsigned char *data);
+bool	binidx_decode_record(const unsigned char *data, size_t avail, struct binidx_record *rec);
+void	binidx_encode_location(unsigned char *buf, const struct binidx_location *loc);
+bool	binidx_decode_location(const unsigned char *buf, struct binidx_location *loc);
+
+#endif
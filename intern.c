@@ -0,0 +1,114 @@
+/*-
+ * Copyright (c) 2026  Peter Pentchev
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <err.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "flexarr.h"
+#include "intern.h"
+
+static size_t
+hash_name(const char * const name, const size_t len)
+{
+	uint64_t h = UINT64_C(14695981039346656037);
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char)name[i];
+		h *= UINT64_C(1099511628211);
+	}
+	return (h ^ (h >> 32));
+}
+
+static size_t
+find_slot(const struct intern * const t, const char * const name, const size_t len)
+{
+	size_t slot = hash_name(name, len) & (t->nslots - 1);
+	while (t->slots[slot] != 0) {
+		const size_t id = t->slots[slot] - 1;
+		if (t->names[id].len == len && memcmp(t->names[id].name, name, len) == 0)
+			break;
+		slot = (slot + 1) & (t->nslots - 1);
+	}
+	return (slot);
+}
+
+static void
+grow_slots(struct intern * const t)
+{
+	const size_t nslots = t->nslots == 0 ? 64 : t->nslots * 2;
+	free(t->slots);
+	t->slots = calloc(nslots, sizeof(*t->slots));
+	if (t->slots == NULL)
+		errx(1, "Out of memory");
+	t->nslots = nslots;
+	for (size_t id = 0; id < t->count; id++)
+		t->slots[find_slot(t, t->names[id].name, t->names[id].len)] = id + 1;
+}
+
+bool
+intern_find(const struct intern * const t, const char * const name, const size_t len, size_t * const id)
+{
+	if (t->nslots == 0)
+		return (false);
+	const size_t slot = find_slot(t, name, len);
+	if (t->slots[slot] == 0)
+		return (false);
+	*id = t->slots[slot] - 1;
+	return (true);
+}
+
+size_t
+intern_id(struct intern * const t, const char * const name, const size_t len)
+{
+	size_t id;
+	if (intern_find(t, name, len, &id))
+		return (id);
+
+	/* Keep the table at most half full. */
+	if ((t->count + 1) * 2 > t->nslots)
+		grow_slots(t);
+
+	FLEXARR_ALLOC(t->names, 1, t->count, t->alloc);
+	id = t->count - 1;
+	t->names[id] = (struct intern_name){
+		.name = arena_strndup(t->arena, name, len),
+		.len = len,
+	};
+	t->slots[find_slot(t, name, len)] = id + 1;
+	return (id);
+}
+
+void
+intern_free(struct intern * const t)
+{
+	free(t->slots);
+	FLEXARR_FREE(t->names, t->alloc);
+	*t = INTERN_INIT(t->arena);
+}
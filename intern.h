@@ -0,0 +1,56 @@
+#ifndef INCLUDED_INTERN_H
+#define INCLUDED_INTERN_H
+
+/*-
+ * Copyright (c) 2026  Peter Pentchev
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * intern - keep a single copy of each distinct string in an arena and
+ * refer to it by a small integer identifier
+ */
+
+struct intern_name {
+	const char	*name;
+	size_t		 len;
+};
+
+struct intern {
+	struct arena		*arena;
+	size_t			*slots;
+	size_t			 nslots;
+	struct intern_name	*names;
+	size_t			 count;
+	size_t			 alloc;
+};
+
+#define INTERN_INIT(a)	((struct intern){ .arena = (a), })
+
+size_t	 intern_id(struct intern *t, const char *name, size_t len);
+bool	 intern_find(const struct intern *t, const char *name, size_t len, size_t *id);
+void	 intern_free(struct intern *t);
+
+#define INTERN_NAME(t, id)	((t)->names[(id)].name)
+#define INTERN_LEN(t, id)	((t)->names[(id)].len)
+
+#endif
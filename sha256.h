@@ -0,0 +1,47 @@
+#ifndef INCLUDED_SHA256_H
+#define INCLUDED_SHA256_H
+
+/*-
+ * Copyright (c) 2026  Peter Pentchev
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * sha256 - compute the SHA-256 digest of a stream of data (FIPS 180-4)
+ */
+
+#define SHA256_SIZE		32
+#define SHA256_HEX_SIZE		(2 * SHA256_SIZE)
+
+struct sha256_ctx {
+	uint32_t	state[8];
+	uint64_t	total;
+	unsigned char	buf[64];
+	size_t		used;
+};
+
+void	sha256_init(struct sha256_ctx *ctx);
+void	sha256_update(struct sha256_ctx *ctx, const void *data, size_t len);
+void	sha256_final(struct sha256_ctx *ctx, unsigned char digest[SHA256_SIZE]);
+void	sha256_hex(const unsigned char digest[SHA256_SIZE], char hex[SHA256_HEX_SIZE + 1]);
+
+#endif
@@ -177,10 +177,11 @@ for my $cmd_in_filename_value (0, 1) {
 		};
 
 		subtest 'Initialize a database' => sub {
-			plan tests => 6;
+			plan tests => 7;
 			my @lines = get_ok_output([prog('db-init')], 'db-init');
 			is scalar @lines, 0, 'db-init did not return any output';
 			ok -f $dbidx, 'db-init created a database';
+			ok -f $dbdir->child('txn.modidx')->child('stamp'), 'db-init created a module index';
 			ok none_exist(0..$last_entry), 'db-init did not create any entries';
 			is_deeply [split_index], \@index_contents, 'db-init created an empty database';
 		};
@@ -337,8 +338,8 @@ for my $cmd_in_filename_value (0, 1) {
 			ok -f $src, 'install/recreate/bin did not remove the source file';
 			ok -f $tgt, 'install/recreate/bin created the target file';
 
-			ok none_exist(0, 2..$last_entry), 'install/recreate/bin did not create any entries';
-			ok all_exist(1), 'install/recreate/bin did not remove the second entry';
+			ok none_exist(0, 2, 4..$last_entry), 'install/recreate/bin did not create any unexpected entries';
+			ok all_exist(1, 3), 'install/recreate/bin saved the overwritten file';
 			index_add_line(\@index_contents, "shell create $tgt");
 			is_deeply [split_index], \@index_contents, 'install/recreate/bin updated the index';
 		};
@@ -355,8 +356,8 @@ for my $cmd_in_filename_value (0, 1) {
 
 			ok !$tgt->exists, 'remove/nonexistent did not create the target file';
 
-			ok none_exist(0, 2..$last_entry), 'remove/nonexistent did not create any entries';
-			ok all_exist(1), 'remove/nonexistent did not remove the second entry';
+			ok none_exist(0, 2, 4..$last_entry), 'remove/nonexistent did not create any entries';
+			ok all_exist(1, 3), 'remove/nonexistent did not remove the second entry';
 			is_deeply [split_index], \@index_contents, 'remove/nonexistent did not modify the index';
 		};
 
@@ -373,8 +374,8 @@ for my $cmd_in_filename_value (0, 1) {
 
 			ok !$tgt->exists, 'remove removed the target file';
 
-			ok none_exist(0, 2, 3, 5..$last_entry), 'remove/nonexistent did not create any unexpected entries';
-			ok all_exist(1, 4), 'remove/nonexistent created a fourth entry';
+			ok none_exist(0, 2, 5..$last_entry), 'remove/nonexistent did not create any unexpected entries';
+			ok all_exist(1, 3, 4), 'remove/nonexistent created a fourth entry';
 			index_add_line(\@index_contents, "removal remove $tgt");
 			is_deeply [split_index], \@index_contents, 'remove/nonexistent updated the index';
 		};
@@ -399,8 +400,8 @@ for my $cmd_in_filename_value (0, 1) {
 
 			ok -f $tgt, 'remove/inaccessible did not remove the target file';
 
-			ok none_exist(0, 2, 3, 5..$last_entry), 'remove/nonexistent did not create any entries';
-			ok all_exist(1, 4), 'remove/nonexistent did not remove any existing entries';
+			ok none_exist(0, 2, 5..$last_entry), 'remove/nonexistent did not create any entries';
+			ok all_exist(1, 3, 4), 'remove/nonexistent did not remove any existing entries';
 			is_deeply [split_index], \@index_contents, 'remove/nonexistent did not modify the index';
 		};
 
@@ -425,15 +426,15 @@ for my $cmd_in_filename_value (0, 1) {
 			ok @lines, 'install/inaccessible output some error messages';
 
 			ok -f $src, 'install/inaccessible did not remove the source file';
-			ok -f $tgt, 'install/inaccessible created the target file before failing';
+			ok ! -e $tgt, 'install/inaccessible did not leave the target file behind';
 
-			ok none_exist(0, 2, 3, 5..$last_entry), 'install/nonexistent did not create any entries';
-			ok all_exist(1, 4), 'install/nonexistent did not remove any existing entries';
+			ok none_exist(0, 2, 5..$last_entry), 'install/nonexistent did not create any entries';
+			ok all_exist(1, 3, 4), 'install/nonexistent did not remove any existing entries';
 			is_deeply [split_index], \@index_contents, 'install/nonexistent did not modify the index';
 		};
 
 		subtest 'Roll something back' => sub {
-			plan tests => 12;
+			plan tests => 14;
 
 			my $to_remove = $data->child('target-1.txt');
 			my $to_stay = $data->child('target-2.txt');
@@ -450,19 +451,27 @@ for my $cmd_in_filename_value (0, 1) {
 			ok -f $to_stay, 'the unaffected target is still there';
 			ok ! -f $to_stay_removed, 'the removed file is still not there';
 
-			ok none_exist(0..3, 5..$last_entry), 'rollback rolled back the patch entry';
-			ok all_exist(4), 'rollback did not remove any other entries';
+			ok none_exist(0..2, 5..$last_entry), 'rollback rolled back the patch entry';
+			ok all_exist(3, 4), 'rollback did not remove any other entries';
 			index_roll_module_back \@index_contents, 'something';
+			ok ! -e $dbdir->child('txn.modidx')->child('m.something'), 'rollback removed the module index file';
+			ok -f $dbdir->child('txn.modidx')->child('m.removal'), 'rollback did not remove another module index file';
 			is_deeply [split_index], \@index_contents, 'rollback updated the index';
 		};
 
 		subtest 'No something, just removal in modules' => sub {
-			plan tests => 6;
+			plan tests => 11;
 			my @lines = get_ok_output([prog('list-modules')], 'list-modules after rolling back');
 			is_deeply \@lines, ['shell', 'removal'], 'list-modules returned the single module name';
-			ok none_exist(0..3, 5..$last_entry), 'list-modules did not create any entries';
-			ok all_exist(4), 'rollback did not remove any entries';
+			ok none_exist(0..2, 5..$last_entry), 'list-modules did not create any entries';
+			ok all_exist(3, 4), 'rollback did not remove any entries';
 			is_deeply [split_index], \@index_contents, 'list-modules did not modify the database';
+
+			@lines = get_ok_output([prog('list-modules'), '--stats'], 'list-modules --stats after rolling back');
+			is scalar @lines, 2, 'list-modules --stats returned two lines';
+			like $lines[0], qr{^shell\t\d+\t\d+\t\d+\t\d+$}, 'list-modules --stats returned the shell module statistics';
+			my $size = (-s $dbdir->child('txn.000004')) + (-s $dbdir->child('txn.000004.data'));
+			is $lines[1], "removal\t0\t0\t1\t$size", 'list-modules --stats returned the removal module statistics';
 		};
 
 		subtest 'Try to remove the same module again' => sub {
@@ -483,8 +492,8 @@ for my $cmd_in_filename_value (0, 1) {
 			ok -f $to_stay, 'the unaffected target is still there';
 			ok ! -f $to_stay_removed, 'the removed file is still not there';
 
-			ok none_exist(0..3, 5..$last_entry), 'rollback did not create any entries';
-			ok all_exist(4), 'rollback did not remove any entries';
+			ok none_exist(0..2, 5..$last_entry), 'rollback did not create any entries';
+			ok all_exist(3, 4), 'rollback did not remove any entries';
 			is_deeply [split_index], \@index_contents, 'rollback did not modify the index';
 		};
 
@@ -506,7 +515,7 @@ for my $cmd_in_filename_value (0, 1) {
 			ok -f $to_stay, 'the unaffected target is still there';
 			ok -f $to_reappear, 'the rollback target reappeared';
 
-			ok none_exist(0..$last_entry), 'rollback removed the file removal entry';
+			ok none_exist(0..2, 4..$last_entry), 'rollback removed the file removal entry';
 			index_roll_module_back \@index_contents, 'removal';
 			is_deeply [split_index], \@index_contents, 'rollback did not modify the index';
 		};
@@ -520,7 +529,7 @@ for my $cmd_in_filename_value (0, 1) {
 			ok ! -e $data->child('nonexistent'), 'install-exact/nonexistent did not create a nonexistent source file';
 			ok ! -e $data->child('target'), 'install-exact/nonexistent did not create the target';
 
-			ok none_exist(0..$last_entry), 'install-exact/nonexistent did not create any new entries';
+			ok none_exist(0..2, 4..$last_entry), 'install-exact/nonexistent did not create any new entries';
 			is_deeply [split_index], \@index_contents, 'install-exact/nonexistent did not modify the database';
 		};
 
@@ -543,7 +552,7 @@ for my $cmd_in_filename_value (0, 1) {
 			ok @sbuf, 'install-exact/create actually created the target file';
 			is $sbuf[2] & 03777, 0602, 'install-exact/create set the correct permissions mode';
 
-			ok none_exist(0..$last_entry), 'install-exact/create did not create any entries';
+			ok none_exist(0..2, 4..$last_entry), 'install-exact/create did not create any entries';
 			index_add_line(\@index_contents, "something create $tgt");
 			is_deeply [split_index], \@index_contents, 'install-exact/create updated the index';
 		};
@@ -567,7 +576,7 @@ for my $cmd_in_filename_value (0, 1) {
 			ok @sbuf, 'install-exact/same actually created the target file';
 			is $sbuf[2] & 03777, 0704, 'install-exact/same set the correct permissions mode';
 
-			ok none_exist(0..$last_entry), 'install-exact/same did not create any entries';
+			ok none_exist(0..2, 4..$last_entry), 'install-exact/same did not create any entries';
 			is_deeply [split_index], \@index_contents, 'install-exact/same did not modify the index';
 		};
 	};
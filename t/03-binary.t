@@ -0,0 +1,107 @@
+#!/usr/bin/perl
+#
+# Copyright (c) 2026  Peter Pentchev
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+# OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+use v5.010;
+use strict;
+use warnings;
+
+use FindBin;
+use Test::More;
+
+use lib "$FindBin::Bin/lib";
+use Test::Txn;
+
+plan tests => 8;
+
+my ($tempd, $dbdir, $dbidx, $data) = setup_db();
+
+subtest 'Create a binary database' => sub {
+	plan tests => 4;
+	my @lines = get_ok_output([$prog, 'db-init', '-f', 'binary'], 'db-init -f binary');
+	is scalar @lines, 0, 'db-init did not output anything';
+	is substr($dbidx->slurp_raw, 0, 8), "TXN-IDX\n", 'db-init created a binary index';
+};
+
+my $src = $tempd->child('source.txt');
+my $tgt = $data->child('source.txt');
+my $removed = $data->child('removed.txt');
+
+subtest 'Record some changes' => sub {
+	plan tests => 8;
+	$src->spew_utf8("a\nb\nc\n");
+	$ENV{'TXN_INSTALL_MODULE'} = 'first';
+	get_ok_output([$prog, 'install', '-m', '644', $src, $data], 'install a new file');
+
+	$src->spew_utf8("a\nB\nc\n");
+	$ENV{'TXN_INSTALL_MODULE'} = 'second';
+	get_ok_output([$prog, 'install', '-m', '644', $src, $data], 'modify the file');
+
+	$removed->spew_utf8("removed\n");
+	$ENV{'TXN_INSTALL_MODULE'} = 'third';
+	get_ok_output([$prog, 'remove', $removed], 'remove a file');
+	is $tgt->slurp_utf8, "a\nB\nc\n", 'the file was modified';
+	ok ! -e $removed, 'the file was removed';
+};
+
+subtest 'Examine the binary database' => sub {
+	plan tests => 6;
+	my @lines = get_ok_output([$prog, 'list-modules'], 'list-modules');
+	is_deeply \@lines, [qw(first second third)], 'list-modules returned the modules';
+	@lines = get_ok_output([$prog, 'db-dump'], 'db-dump');
+	is_deeply \@lines, [
+		"000000 first create $tgt",
+		"000001 second patch $tgt",
+		"000002 third remove $removed",
+		'000003',
+	], 'db-dump returned the entries';
+};
+
+subtest 'Roll a module back' => sub {
+	plan tests => 7;
+	my @lines = get_ok_output([$prog, 'rollback', 'second'], 'rollback');
+	is scalar @lines, 0, 'rollback did not output anything';
+	is $tgt->slurp_utf8, "a\nb\nc\n", 'rollback reverted the change';
+	@lines = get_ok_output([$prog, 'db-dump'], 'db-dump');
+	is $lines[1], "000001 second unpatch $tgt", 'rollback marked the entry as undone';
+};
+
+my @dump = get_ok_output([$prog, 'db-dump'], 'db-dump before converting');
+
+subtest 'Convert to the text format' => sub {
+	plan tests => 4;
+	my @lines = get_ok_output([$prog, 'db-convert', 'text'], 'db-convert text');
+	is scalar @lines, 0, 'db-convert did not output anything';
+	is_deeply [split /\n/, $dbidx->slurp_utf8], \@dump, 'db-convert wrote out the text index';
+};
+
+subtest 'Convert back to the binary format' => sub {
+	plan tests => 7;
+	my @lines = get_ok_output([$prog, 'db-convert', 'binary'], 'db-convert binary');
+	is scalar @lines, 0, 'db-convert did not output anything';
+	is substr($dbidx->slurp_raw, 0, 8), "TXN-IDX\n", 'db-convert wrote out a binary index';
+	@lines = get_ok_output([$prog, 'db-dump'], 'db-dump');
+	is_deeply \@lines, \@dump, 'the converted index has the same entries';
+};
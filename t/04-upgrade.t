@@ -0,0 +1,106 @@
+#!/usr/bin/perl
+#
+# Copyright (c) 2026  Peter Pentchev
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+# OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+use v5.010;
+use strict;
+use warnings;
+
+use FindBin;
+use Test::Command;
+use Test::More;
+
+use lib "$FindBin::Bin/lib";
+use Test::Txn;
+
+plan tests => 5;
+
+my ($tempd, $dbdir, $dbidx, $data) = setup_db(create => 1);
+
+my $src = $tempd->child('source.txt');
+$src->spew_utf8("source\n");
+my $tgt = $data->child('source.txt');
+
+subtest 'Upgrade an index that is about to run out of serial numbers' => sub {
+	plan tests => 4;
+	$dbidx->spew_utf8("900000\n");
+	$ENV{'TXN_INSTALL_MODULE'} = 'wide';
+	get_ok_output([$prog, 'install', '-m', '644', $src, $data], 'install');
+	ok -f $tgt, 'the file was installed';
+	is_deeply [split /\n/, $dbidx->slurp_utf8], [
+		'txn-index 2',
+		"000000900000 wide create $tgt",
+		'000000900001',
+	], 'the index was upgraded';
+};
+
+subtest 'Roll back using the upgraded index' => sub {
+	plan tests => 5;
+	my @lines = get_ok_output([$prog, 'rollback', 'wide'], 'rollback');
+	is scalar @lines, 0, 'rollback did not output anything';
+	ok ! -e $tgt, 'the file was removed';
+	my $fname = substr $tgt, 2;
+	is_deeply [split /\n/, $dbidx->slurp_utf8], [
+		'txn-index 2',
+		"000000900000 wide uncreate $fname",
+		'000000900001',
+	], 'the entry was marked as undone';
+};
+
+subtest 'Compact the index after the rollback' => sub {
+	plan tests => 5;
+	my $fname = substr $tgt, 2;
+	my $stale = $dbdir->child('txn.000042');
+	$stale->spew_utf8("stale\n");
+	my @lines = get_ok_output([$prog, 'db-compact'], 'db-compact');
+	is_deeply \@lines, [
+		'index: 1 entries, '.length("000000900000 wide uncreate $fname\n").' bytes reclaimed',
+		'artifacts: 1 files, 6 bytes reclaimed',
+	], 'db-compact reported the reclaimed space';
+	ok ! -e $stale, 'the stale artifact was removed';
+	is_deeply [split /\n/, $dbidx->slurp_utf8], [
+		'txn-index 2',
+		'000000900001',
+	], 'the undone entry was dropped';
+};
+
+subtest 'Upgrade an index explicitly' => sub {
+	plan tests => 3;
+	$dbidx->spew_utf8("000000 something create $tgt\n000001\n");
+	get_ok_output([$prog, 'db-upgrade'], 'db-upgrade');
+	is_deeply [split /\n/, $dbidx->slurp_utf8], [
+		'txn-index 2',
+		"000000000000 something create $tgt",
+		'000000000001',
+	], 'db-upgrade upgraded the index';
+};
+
+subtest 'Refuse an unknown index version' => sub {
+	plan tests => 2;
+	$dbidx->spew_utf8("txn-index 42\n");
+	my $c = Test::Command->new(cmd => [$prog, 'list-modules']);
+	$c->exit_isnt_num(0, 'list-modules failed');
+	$c->stdout_is_eq('', 'list-modules did not output anything');
+};
@@ -0,0 +1,108 @@
+#!/usr/bin/perl
+#
+# Copyright (c) 2026  Peter Pentchev
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+# OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+use v5.010;
+use strict;
+use warnings;
+
+use FindBin;
+use Test::Command;
+use Test::More;
+
+use lib "$FindBin::Bin/lib";
+use Test::Txn;
+
+plan tests => 3;
+
+my ($tempd, $dbdir, $dbidx, $data) = setup_db(create => 1);
+
+my $src1 = $tempd->child('one.txt');
+$src1->spew_utf8("one\n");
+my $src2 = $tempd->child('two.txt');
+$src2->spew_utf8("two\n");
+my $patched = $data->child('patched.txt');
+my $removed = $data->child('removed.txt');
+my $manifest = $tempd->child('manifest');
+
+subtest 'Perform a batch of operations' => sub {
+	plan tests => 7;
+	$patched->spew_utf8("original\n");
+	$removed->spew_utf8("removed\n");
+	$manifest->spew_utf8(<<"EOMANIFEST");
+# Some files for the first module
+install first -m 644 $src1 $src2 $data
+
+install-exact second $src1 $patched
+remove third $removed
+EOMANIFEST
+	my @lines = get_ok_output([$prog, 'batch', $manifest], 'batch');
+	is scalar @lines, 0, 'batch did not output anything';
+	ok -f $data->child('one.txt') && -f $data->child('two.txt'),
+	    'the files were installed';
+	is $patched->slurp_utf8, "one\n", 'the file was patched';
+	ok ! -e $removed, 'the file was removed';
+	is_deeply [split /\n/, $dbidx->slurp_utf8], [
+		"000000 first create $data/one.txt",
+		"000001 first create $data/two.txt",
+		"000002 second patch $patched",
+		"000003 third remove $removed",
+		'000004',
+	], 'the operations were recorded';
+};
+
+subtest 'Check a batch before changing anything' => sub {
+	plan tests => 5;
+	my $idx = $dbidx->slurp_utf8;
+	$manifest->spew_utf8(<<"EOMANIFEST");
+install fourth $src2 $patched
+install fourth $src2 $data/three.txt
+install fourth $tempd/nonexistent $data
+EOMANIFEST
+	my $c = Test::Command->new(cmd => [$prog, 'batch', $manifest]);
+	$c->exit_isnt_num(0, 'batch failed');
+	$c->stdout_is_eq('', 'batch did not output anything');
+	is $patched->slurp_utf8, "one\n", 'the patch was reverted';
+	ok ! -e $data->child('three.txt'), 'the new file was removed';
+	is $dbidx->slurp_utf8, $idx, 'the index was restored';
+};
+
+subtest 'Revert a batch that fails halfway' => sub {
+	plan tests => 5;
+	my $idx = $dbidx->slurp_utf8;
+	my $gone = $data->child('gone.txt');
+	$gone->spew_utf8("gone\n");
+	$manifest->spew_utf8(<<"EOMANIFEST");
+install fourth $src2 $patched
+remove fourth $gone
+remove fourth $gone
+EOMANIFEST
+	my $c = Test::Command->new(cmd => [$prog, 'batch', $manifest]);
+	$c->exit_isnt_num(0, 'batch failed');
+	$c->stdout_is_eq('', 'batch did not output anything');
+	is $patched->slurp_utf8, "one\n", 'the patch was reverted';
+	is $gone->slurp_utf8, "gone\n", 'the removed file was restored';
+	is $dbidx->slurp_utf8, $idx, 'the index was restored';
+};
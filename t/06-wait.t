@@ -0,0 +1,83 @@
+#!/usr/bin/perl
+#
+# Copyright (c) 2026  Peter Pentchev
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+# OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+use v5.010;
+use strict;
+use warnings;
+
+use Fcntl qw(:flock);
+use FindBin;
+use Test::Command;
+use Test::More;
+
+use lib "$FindBin::Bin/lib";
+use Test::Txn;
+
+plan tests => 6;
+
+my (undef, $dbdir, $dbidx) = setup_db();
+delete $ENV{'TXN_INSTALL_WAIT'};
+
+get_ok_output([$prog, 'db-init'], 'db-init');
+open my $lock, '+<', $dbidx or die "Could not open $dbidx: $!\n";
+flock $lock, LOCK_EX or die "Could not lock $dbidx: $!\n";
+
+subtest 'Fail right away if the database is locked' => sub {
+	plan tests => 2;
+	my $c = Test::Command->new(cmd => [$prog, 'rollback', 'nothing']);
+	$c->exit_isnt_num(0, 'rollback failed');
+	$c->stderr_like(qr/Could not lock/, 'rollback complained about the lock');
+};
+
+subtest 'Read the database without locking it' => sub {
+	plan tests => 3;
+	my @lines = get_ok_output([$prog, 'db-dump'], 'db-dump');
+	is_deeply \@lines, ['000000'], 'db-dump read the index';
+};
+
+subtest 'Time out waiting for the lock' => sub {
+	plan tests => 2;
+	my $c = Test::Command->new(cmd => [$prog, '--wait=1', 'rollback', 'nothing']);
+	$c->exit_isnt_num(0, 'rollback failed');
+	$c->stderr_like(qr/Timed out after 1 seconds/, 'rollback timed out');
+};
+
+subtest 'Wait for the lock to be released' => sub {
+	plan tests => 3;
+	my $pid = fork;
+	die "Could not fork: $!\n" unless defined $pid;
+	if ($pid == 0) {
+		select undef, undef, undef, 0.5;
+		flock $lock, LOCK_UN;
+		exit 0;
+	}
+	close $lock;
+	my $c = Test::Command->new(cmd => [$prog, '--wait', 'rollback', 'nothing']);
+	$c->exit_is_num(0, 'rollback succeeded');
+	$c->stdout_is_eq('', 'rollback did not output anything');
+	$c->stderr_like(qr/Waited [0-9.]+ seconds/, 'rollback reported the wait');
+	waitpid $pid, 0;
+};
@@ -0,0 +1,129 @@
+#!/usr/bin/perl
+#
+# Copyright (c) 2026  Peter Pentchev
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+# OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+use v5.010;
+use strict;
+use warnings;
+
+use FindBin;
+use Path::Tiny;
+use Test::Command;
+use Test::More;
+
+use lib "$FindBin::Bin/lib";
+use Test::Txn;
+
+plan tests => 4;
+
+my ($tempd, $dbdir, $dbidx, $data) = setup_db(create => 1);
+
+$ENV{'TXN_INSTALL_MODULE'} = 'parallel';
+$ENV{'TXN_INSTALL_JOBS'} = 4;
+
+my $srcdir = $tempd->child('src');
+my $other = $tempd->child('other');
+$_->mkpath({ mode => 0755 }) for $srcdir, $other;
+my @names = map { sprintf 'file-%02d.txt', $_ } 0..19;
+for my $name (@names) {
+	$srcdir->child($name)->spew_utf8("new $name\n");
+	$data->child($name)->spew_utf8("old $name\n") if $name =~ /[02468]\.txt$/;
+}
+$other->child('file-03.txt')->spew_utf8("newer file-03.txt\n");
+
+subtest 'Install several files in parallel' => sub {
+	plan tests => 6;
+	my @lines = get_ok_output([$prog, 'install', '-m', '644',
+	    (map { $srcdir->child($_) } @names), $other->child('file-03.txt'),
+	    $data], 'install');
+	is scalar @lines, 0, 'install did not output anything';
+	is $data->child('file-03.txt')->slurp_utf8, "newer file-03.txt\n",
+	    'the same destination was installed twice in order';
+	my @expected = map {
+		my $action = /[02468]\.txt$/ ? 'patch' : 'create';
+		"parallel $action $data/$_"
+	} @names;
+	push @expected, "parallel patch $data/file-03.txt";
+	my @idx = split /\n/, $dbidx->slurp_utf8;
+	is_deeply [map { s/^[0-9]+ //r } @idx[0..$#idx - 1]], \@expected,
+	    'the files were recorded in order';
+	is_deeply [map { /^([0-9]+)/ } @idx], [map { sprintf '%06d', $_ } 0..21],
+	    'the serial numbers are contiguous';
+};
+
+subtest 'Roll the parallel installation back' => sub {
+	plan tests => 5;
+	my @lines = get_ok_output([$prog, 'rollback', 'parallel'], 'rollback');
+	is scalar @lines, 0, 'rollback did not output anything';
+	is_deeply [sort map { $_->basename } $data->children], [grep { /[02468]\.txt$/ } @names],
+	    'only the files that existed before are left';
+	is $data->child('file-04.txt')->slurp_utf8, "old file-04.txt\n",
+	    'the patched files were reverted';
+};
+
+subtest 'A failed rollback of one file does not stop the others' => sub {
+	plan tests => 10;
+	$ENV{'TXN_INSTALL_MODULE'} = 'partial';
+	$data->child('file-02.txt')->spew_utf8("second file-02.txt\n");
+	$data->child('file-04.txt')->spew_utf8("second file-04.txt\n");
+	my @lines = get_ok_output([$prog, 'install', '-m', '644',
+	    $srcdir->child('file-02.txt'), $srcdir->child('file-04.txt'),
+	    $data], 'install');
+	is scalar @lines, 0, 'install did not output anything';
+
+	$data->child('file-02.txt')->spew_utf8("something else entirely\n");
+	my $c = Test::Command->new(cmd => [$prog, 'rollback', 'partial']);
+	$c->exit_isnt_num(0, 'rollback failed');
+	is $data->child('file-04.txt')->slurp_utf8, "second file-04.txt\n",
+	    'the other file was reverted';
+	my @idx = grep { / partial / } split /\n/, $dbidx->slurp_utf8;
+	is_deeply [map { (split / /)[2] } @idx], [qw(patch unpatch)],
+	    'only the reverted file was marked as undone';
+
+	$data->child('file-02.txt')->spew_utf8("new file-02.txt\n");
+	@lines = get_ok_output([$prog, 'rollback', 'partial'], 'rollback again');
+	is scalar @lines, 0, 'the second rollback did not output anything';
+	is $data->child('file-02.txt')->slurp_utf8, "second file-02.txt\n",
+	    'the first file was reverted the second time';
+};
+
+subtest 'The changes to a file are reverted in order however it was named' => sub {
+	plan tests => 11;
+	$ENV{'TXN_INSTALL_MODULE'} = 'spelling';
+	$other->child('file-06.txt')->spew_utf8("newer file-06.txt\n");
+	my @lines = get_ok_output([$prog, 'install', '-m', '644',
+	    $srcdir->child('file-06.txt'), "$data/"], 'install');
+	is scalar @lines, 0, 'install did not output anything';
+	@lines = get_ok_output([$prog, 'install', '-m', '644',
+	    $other->child('file-06.txt'), "$data/./"], 'install again');
+	is scalar @lines, 0, 'the second install did not output anything';
+	is $data->child('file-06.txt')->slurp_utf8, "newer file-06.txt\n",
+	    'the file was installed twice';
+
+	@lines = get_ok_output([$prog, 'rollback', 'spelling'], 'rollback');
+	is scalar @lines, 0, 'rollback did not output anything';
+	is $data->child('file-06.txt')->slurp_utf8, "old file-06.txt\n",
+	    'both changes were reverted';
+};
@@ -0,0 +1,132 @@
+#!/usr/bin/perl
+#
+# Copyright (c) 2026  Peter Pentchev
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+# OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+use v5.010;
+use strict;
+use warnings;
+
+use FindBin;
+use Test::More;
+
+use lib "$FindBin::Bin/lib";
+use Test::Txn;
+
+# The inode number and the link count of a file.
+sub inode($) {
+	my ($fname) = @_;
+	my @st = stat "$fname" or die "Could not examine $fname: $!\n";
+	return ($st[1], $st[3]);
+}
+
+sub blobs($) {
+	my ($dbdir) = @_;
+	return sort map { $_->children } grep { $_->is_dir } $dbdir->child('txn.blobs')->children;
+}
+
+plan tests => 4;
+
+my ($tempd, $dbdir, undef, $data) = setup_db();
+
+my @removed = map { $data->child("vendor-$_.conf") } 1..3;
+my @patched = map { $data->child("patched-$_.txt") } 1..2;
+my $src = $tempd->child('new.txt');
+$src->spew_utf8("line 1\nnew line 2\n");
+
+subtest 'Store identical artifacts once' => sub {
+	plan tests => 17;
+	my @lines = get_ok_output([$prog, 'db-init', '--dedup'], 'db-init --dedup');
+	is scalar @lines, 0, 'db-init did not output anything';
+	ok -d $dbdir->child('txn.blobs'), 'db-init created the blob store';
+
+	$_->spew_utf8("the same vendor file\n") for @removed;
+	chmod 0640, $removed[0];
+	$_->spew_utf8("line 1\nline 2\n") for @patched;
+	$ENV{'TXN_INSTALL_MODULE'} = 'first';
+	for my $fname (@removed[0..1]) {
+		@lines = get_ok_output([$prog, 'remove', $fname], 'remove');
+	}
+	$ENV{'TXN_INSTALL_MODULE'} = 'second';
+	@lines = get_ok_output([$prog, 'remove', $removed[2]], 'remove');
+	for my $fname (@patched) {
+		@lines = get_ok_output([$prog, 'install', $src, $fname], 'install');
+	}
+
+	my @blobs = blobs $dbdir;
+	is scalar @blobs, 2, 'only two blobs were stored';
+	my ($ino, $nlink) = inode $dbdir->child('txn.000000.data');
+	is_deeply [map { [inode $dbdir->child("txn.00000$_.data")] } 1..2],
+	    [[$ino, $nlink], [$ino, $nlink]], 'the removed files share a blob';
+	is $nlink, 4, 'the blob has a link for each removed file';
+};
+
+subtest 'Roll back from the blob store' => sub {
+	plan tests => 8;
+	my @lines = get_ok_output([$prog, 'rollback', 'first'], 'rollback first');
+	is $removed[0]->slurp_utf8, "the same vendor file\n",
+	    'the removed file was restored';
+	is sprintf('%o', (stat "$removed[0]")[2] & 07777), '640',
+	    'the removed file metadata was restored';
+	is +(inode $dbdir->child('txn.000002.data'))[1], 2,
+	    'the blob is still there for the other module';
+
+	@lines = get_ok_output([$prog, 'rollback', 'second'], 'rollback second');
+	is $patched[1]->slurp_utf8, "line 1\nline 2\n", 'the patched file was reverted';
+};
+
+subtest 'Compact the blob store' => sub {
+	plan tests => 4;
+	my $stale = $dbdir->child('txn.blobs', 'tmp.stale');
+	$stale->spew_utf8("stale\n");
+	my @lines = get_ok_output([$prog, 'db-compact'], 'db-compact');
+	is_deeply [blobs $dbdir], [], 'no blobs are left';
+	ok ! -e $stale, 'the leftover temporary file was removed';
+};
+
+subtest 'Convert an existing database' => sub {
+	plan tests => 15;
+	my $legacy = $tempd->child('legacy');
+	$ENV{'TXN_INSTALL_DB'} = $legacy;
+	$ENV{'TXN_INSTALL_MODULE'} = 'legacy';
+	$_->spew_utf8("the same vendor file\n") for @removed;
+	my @lines;
+	for my $fname (@removed[0..1]) {
+		@lines = get_ok_output([$prog, 'remove', $fname], 'remove');
+	}
+	ok ! -e $legacy->child('txn.blobs'), 'no blob store by default';
+
+	@lines = get_ok_output([$prog, 'db-dedup'], 'db-dedup');
+	is_deeply \@lines, ['artifacts: 2 files, 21 bytes reclaimed'],
+	    'db-dedup reported the reclaimed space';
+	is_deeply [map { [inode $legacy->child("txn.00000$_.data")] } 0..1],
+	    [[inode $legacy->child('txn.000000.data')], [inode $legacy->child('txn.000000.data')]],
+	    'the converted artifacts share a blob';
+
+	@lines = get_ok_output([$prog, 'rollback', 'legacy'], 'rollback');
+	is $removed[1]->slurp_utf8, "the same vendor file\n",
+	    'the converted removed file was restored';
+	@lines = get_ok_output([$prog, 'db-compact'], 'db-compact');
+	is_deeply [blobs $legacy], [], 'no blobs are left';
+};
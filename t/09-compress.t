@@ -0,0 +1,111 @@
+#!/usr/bin/perl
+#
+# Copyright (c) 2026  Peter Pentchev
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+# OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+use v5.010;
+use strict;
+use warnings;
+
+use FindBin;
+use Test::Command;
+use Test::More;
+
+use lib "$FindBin::Bin/lib";
+use Test::Txn;
+
+sub read_raw($) {
+	my ($fname) = @_;
+	open my $f, '<:raw', "$fname" or die "Could not open $fname: $!\n";
+	local $/;
+	return scalar <$f>;
+}
+
+plan tests => 4;
+
+my ($tempd, $dbdir, undef, $data) = setup_db(create => 1);
+$ENV{'TXN_INSTALL_MODULE'} = 'compress';
+
+my $orig = join '', map { "line $_\n" } 1..2000;
+my $changed = $orig =~ s/^line 1000$/changed line/mr;
+my $patched = $data->child('patched.txt');
+my $removed = $data->child('removed.txt');
+my $magic = $data->child('magic.bin');
+my $magic_data = "TXN-CMP\n\x01not really compressed";
+my $src = $tempd->child('source.txt');
+$src->spew_utf8($changed);
+
+subtest 'Store compressed artifacts' => sub {
+	plan tests => 12;
+	$patched->spew_utf8($orig);
+	$removed->spew_utf8($orig);
+	$magic->spew_raw($magic_data);
+
+	local $ENV{'TXN_INSTALL_COMPRESS'} = 'zlib';
+	my @lines = get_ok_output([$prog, 'install', $src, $patched], 'install');
+	@lines = get_ok_output([$prog, 'remove', $removed], 'remove');
+	{
+		local $ENV{'TXN_INSTALL_COMPRESS'} = 'none';
+		@lines = get_ok_output([$prog, 'remove', $magic], 'remove');
+	}
+
+	my $patch = read_raw $dbdir->child('txn.000000');
+	is substr($patch, 0, 9), "TXN-CMP\n\x01", 'the patch was compressed';
+	my $backup = read_raw $dbdir->child('txn.000001');
+	ok length($backup) < length($orig) / 2,
+	    'the removed file was compressed';
+	my $plain = read_raw $dbdir->child('txn.000002');
+	is substr($plain, -(9 + length $magic_data)), "TXN-CMP\n\x00$magic_data",
+	    'a file that looks compressed got an uncompressed data header';
+	is $patched->slurp_utf8, $changed, 'the file was patched';
+	ok ! -e $removed, 'the file was removed';
+	ok ! -e $magic, 'the other file was removed';
+};
+
+subtest 'Roll the compressed artifacts back' => sub {
+	plan tests => 5;
+	my @lines = get_ok_output([$prog, 'rollback', 'compress'], 'rollback');
+	is $patched->slurp_utf8, $orig, 'the patched file was reverted';
+	is $removed->slurp_utf8, $orig, 'the removed file was restored';
+	is read_raw $magic, $magic_data, 'the other removed file was restored';
+};
+
+subtest 'Roll back a compressed patch using patch(1)' => sub {
+	plan tests => 6;
+	local $ENV{'TXN_INSTALL_COMPRESS'} = 'zlib';
+	my @lines = get_ok_output([$prog, 'install', $src, $patched], 'install');
+	is $patched->slurp_utf8, $changed, 'the file was patched';
+	local $ENV{'TXN_INSTALL_PATCH'} = 'patch';
+	@lines = get_ok_output([$prog, 'rollback', 'compress'], 'rollback');
+	is $patched->slurp_utf8, $orig, 'the patched file was reverted';
+};
+
+subtest 'Reject an invalid compression method' => sub {
+	plan tests => 3;
+	local $ENV{'TXN_INSTALL_COMPRESS'} = 'lzw';
+	my $c = Test::Command->new(cmd => [$prog, 'remove', $patched]);
+	$c->exit_isnt_num(0, 'remove failed');
+	$c->stderr_like(qr/TXN_INSTALL_COMPRESS/, 'remove complained about the setting');
+	is $patched->slurp_utf8, $orig, 'the file was not removed';
+};
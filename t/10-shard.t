@@ -0,0 +1,128 @@
+#!/usr/bin/perl
+#
+# Copyright (c) 2026  Peter Pentchev
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+# OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+use v5.010;
+use strict;
+use warnings;
+
+use FindBin;
+use Path::Tiny;
+use Test::More;
+
+use lib "$FindBin::Bin/lib";
+use Test::Txn;
+# The artifact files in the database directory itself.
+sub flat($) {
+	my ($dbdir) = @_;
+	return sort map { $_->basename } grep { $_->basename =~ /^txn\.\d+/ } $dbdir->children;
+}
+
+# The artifact files in the sharded layout, relative to the shards directory.
+sub sharded($) {
+	my ($dbdir) = @_;
+	my $shards = $dbdir->child('txn.shards');
+	return sort map { my $leaf = $_; map { $_->basename } $leaf->children }
+	    map { $_->children } $shards->children;
+}
+
+plan tests => 4;
+
+my ($tempd, $dbdir, undef, $data) = setup_db();
+$ENV{'TXN_INSTALL_MODULE'} = 'shard';
+
+my $removed = $data->child('vendor.conf');
+my $patched = $data->child('patched.txt');
+my $src = $tempd->child('new.txt');
+$src->spew_utf8("line 1\nnew line 2\n");
+
+subtest 'Store the artifacts in the sharded layout' => sub {
+	plan tests => 11;
+	my @lines = get_ok_output([$prog, 'db-init', '--sharded'], 'db-init --sharded');
+	is scalar @lines, 0, 'db-init did not output anything';
+	ok -d $dbdir->child('txn.shards'), 'db-init created the shards directory';
+
+	$removed->spew_utf8("a vendor file\n");
+	$patched->spew_utf8("line 1\nline 2\n");
+	@lines = get_ok_output([$prog, 'remove', $removed], 'remove');
+	@lines = get_ok_output([$prog, 'install', $src, $patched], 'install');
+	is_deeply [flat $dbdir], [], 'no artifacts in the database directory';
+	ok -f $dbdir->child('txn.shards', '000', '000', 'txn.000000'),
+	    'the removed file was stored in the first shard';
+	ok -f $dbdir->child('txn.shards', '000', '000', 'txn.000001'),
+	    'the patch was stored in the first shard';
+};
+
+subtest 'Roll back from the sharded layout' => sub {
+	plan tests => 7;
+	my @lines = get_ok_output([$prog, 'rollback', 'shard'], 'rollback');
+	is $removed->slurp_utf8, "a vendor file\n", 'the removed file was restored';
+	is $patched->slurp_utf8, "line 1\nline 2\n", 'the patched file was reverted';
+
+	@lines = get_ok_output([$prog, 'db-compact'], 'db-compact');
+	is_deeply [$dbdir->child('txn.shards')->children], [],
+	    'db-compact removed the empty shard directories';
+};
+
+subtest 'Migrate an existing database' => sub {
+	plan tests => 15;
+	my $legacy = $tempd->child('legacy');
+	$ENV{'TXN_INSTALL_DB'} = $legacy;
+	$removed->spew_utf8("a vendor file\n");
+	my @lines = get_ok_output([$prog, 'remove', $removed], 'remove');
+	@lines = get_ok_output([$prog, 'install', $src, $patched], 'install');
+	is_deeply [flat $legacy], ['txn.000000', 'txn.000000.data', 'txn.000001'],
+	    'the artifacts are in the database directory by default';
+
+	# A stale link left over by an interrupted migration.
+	my $stale = $legacy->child('txn.shards.new', '000', '000');
+	$stale->mkpath({ mode => 0755 });
+	$stale->child('txn.000000')->spew_utf8("stale\n");
+
+	@lines = get_ok_output([$prog, 'db-shard'], 'db-shard');
+	is_deeply \@lines, ['artifacts: 3 files moved'], 'db-shard reported the moved files';
+	is_deeply [flat $legacy], [], 'no artifacts left in the database directory';
+	is_deeply [sharded $legacy], ['txn.000000', 'txn.000000.data', 'txn.000001'],
+	    'the artifacts were moved into the sharded layout';
+	ok ! -e $legacy->child('txn.shards.new'), 'the new layout was put in place';
+
+	@lines = get_ok_output([$prog, 'rollback', 'shard'], 'rollback');
+	is $removed->slurp_utf8, "a vendor file\n", 'the removed file was restored';
+	is $patched->slurp_utf8, "line 1\nline 2\n", 'the patched file was reverted';
+};
+
+subtest 'Finish an interrupted migration' => sub {
+	plan tests => 7;
+	my $legacy = $tempd->child('legacy');
+	my @lines = get_ok_output([$prog, 'remove', $removed], 'remove');
+	my $moved = $legacy->child('txn.shards', '000', '000', 'txn.000002');
+	ok -f $moved, 'the removed file was stored in the sharded layout';
+
+	# The database directory was not cleaned up after the rename.
+	link "$moved", $legacy->child('txn.000002') or die "Could not link $moved: $!\n";
+	@lines = get_ok_output([$prog, 'db-shard'], 'db-shard');
+	is_deeply [flat $legacy], [], 'the leftover artifact was removed';
+	ok -f $moved, 'the moved artifact is still there';
+};
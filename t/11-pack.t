@@ -0,0 +1,107 @@
+#!/usr/bin/perl
+#
+# Copyright (c) 2026  Peter Pentchev
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+# OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+use v5.010;
+use strict;
+use warnings;
+
+use FindBin;
+use Test::Command;
+use Test::More;
+
+use lib "$FindBin::Bin/lib";
+use Test::Txn;
+sub segments($) {
+	my ($dbdir) = @_;
+	return sort map { $_->basename } grep { $_->basename =~ /^pack\./ }
+	    $dbdir->child('txn.pack')->children;
+}
+
+plan tests => 4;
+
+my ($tempd, $dbdir, undef, $data) = setup_db();
+$ENV{'TXN_INSTALL_MODULE'} = 'pack';
+
+my @removed = map { $data->child("vendor-$_.conf") } 1..3;
+my $patched = $data->child('patched.txt');
+my $src = $tempd->child('new.txt');
+$src->spew_utf8("line 1\nnew line 2\n");
+
+subtest 'Append the artifacts to a pack segment' => sub {
+	plan tests => 17;
+	my @lines = get_ok_output([$prog, 'db-init', '--pack'], 'db-init --pack');
+	is scalar @lines, 0, 'db-init did not output anything';
+	ok -f $dbdir->child('txn.pack', 'locations'), 'db-init created the location table';
+
+	$removed[$_]->spew_utf8("vendor file $_\n" x 10) for 0..$#removed;
+	$patched->spew_utf8("line 1\nline 2\n");
+	for my $fname (@removed) {
+		@lines = get_ok_output([$prog, 'remove', $fname], 'remove');
+	}
+	@lines = get_ok_output([$prog, 'install', $src, $patched], 'install');
+	is_deeply [segments $dbdir], ['pack.000000'], 'a single pack segment was created';
+	is_deeply [grep { $_->basename =~ /^txn\.\d+/ } $dbdir->children], [],
+	    'no separate artifact files were created';
+
+	@lines = get_ok_output([$prog, 'list-modules', '--stats'], 'list-modules --stats');
+	like $lines[0], qr/^pack\t0\t1\t3\t[1-9]\d*$/, 'list-modules found the packed artifacts';
+};
+
+subtest 'Detect a damaged pack segment' => sub {
+	plan tests => 3;
+	my $segment = $dbdir->child('txn.pack', 'pack.000000');
+	my $contents = $segment->slurp_raw;
+	my $damaged = $contents;
+	substr($damaged, -5, 1) = substr($damaged, -5, 1) eq 'X' ? 'Y' : 'X';
+	$segment->spew_raw($damaged);
+
+	my $c = Test::Command->new(cmd => [$prog, 'rollback', 'pack']);
+	$c->exit_isnt_num(0, 'rollback failed');
+	$c->stderr_like(qr/Checksum mismatch/, 'rollback reported the damaged artifact');
+	is $patched->slurp_utf8, "line 1\nnew line 2\n", 'the patched file was not reverted';
+	$segment->spew_raw($contents);
+};
+
+subtest 'Roll back from the pack segment' => sub {
+	plan tests => 9;
+	my @lines = get_ok_output([$prog, 'rollback', 'pack'], 'rollback');
+	is $removed[$_]->slurp_utf8, "vendor file $_\n" x 10, "removed file $_ was restored"
+	    for 0..$#removed;
+	is $patched->slurp_utf8, "line 1\nline 2\n", 'the patched file was reverted';
+
+	@lines = get_ok_output([$prog, 'db-compact'], 'db-compact');
+	is_deeply [segments $dbdir], [], 'db-compact removed the pack segment';
+};
+
+subtest 'Reject the pack mode along with the content-addressed store' => sub {
+	plan tests => 3;
+	my $other = $tempd->child('other');
+	local $ENV{'TXN_INSTALL_DB'} = $other;
+	my $c = Test::Command->new(cmd => [$prog, 'db-init', '--pack', '--dedup']);
+	$c->exit_isnt_num(0, 'db-init failed');
+	$c->stderr_like(qr/cannot be combined/, 'db-init complained about the options');
+	ok ! -e $other->child('txn.index'), 'db-init did not create the database';
+};
@@ -0,0 +1,92 @@
+#!/usr/bin/perl
+#
+# Copyright (c) 2026  Peter Pentchev
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+# OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+use v5.010;
+use strict;
+use warnings;
+
+use FindBin;
+use Test::More;
+
+use lib "$FindBin::Bin/lib";
+use Test::Txn;
+
+plan tests => 4;
+
+my ($tempd, $dbdir, undef, $data) = setup_db();
+$ENV{'TXN_INSTALL_MODULE'} = 'backup';
+
+my $orig = "\x7fELF\0\0\0\0original binary\n" x 100;
+my $src = $tempd->child('new.bin');
+$src->spew_raw("\x7fELF\0\0\0\0replacement binary\n" x 50);
+my $tgt = $data->child('program.bin');
+
+subtest 'Save an overwritten binary file' => sub {
+	plan tests => 9;
+	$tgt->spew_raw($orig);
+	$tgt->chmod(0640);
+	my @lines = get_ok_output([$prog, 'install', '-m', '755', $src, $tgt], 'install');
+	is $tgt->slurp_raw, $src->slurp_raw, 'the binary file was overwritten';
+	is_deeply [split /\n/, $dbdir->child('txn.index')->slurp_utf8],
+	    ["000000 backup create $tgt", '000001'], 'install recorded a creation';
+	ok -f $dbdir->child('txn.000000'), 'install saved the metadata';
+	is $dbdir->child('txn.000000.data')->slurp_raw, $orig,
+	    'install saved the contents of the overwritten file';
+
+	@lines = get_ok_output([$prog, 'list-modules', '--stats'], 'list-modules --stats');
+	like $lines[0], qr/^backup\t1\t0\t0\t[1-9]\d*$/, 'list-modules counted the saved file';
+};
+
+subtest 'Restore an overwritten binary file' => sub {
+	plan tests => 6;
+	my @lines = get_ok_output([$prog, 'rollback', 'backup'], 'rollback');
+	is $tgt->slurp_raw, $orig, 'rollback restored the overwritten file';
+	is((stat $tgt)[2] & 07777, 0640, 'rollback restored the permissions mode');
+	ok ! -e $dbdir->child('txn.000000'), 'rollback removed the metadata';
+	ok ! -e $dbdir->child('txn.000000.data'), 'rollback removed the contents';
+};
+
+subtest 'Restore a compressed copy' => sub {
+	plan tests => 7;
+	local $ENV{'TXN_INSTALL_COMPRESS'} = 'zlib';
+	my @lines = get_ok_output([$prog, 'install', $src, $tgt], 'install');
+	ok -f $dbdir->child('txn.000001'), 'install saved the overwritten file';
+	ok ! -e $dbdir->child('txn.000001.data'), 'install kept it in a single file';
+
+	@lines = get_ok_output([$prog, 'rollback', 'backup'], 'rollback');
+	is $tgt->slurp_raw, $orig, 'rollback restored the overwritten file';
+};
+
+subtest 'Remove a newly-created binary file' => sub {
+	plan tests => 7;
+	my $new = $data->child('new-program.bin');
+	my @lines = get_ok_output([$prog, 'install', $src, $new], 'install');
+	ok ! -e $dbdir->child('txn.000002'), 'install did not save anything';
+
+	@lines = get_ok_output([$prog, 'rollback', 'backup'], 'rollback');
+	ok ! -e $new, 'rollback removed the new file';
+	is $tgt->slurp_raw, $orig, 'rollback did not touch the other file';
+};
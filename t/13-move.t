@@ -0,0 +1,104 @@
+#!/usr/bin/perl
+#
+# Copyright (c) 2026  Peter Pentchev
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+# OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+use v5.010;
+use strict;
+use warnings;
+
+use FindBin;
+use Test::More;
+
+use lib "$FindBin::Bin/lib";
+use Test::Txn;
+
+plan tests => 4;
+
+my (undef, $dbdir, undef, $data) = setup_db();
+$ENV{'TXN_INSTALL_MODULE'} = 'move';
+
+my $image = $data->child('disk.img');
+my $linked = $data->child('linked.img');
+my $other = $data->child('other-link.img');
+my $target = $data->child('target.img');
+my $symlink = $data->child('symlink.img');
+my $ino;
+
+subtest 'Move a removed file into the database' => sub {
+	plan tests => 6;
+	$image->spew_raw("\0disk image\n" x 1000);
+	$image->chmod(0644);
+	$ino = (stat $image)[1];
+	my @lines = get_ok_output([$prog, 'remove', $image], 'remove');
+	ok ! -e $image, 'remove removed the file';
+	is((stat $dbdir->child('txn.000000.data'))[1], $ino,
+	    'remove moved the file into the database');
+	is $dbdir->child('txn.000000.data')->slurp_raw, "\0disk image\n" x 1000,
+	    'the contents were preserved';
+	is((stat $dbdir->child('txn.000000.data'))[2] & 07777, 0600,
+	    'the moved file was made private to the database');
+};
+
+subtest 'Copy a removed file that has other links' => sub {
+	plan tests => 6;
+	$linked->spew_raw("shared contents\n");
+	ok link($linked, $other), 'a second link was created';
+	my @lines = get_ok_output([$prog, 'remove', $linked], 'remove');
+	ok ! -e $linked, 'remove removed the file';
+	isnt((stat $dbdir->child('txn.000001.data'))[1], (stat $other)[1],
+	    'remove copied the file into the database');
+	is $other->slurp_raw, "shared contents\n", 'the other link was not touched';
+};
+
+subtest 'Copy a file removed through a symbolic link' => sub {
+	plan tests => 7;
+	$target->spew_raw("link target\n");
+	ok symlink('target.img', $symlink), 'a symbolic link was created';
+	my @lines = get_ok_output([$prog, 'remove', $symlink], 'remove');
+	ok ! -l $symlink, 'remove removed the symbolic link';
+	my $stored = $dbdir->child('txn.000002.data');
+	ok -f $stored && ! -l $stored, 'remove stored a regular file';
+	isnt((stat $stored)[1], (stat $target)[1],
+	    'remove copied the file into the database');
+	is $target->slurp_raw, "link target\n", 'the link target was not touched';
+};
+
+subtest 'Roll the removals back' => sub {
+	plan tests => 10;
+	my $copy_ino = (stat $dbdir->child('txn.000001.data'))[1];
+	my @lines = get_ok_output([$prog, 'rollback', 'move'], 'rollback');
+	is $image->slurp_raw, "\0disk image\n" x 1000, 'the moved file was restored';
+	is((stat $image)[1], $ino, 'the moved file was moved back');
+	is((stat $image)[2] & 07777, 0644, 'the moved file got its mode back');
+	is $linked->slurp_raw, "shared contents\n", 'the copied file was restored';
+	is((stat $linked)[1], $copy_ino, 'the stored copy was moved into place');
+	is $symlink->slurp_raw, "link target\n",
+	    'the file removed through a symbolic link was restored';
+	is_deeply [sort map { $_->basename } $data->children],
+	    ['disk.img', 'linked.img', 'other-link.img', 'symlink.img', 'target.img'],
+	    'no temporary files were left';
+	is_deeply [grep { $_->basename =~ /^txn\.\d+/ } $dbdir->children], [],
+	    'rollback removed the artifacts';
+};
@@ -0,0 +1,109 @@
+#!/usr/bin/perl
+#
+# Copyright (c) 2026  Peter Pentchev
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+# OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+use v5.010;
+use strict;
+use warnings;
+
+use FindBin;
+use Test::Command;
+use Test::More;
+
+use lib "$FindBin::Bin/lib";
+use Test::Txn;
+
+my @modes = qw(none batch always);
+
+plan tests => @modes + 1;
+
+my ($tempd, $dbdir, $dbidx, $data) = setup_db(create => 1);
+
+my $src1 = $tempd->child('one.txt');
+$src1->spew_utf8("one\n");
+my $src2 = $tempd->child('two.txt');
+$src2->spew_utf8("two\n");
+my $patched = $data->child('patched.txt');
+my $removed = $data->child('removed.txt');
+my $manifest = $tempd->child('manifest');
+
+for my $mode (@modes) {
+	subtest "Install and roll back with TXN_INSTALL_SYNC=$mode" => sub {
+		plan tests => 20;
+		local $ENV{'TXN_INSTALL_SYNC'} = $mode;
+		local $ENV{'TXN_INSTALL_MODULE'} = "install-$mode";
+		$patched->spew_utf8("original\n");
+		$removed->spew_utf8("removed\n");
+
+		my @lines = get_ok_output([$prog, 'install', '-m', '644',
+		    $src1, $src2, $data], 'install');
+		is scalar @lines, 0, 'install did not output anything';
+		is $data->child('one.txt')->slurp_utf8, "one\n",
+		    'the first file was installed';
+		is $data->child('two.txt')->slurp_utf8, "two\n",
+		    'the second file was installed';
+
+		$manifest->spew_utf8(<<"EOMANIFEST");
+install-exact batch-$mode $src1 $patched
+install-exact batch-$mode $src2 $data/./patched.txt
+remove batch-$mode $removed
+EOMANIFEST
+		@lines = get_ok_output([$prog, 'batch', $manifest], 'batch');
+		is scalar @lines, 0, 'batch did not output anything';
+		is $patched->slurp_utf8, "two\n",
+		    'the same file was changed twice in order';
+		ok !-e $removed, 'the file was removed';
+		my @idx = grep { /-$mode / } split /\n/, $dbidx->slurp_utf8;
+		is scalar @idx, 5, 'all the changes were recorded';
+
+		@lines = get_ok_output([$prog, 'rollback', "batch-$mode"],
+		    'rollback the batch');
+		is scalar @lines, 0, 'the batch rollback did not output anything';
+		@lines = get_ok_output([$prog, 'rollback', "install-$mode"],
+		    'rollback the installation');
+		is scalar @lines, 0, 'the install rollback did not output anything';
+		is $patched->slurp_utf8, "original\n",
+		    'the twice-changed file was reverted';
+		is $removed->slurp_utf8, "removed\n",
+		    'the removed file was put back';
+		ok !-e $data->child('one.txt') && !-e $data->child('two.txt'),
+		    'the installed files were removed';
+	};
+}
+
+subtest 'Reject an invalid TXN_INSTALL_SYNC value' => sub {
+	plan tests => 4;
+	local $ENV{'TXN_INSTALL_SYNC'} = 'sometimes';
+	local $ENV{'TXN_INSTALL_MODULE'} = 'invalid';
+	my $before = $dbidx->slurp_utf8;
+	my $c = Test::Command->new(cmd => [$prog, 'install', '-m', '644',
+	    $src1, $data]);
+	$c->exit_isnt_num(0, 'install failed');
+	$c->stderr_like(qr/Invalid TXN_INSTALL_SYNC value 'sometimes'/,
+	    'install complained about the value');
+	ok !-e $data->child('one.txt'), 'the file was not installed';
+	is $dbidx->slurp_utf8, $before, 'nothing was recorded';
+};
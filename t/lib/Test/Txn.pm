@@ -0,0 +1,67 @@
+#
+# Copyright (c) 2026  Peter Pentchev
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+# OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+package Test::Txn;
+
+use v5.010;
+use strict;
+use warnings;
+
+use File::Temp qw(tempdir);
+use Path::Tiny;
+use Test::Command;
+
+use parent qw(Exporter);
+
+our @EXPORT = qw($prog get_ok_output setup_db);
+
+our $prog = $ENV{TEST_PROG} // './txn';
+
+sub get_ok_output($ $) {
+	my ($cmd, $desc) = @_;
+
+	my $c = Test::Command->new(cmd => $cmd);
+	$c->exit_is_num(0, "$desc succeeded");
+	$c->stderr_is_eq('', "$desc did not output any errors");
+	split /\n/, $c->stdout_value
+}
+
+# Point txn at a database in a new temporary directory, next to a "data"
+# one for the files to install; return the paths to all of these.
+# The database directory itself is only created if asked to, since
+# db-init would create it anyway.
+sub setup_db(%) {
+	my (%opts) = @_;
+
+	my $tempd = path(tempdir(CLEANUP => 1));
+	my $dbdir = $tempd->child('db');
+	my $data = $tempd->child('data');
+	$data->mkpath({ mode => 0755 });
+	$dbdir->mkpath({ mode => 0755 }) if $opts{create};
+	$ENV{'TXN_INSTALL_DB'} = $dbdir;
+	return ($tempd, $dbdir, $dbdir->child('txn.index'), $data);
+}
+
+1;
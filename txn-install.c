@@ -28,20 +28,36 @@
 
 #include <sys/types.h>
 #include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/wait.h>
 
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <grp.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#define ZLIB_CONST
+#include <zlib.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
 #ifndef __printflike
 #if defined(__GNUC__) && __GNUC__ >= 3
 #define __printflike(x, y)	__attribute__((format(printf, (x), (y))))
@@ -58,6 +74,15 @@
 #endif
 #endif
 
+#if defined(__linux__) && defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define HAVE_COPY_FILE_RANGE
+#endif
+
+#ifdef FICLONE
+#define HAVE_FICLONE
+#endif
+
 #ifndef __dead2
 #if defined(__GNUC__) && __GNUC__ >= 2
 #define __dead2	__attribute__((noreturn))
@@ -66,7 +91,12 @@
 #endif
 #endif
 
+#include "arena.h"
+#include "binidx.h"
 #include "flexarr.h"
+#include "intern.h"
+#include "sha256.h"
+#include "unidiff.h"
 
 #define TXN_VERSION	"0.2.1"
 
@@ -92,7 +122,6 @@ static const char * const index_action_names[] = {
 #define INDEX_ACTION_COUNT	(sizeof(index_action_names) / sizeof(index_action_names[0]))
 
 struct index_line {
-	bool			read_any;
 	size_t			idx;
 	const char		*module;
 	enum index_action	action;
@@ -104,18 +133,304 @@ struct rollback_index_line {
 	long			fpos;
 };
 
+enum index_format {
+	INDEX_TEXT,
+	INDEX_BINARY,
+};
+
+/* The state of the pack segments and their location table. */
+struct artifact_pack {
+	char		*dir;
+	int		loc_fd;
+	/* The number of the last segment, -1 if there are none yet. */
+	long		last_seg;
+	/* The segment being appended to, opened on the first write. */
+	int		seg_fd;
+	char		*seg_path;
+	off_t		seg_size;
+	/* Something was appended and needs to be synced in the "batch" mode. */
+	bool		dirty;
+};
+
 struct txn_db {
 	const char * const dir;
 	const char * const idx;
 	FILE * const file;
 	const char * const module;
+	const enum index_format format;
+	/* The width of the serial numbers in a text index. */
+	const size_t num_size;
+	struct sync_queue * const sync;
+	/* Opened without a lock, only for reading a consistent copy. */
+	const bool snapshot;
+	/* The artifacts are kept in the content-addressed blob store. */
+	const bool dedup;
+	/* The artifacts are spread over the "txn.shards" subdirectories. */
+	const bool sharded;
+	/* The artifacts are appended to the "txn.pack" segments. */
+	struct artifact_pack * const pack;
+};
+
+/* A record parsed from the database index, pointing into its contents. */
+struct index_rec {
+	size_t			idx;
+	size_t			offset;
+	const char		*module;
+	size_t			module_len;
+	enum index_action	action;
+	const char		*filename;
+	size_t			filename_len;
+};
+
+/* The records loaded from the database index, all kept in a single arena. */
+struct index_records {
+	struct arena			arena;
+	struct intern			modules;
+	struct rollback_index_line	*lines;
+	size_t				count;
+	size_t				alloc;
+};
+
+struct module_stats {
+	size_t		count[ACT_REMOVE + 1];
+	uintmax_t	bytes;
+};
+
+struct modidx_stamp {
+	size_t		size;
+	size_t		next_idx;
+	uintmax_t	ino;
+	intmax_t	mtime_sec;
+	long		mtime_nsec;
+};
+
+struct index_view {
+	void			*base;
+	const char		*data;
+	size_t			len;
+	bool			mapped;
+
+	/* The records are between start and end; a text index ends at len. */
+	enum index_format	format;
+	size_t			num_size;
+	size_t			start;
+	size_t			end;
+	/* The header and the module names (by id) of a binary index. */
+	struct binidx_header	header;
+	struct intern_name	*modules;
+	size_t			module_count;
+};
+
+/* The characters allowed in module and action names. */
+static const bool index_name_chars[256] = {
+	['-'] = true,
+	['0'] = true, ['1'] = true, ['2'] = true, ['3'] = true, ['4'] = true,
+	['5'] = true, ['6'] = true, ['7'] = true, ['8'] = true, ['9'] = true,
+	['A'] = true, ['B'] = true, ['C'] = true, ['D'] = true, ['E'] = true,
+	['F'] = true, ['G'] = true, ['H'] = true, ['I'] = true, ['J'] = true,
+	['K'] = true, ['L'] = true, ['M'] = true, ['N'] = true, ['O'] = true,
+	['P'] = true, ['Q'] = true, ['R'] = true, ['S'] = true, ['T'] = true,
+	['U'] = true, ['V'] = true, ['W'] = true, ['X'] = true, ['Y'] = true,
+	['Z'] = true,
+	['a'] = true, ['b'] = true, ['c'] = true, ['d'] = true, ['e'] = true,
+	['f'] = true, ['g'] = true, ['h'] = true, ['i'] = true, ['j'] = true,
+	['k'] = true, ['l'] = true, ['m'] = true, ['n'] = true, ['o'] = true,
+	['p'] = true, ['q'] = true, ['r'] = true, ['s'] = true, ['t'] = true,
+	['u'] = true, ['v'] = true, ['w'] = true, ['x'] = true, ['y'] = true,
+	['z'] = true,
+};
+
+enum cmp_result {
+	CMP_SAME,
+	CMP_DIFFERENT,
+	CMP_ERROR,
+};
+
+#define CMP_BUF_SIZE	(256 * 1024)
+
+enum classifier {
+	CLASSIFY_BUILTIN,
+	CLASSIFY_FILE,
+};
+
+enum patcher {
+	PATCHER_BUILTIN,
+	PATCHER_PATCH,
+};
+
+enum compression {
+	COMPRESS_NONE,
+	COMPRESS_ZLIB,
+};
+
+enum sync_mode {
+	SYNC_NONE,
+	SYNC_BATCH,
+	SYNC_ALWAYS,
+};
+
+struct sync_path {
+	char	*path;
+	bool	dir;
+};
+
+/* The files and directories to sync at the end of a "batch" command. */
+struct sync_queue {
+	enum sync_mode		mode;
+	bool			index;
+	struct sync_path	*paths;
+	size_t			count;
+	size_t			alloc;
+	/* Files may be queued by several worker threads. */
+	pthread_mutex_t		lock;
+};
+
+#define TEXT_PREFIX_SIZE	(64 * 1024)
+#define TEXT_MAX_BAD_RATIO	100
+
+/* The bytes of a 64-bit word with the lowest or the highest bit set. */
+#define TEXT_WORD_ONES		UINT64_C(0x0101010101010101)
+#define TEXT_WORD_HIGH		UINT64_C(0x8080808080808080)
+
+/* Control characters that file(1) would not expect in a text file. */
+static const unsigned char text_ctrl_chars[256] = {
+	1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1,
+	[0x7F] = 1,
+};
+
+struct install_opts {
+	bool	exact;
+	bool	set_owner;
+	uid_t	owner;
+	bool	set_group;
+	gid_t	group;
+	mode_t	mode;
+};
+
+/*
+ * A new file being written in the same directory as the destination one
+ * and then put in its place; an unnamed one if it has no temporary name.
+ */
+struct publish_file {
+	const char	*dst;
+	char		*temp;
+	int		fd;
+	bool		replace;
+};
+
+/* A file to install and what was found out about it beforehand. */
+struct install_item {
+	const char	*src;
+	const char	*dst;
+	/* Examine it only after the previous files have been installed. */
+	bool		deferred;
+	/* Make the same changes produce the same patch for deduplication. */
+	bool		reproducible;
+
+	bool		ok;
+	bool		exists;
+	bool		same;
+	char		*patch;
+	size_t		patch_len;
+
+	/* Where its index entry starts and its serial number. */
+	long		pos;
+	size_t		idx;
+};
+
+/* A set of independent tasks processed by a pool of threads. */
+struct worker_pool {
+	void		(*func)(void *arg, size_t idx);
+	void		*arg;
+	size_t		count;
+	size_t		next;
+	pthread_mutex_t	lock;
+};
+
+/*
+ * A file identified by its directory and its name within it, so that
+ * e.g. "dir//f" and "dir/./f" are the same one.  If the directory could
+ * not be examined, the file is unknown.
+ */
+struct file_key {
+	bool		known;
+	dev_t		dev;
+	ino_t		ino;
+	const char	*base;
+};
+
+/* A single file operation read from a batch manifest. */
+struct batch_op {
+	size_t			line;
+	const char		*module;
+	bool			remove;
+	struct install_opts	opts;
+	const char		*src;
+	const char		*dst;
+
+	/* Filled in as the operation is performed. */
+	struct file_key		key;
+	bool			same;
+	bool			recorded;
+	bool			applied;
+	enum index_action	action;
+	size_t			idx;
+};
+
+struct batch {
+	struct batch_op	*ops;
+	size_t		count;
+	size_t		alloc;
 };
 
-#define INDEX_LINE_INIT ((struct index_line){ .read_any = false, })
+#define COPY_BUF_SIZE	(128 * 1024)
+#define COPY_CHUNK_SIZE	(1024 * 1024 * 1024)
 
 #define INDEX_NUM_SIZE	6
 #define INDEX_FIRST	"000000\n"
 
+/*
+ * Version 2 of the text index starts with a header line and has wider
+ * serial numbers; a version 1 index is upgraded when it is about to run
+ * out of them.
+ */
+#define INDEX_WIDE_HEADER	"txn-index 2\n"
+#define INDEX_WIDE_HEADER_SIZE	(sizeof(INDEX_WIDE_HEADER) - 1)
+#define INDEX_WIDE_NUM_SIZE	12
+#define INDEX_VERSION_PREFIX	"txn-index "
+#define INDEX_UPGRADE_AT	900000
+
+/* How many times to try reading the index while it is being updated. */
+#define INDEX_SNAPSHOT_TRIES	100
+
+#define MODIDX_DIR	"txn.modidx"
+#define MODIDX_STAMP	"stamp"
+
+#define SHARDS_DIR			"txn.shards"
+#define SHARDS_NEW_DIR			"txn.shards.new"
+#define SHARD_FANOUT			1000
+
+#define PACK_DIR			"txn.pack"
+#define PACK_LOCATIONS			"locations"
+#define PACK_SEGMENT_PREFIX		"pack."
+#define PACK_SEGMENT_SIZE		(64 * 1024 * 1024)
+
+#define BLOBS_DIR			"txn.blobs"
+#define BLOBS_TEMP_PREFIX		"tmp."
+#define ARTIFACT_DATA_SUFFIX		".data"
+#define ARTIFACT_META_MAGIC		"TXN-META"
+#define ARTIFACT_META_MAGIC_SIZE	8
+
+/*
+ * A compressed artifact starts with a header: the magic string and
+ * a byte that specifies the codec.
+ */
+#define ARTIFACT_CODEC_MAGIC		"TXN-CMP\n"
+#define ARTIFACT_CODEC_MAGIC_SIZE	8
+#define ARTIFACT_CODEC_HEADER_SIZE	(ARTIFACT_CODEC_MAGIC_SIZE + 1)
+#define ARTIFACT_IO_SIZE		(64 * 1024)
+
 static void __dead2
 usage(const bool _ferr)
 {
@@ -124,14 +439,23 @@ usage(const bool _ferr)
 	    "\ttxn install-exact filename... destination\n"
 	    "\ttxn remove filename\n"
 	    "\ttxn rollback modulename\n"
+	    "\ttxn batch [manifest]\n"
 	    "\n"
-	    "\ttxn db-init\n"
-	    "\ttxn list-modules\n"
+	    "\ttxn db-init [-dps] [-f text | binary]\n"
+	    "\ttxn db-compact\n"
+	    "\ttxn db-convert text | binary\n"
+	    "\ttxn db-dedup\n"
+	    "\ttxn db-dump\n"
+	    "\ttxn db-shard\n"
+	    "\ttxn db-upgrade\n"
+	    "\ttxn list-modules [-s | --stats]\n"
 	    "\n"
 	    "\ttxn -V | -h | --features\n"
 	    "\n"
 	    "\t-h\tdisplay program usage information and exit\n"
 	    "\t-V\tdisplay program version information and exit\n"
+	    "\t--wait[=seconds]\n"
+	    "\t\twait for another txn process to unlock the database\n"
 	    "\n"
 	    "For the 'install' and 'remove' commands, the TXN_INSTALL_MODULE environment\n"
 	    "variable specifies the module name; if it is unset, 'unknown' is used.\n";
@@ -149,7 +473,10 @@ version(void)
 static void
 features(void)
 {
-	puts("Features: txn=" TXN_VERSION);
+	puts("Features: txn=" TXN_VERSION
+	    " batch=1.0 compress=1.0 db-compact=1.0 db-convert=1.0"
+	    " db-dedup=1.0 db-dump=1.0 db-shard=1.0 db-upgrade=1.0"
+	    " index-binary=1.0 jobs=1.0 pack=1.0 sync=1.0 wait=1.0");
 }
 
 static const char *
@@ -184,1022 +511,6044 @@ writen(const int fd, const char * const buf, const size_t len)
 	return (true);
 }
 
-static struct txn_db
-do_open_db(const char * const dir, const char * const idx)
+static ssize_t
+readn(const int fd, char * const buf, const size_t len)
 {
-	const int fd = open(idx, O_RDWR);
-	if (fd == -1)
-		err(1, "Could not open the database index '%s'", idx);
-	if (flock(fd, LOCK_EX | LOCK_NB) == -1)
-		err(1, "Could not lock the database index '%s'", idx);
-
-	FILE * const file = fdopen(fd, "r+");
-	if (file == NULL)
-		err(1, "Could not reopen the database index '%s'", idx);
+	size_t done = 0;
+	while (done < len) {
+		const ssize_t n = read(fd, buf + done, len - done);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		} else if (n == 0) {
+			break;
+		}
+		done += n;
+	}
+	return (done);
+}
 
-	const char * const module = getenv("TXN_INSTALL_MODULE");
+static bool
+index_valid_name(const char * const name)
+{
+	if (name[0] == '\0')
+		return (false);
+	for (const char *p = name; *p != '\0'; p++)
+		if (!index_name_chars[(unsigned char)*p])
+			return (false);
+	return (true);
+}
 
-	return ((struct txn_db){
-		.dir = dir,
-		.idx = idx,
-		.file = file,
-		.module = module != NULL ? module : "unknown",
-	});
+/*
+ * The module index is a "txn.modidx" directory next to the database
+ * index: an "m.<module>" file for each module lists the offsets of
+ * the module's live records in the database index, one per line, and
+ * a "stamp" file describes the state of the database index (size, next
+ * serial number, inode, modification time) that the module files match.
+ * It is only a cache: if it is missing or the database index has been
+ * modified by something that did not keep it up to date, it is rebuilt
+ * the next time it is needed.
+ */
+static char *
+modidx_path(const char * const dir, const char * const name)
+{
+	char *path;
+	const int res = name != NULL ?
+	    asprintf(&path, "%s/" MODIDX_DIR "/%s", dir, name) :
+	    asprintf(&path, "%s/" MODIDX_DIR, dir);
+	if (res == -1)
+		err(1, "Could not allocate memory for a module index filename");
+	return (path);
 }
 
-static struct txn_db
-open_db(void)
+static char *
+modidx_module_path(const char * const dir, const char * const module)
 {
-	const char * const dir = get_db_dir();
-	const char * const idx = get_db_index(dir);
-	return (do_open_db(dir, idx));
+	char *path;
+	if (asprintf(&path, "%s/" MODIDX_DIR "/m.%s", dir, module) == -1)
+		err(1, "Could not allocate memory for a module index filename");
+	return (path);
 }
 
-static struct txn_db
-open_or_create_db(const bool may_exist)
+/*
+ * Describe the current state of the database index; on failure, leave
+ * an all-zeroes description that no stamp file will match.
+ */
+static bool
+modidx_current(const struct txn_db * const db, const size_t next_idx, struct modidx_stamp * const st)
 {
-	const char * const dir = get_db_dir();
-	const char * const idx = get_db_index(dir);
+	*st = (struct modidx_stamp){ .size = 0 };
 	struct stat sb;
-	if (stat(dir, &sb) == -1) {
-		if (errno != ENOENT)
-			err(1, "Could not check for the existence of '%s'", dir);
-		if (mkdir(dir, 0755) == -1)
-			err(1, "Could not create the database directory '%s'", dir);
-	} else if (!S_ISDIR(sb.st_mode)) {
-		errx(1, "Not a directory: %s", dir);
-	} else {
-		if (stat(idx, &sb) == -1) {
-			if (errno != ENOENT)
-				err(1, "Could not check for the existence of '%s'", idx);
-		} else if (!S_ISREG(sb.st_mode)) {
-			errx(1, "Not a regular file: %s", idx);
-		} else if (!may_exist) {
-			errx(1, "The database index '%s' already exists", idx);
-		} else {
-			return (do_open_db(dir, idx));
-		}
-	}
-
-	const int fd = open(idx, O_CREAT | O_EXCL | O_RDWR, 0644);
-	if (fd == -1)
-		err(1, "Could not create the database index '%s'", idx);
-	if (!writen(fd, INDEX_FIRST, INDEX_NUM_SIZE + 1))
-		err(1, "Could not write out an empty database index '%s'", idx);
-	if (close(fd) == -1)
-		err(1, "Could not close the newly-created database index '%s'", idx);
-	return (do_open_db(dir, idx));
+	if (fstat(fileno(db->file), &sb) == -1)
+		return (false);
+	*st = (struct modidx_stamp){
+		.size = sb.st_size,
+		.next_idx = next_idx,
+		.ino = sb.st_ino,
+		.mtime_sec = sb.st_mtim.tv_sec,
+		.mtime_nsec = sb.st_mtim.tv_nsec,
+	};
+	return (true);
 }
 
-static int
-cmd_db_init(const int argc, char * const argv[] __unused)
+static bool
+modidx_stamp_equal(const struct modidx_stamp * const a, const struct modidx_stamp * const b)
 {
-	if (argc > 1)
-		usage(true);
+	return (a->ino != 0 && a->size == b->size && a->next_idx == b->next_idx &&
+	    a->ino == b->ino && a->mtime_sec == b->mtime_sec &&
+	    a->mtime_nsec == b->mtime_nsec);
+}
 
-	open_or_create_db(false);
-	return (0);
+static bool
+modidx_read_stamp(const char * const dir, struct modidx_stamp * const st)
+{
+	char * const path = modidx_path(dir, MODIDX_STAMP);
+	FILE * const fp = fopen(path, "r");
+	free(path);
+	if (fp == NULL)
+		return (false);
+	const bool res = fscanf(fp, "txn-modidx 1 %zu %zu %ju %jd %ld",
+	    &st->size, &st->next_idx, &st->ino, &st->mtime_sec, &st->mtime_nsec) == 5;
+	fclose(fp);
+	return (res);
 }
 
+/* Make sure the module index is rebuilt the next time it is needed. */
 static void
-read_next_index_line(FILE * const fp, const char * const db_idx, struct index_line * const ln)
+modidx_invalidate(const char * const dir)
 {
-	/* Read the serial number first */
-	size_t idx = 0;
-	{
-		for (size_t ofs = 0; ofs < INDEX_NUM_SIZE; ofs++) {
-			const int ch = fgetc(fp);
-			if (ch == EOF) {
-				if (ferror(fp))
-					err(1, "Could not read a line index from '%s'", db_idx);
-				else
-					errx(1, "Invalid database index '%s': incomplete line index at EOF", db_idx);
-			} else if (ch < '0' || ch > '9') {
-				errx(1, "Invalid database index '%s': bad character in the line index", db_idx);
-			}
-			idx = idx * 10 + (ch - '0');
-		}
+	char * const path = modidx_path(dir, MODIDX_STAMP);
+	if (unlink(path) == -1 && errno != ENOENT)
+		warn("Could not remove the module index stamp '%s'", path);
+	free(path);
+}
 
-		const int ch = fgetc(fp);
-		if (ch == EOF) {
-			if (ferror(fp))
-				err(1, "Could not read a module name from '%s'", db_idx);
-			else
-				errx(1, "Invalid database index '%s': no module name at EOF", db_idx);
-		} else if (ch == '\n') {
-			ln->read_any = true;
-			ln->idx = idx;
-			ln->module = NULL;
-			return;
-		} else if (ch != ' ') {
-			errx(1, "Invalid database index '%s': expected a space before the module name at %zu", db_idx, idx);
-		}
+static bool
+modidx_write_stamp(const char * const dir, const struct modidx_stamp * const st)
+{
+	char buf[128];
+	const int len = snprintf(buf, sizeof(buf), "txn-modidx 1 %zu %zu %ju %jd %ld\n",
+	    st->size, st->next_idx, st->ino, st->mtime_sec, st->mtime_nsec);
+	char * const path = modidx_path(dir, MODIDX_STAMP);
+	const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	bool res = fd != -1 && writen(fd, buf, len);
+	if (fd != -1 && close(fd) == -1)
+		res = false;
+	if (!res) {
+		warn("Could not update the module index stamp '%s'", path);
+		modidx_invalidate(dir);
 	}
+	free(path);
+	return (res);
+}
 
-	/* Read the module name or return a "last line" entry */
-	char *module;
-	{
-		size_t mlen, mall;
-		FLEXARR_INIT(module, mlen, mall);
-		while (true) {
-			const int ch = fgetc(fp);
-			if (ch == EOF) {
-				if (ferror(fp))
-					err(1, "Could not read a module name from '%s'", db_idx);
-				else
-					errx(1, "Invalid database index '%s': no space after the module name at %zu", db_idx, idx);
-			} else if (ch == ' ') {
-				FLEXARR_ALLOC(module, 1, mlen, mall);
-				module[mlen - 1] = '\0';
-				break;
-			} else if (!((ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z') || (ch >= '0' && ch <= '9') || (ch == '-'))) {
-				errx(1, "Invalid database index '%s': invalid character '%c' in the module name at %zu", db_idx, ch, idx);
-			} else {
-				FLEXARR_ALLOC(module, 1, mlen, mall);
-				module[mlen - 1] = ch;
-			}
-		}
-	}
+/* Update the stamp after the database index was modified as expected. */
+static void
+modidx_update_stamp(const struct txn_db * const db, const size_t next_idx)
+{
+	struct modidx_stamp st;
+	if (modidx_current(db, next_idx, &st))
+		modidx_write_stamp(db->dir, &st);
+	else
+		modidx_invalidate(db->dir);
+}
 
-	/* Read the action name. */
-	enum index_action act = act;
-	{
-		char *action;
-		size_t alen, aall;
-		FLEXARR_INIT(action, alen, aall);
-		while (true) {
-			const int ch = fgetc(fp);
-			if (ch == EOF) {
-				if (ferror(fp))
-					err(1, "Could not read an action name from '%s'", db_idx);
-				else
-					errx(1, "Invalid database index '%s': no space after the action name at %zu", db_idx, idx);
-			} else if (ch == ' ') {
-				FLEXARR_ALLOC(action, 1, alen, aall);
-				action[alen - 1] = '\0';
-				break;
-			} else if (!((ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z') || (ch >= '0' && ch <= '9') || (ch == '-'))) {
-				errx(1, "Invalid database index '%s': invalid character '%c' in the action name at %zu", db_idx, ch, idx);
-			} else {
-				FLEXARR_ALLOC(action, 1, alen, aall);
-				action[alen - 1] = ch;
-			}
-		}
+/* Create an empty module index for a newly-created database index. */
+static void
+modidx_init(const struct txn_db * const db)
+{
+	char * const path = modidx_path(db->dir, NULL);
+	if (mkdir(path, 0755) == -1 && errno != EEXIST)
+		warn("Could not create the module index directory '%s'", path);
+	else
+		modidx_update_stamp(db, 0);
+	free(path);
+}
 
-		bool found = false;
-		for (size_t i = 0; i < INDEX_ACTION_COUNT; i++) {
-			if (strcmp(action, index_action_names[i]) == 0) {
-				act = i;
-				found = true;
-				break;
-			}
-		}
-		if (!found)
-			errx(1, "Invalid database index '%s': invalid action name '%s' at %zu", db_idx, action, idx);
+/* Remove the stamp and all the module files, creating the directory if needed. */
+static bool
+modidx_clear(const char * const dir)
+{
+	char * const path = modidx_path(dir, NULL);
+	if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+		warn("Could not create the module index directory '%s'", path);
+		free(path);
+		return (false);
 	}
 
-	char *filename = NULL;
-	{
-		size_t alloc = 0;
-		if (getline(&filename, &alloc, fp) == -1)
-			errx(1, "Invalid database index '%s': no filename at %zu", db_idx, idx);
-		size_t len = strlen(filename);
-		while (len > 0 && (filename[len - 1] == '\r' || filename[len - 1] == '\n'))
-			filename[--len] = '\0';
+	DIR * const d = opendir(path);
+	if (d == NULL) {
+		warn("Could not read the module index directory '%s'", path);
+		free(path);
+		return (false);
 	}
-
-	*ln = (struct index_line){
-		.read_any = true,
-		.idx = idx,
-		.module = module,
-		.action = act,
-		.filename = filename,
-	};
+	const int dfd = dirfd(d);
+	bool res = true;
+	if (unlinkat(dfd, MODIDX_STAMP, 0) == -1 && errno != ENOENT) {
+		warn("Could not remove the module index stamp in '%s'", path);
+		res = false;
+	}
+	const struct dirent *ent;
+	while (res && (errno = 0, ent = readdir(d)) != NULL)
+		if (strncmp(ent->d_name, "m.", 2) == 0 && unlinkat(dfd, ent->d_name, 0) == -1) {
+			warn("Could not remove '%s' in '%s'", ent->d_name, path);
+			res = false;
+		}
+	if (res && errno != 0) {
+		warn("Could not read the module index directory '%s'", path);
+		res = false;
+	}
+	closedir(d);
+	free(path);
+	return (res);
 }
 
-static int
-cmd_list_modules(const int argc, char * const argv[] __unused)
+/*
+ * Record a just-written database index entry in the module index if
+ * the latter matched the database index before the write.
+ */
+static void
+modidx_record(const struct txn_db * const db, const struct modidx_stamp * const pre, const char * const module, const size_t offset, const size_t idx)
 {
-	if (argc > 1)
-		usage(true);
-
-	const struct txn_db db = open_db();
-	struct index_line ln = INDEX_LINE_INIT;
-	const char **modules;
-	size_t mlen, mall;
-	FLEXARR_INIT(modules, mlen, mall);
-	while (true) {
-		read_next_index_line(db.file, db.idx, &ln);
-		if (ln.module == NULL)
-			break;
-		switch (ln.action) {
-			case ACT_UNCREATE:
-			case ACT_UNPATCH:
-			case ACT_UNREMOVE:
-				continue;
-
-			default:
-				break;
-		}
-
-		bool found = false;
-		for (size_t i = 0; i < mlen; i++)
-			if (strcmp(modules[i], ln.module) == 0) {
-				found = true;
-				break;
-			}
-
-		if (!found) {
-			FLEXARR_ALLOC(modules, 1, mlen, mall);
-			modules[mlen - 1] = ln.module;
-		}
+	struct modidx_stamp st;
+	if (!index_valid_name(module) || !modidx_read_stamp(db->dir, &st) ||
+	    !modidx_stamp_equal(&st, pre))
+		return;
+
+	char buf[32];
+	const int len = snprintf(buf, sizeof(buf), "%zu\n", offset);
+	char * const path = modidx_module_path(db->dir, module);
+	const int fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+	bool res = fd != -1 && writen(fd, buf, len);
+	if (fd != -1 && close(fd) == -1)
+		res = false;
+	if (res) {
+		modidx_update_stamp(db, idx + 1);
+	} else {
+		warn("Could not update the module index file '%s'", path);
+		modidx_invalidate(db->dir);
 	}
-	if (fclose(db.file) == EOF)
-		err(1, "Could not close the database index '%s'", db.idx);
-
-	for (size_t i = 0; i < mlen; i++)
-		puts(modules[i]);
-	FLEXARR_FREE(modules, mall);
-	return (0);
+	free(path);
 }
 
-static const char *
-get_destination_filename(const char * const src, const char * const dst)
+/*
+ * Forget about a just-removed database index entry, dropping its offset
+ * from the module's file.
+ */
+static void
+modidx_unrecord(const struct txn_db * const db, const struct modidx_stamp * const pre, const char * const module, const size_t offset, const size_t idx)
 {
-	struct stat sb;
-	if (stat(dst, &sb) == -1) {
-		if (errno != ENOENT)
-			err(1, "Could not check for the existence of %s", dst);
-		else
-			return dst;
-	} else if (!S_ISDIR(sb.st_mode)) {
-		return dst;
+	struct modidx_stamp st;
+	if (!index_valid_name(module) || !modidx_read_stamp(db->dir, &st) ||
+	    !modidx_stamp_equal(&st, pre))
+		return;
+
+	char * const path = modidx_module_path(db->dir, module);
+	FILE * const fp = fopen(path, "r+");
+	bool res = fp != NULL;
+	if (res) {
+		long keep = 0;
+		size_t ofs;
+		while (fscanf(fp, "%zu\n", &ofs) == 1 && ofs < offset)
+			keep = ftell(fp);
+		res = !ferror(fp) && keep != -1 && ftruncate(fileno(fp), keep) != -1;
+		if (fclose(fp) == EOF)
+			res = false;
 	}
+	if (res)
+		modidx_update_stamp(db, idx);
+	else
+		modidx_invalidate(db->dir);
+	free(path);
+}
 
-	const char * const last_slash = strrchr(src, '/');
-	const char * const filename = last_slash != NULL ? last_slash + 1 : src;
+/* Remove a module's file after all of its records have been rolled back. */
+static void
+modidx_rolled_back(const struct txn_db * const db, const struct modidx_stamp * const pre, const char * const module)
+{
+	struct modidx_stamp st;
+	if (!modidx_read_stamp(db->dir, &st) || !modidx_stamp_equal(&st, pre))
+		return;
+
+	char * const path = modidx_module_path(db->dir, module);
+	if (unlink(path) == -1 && errno != ENOENT) {
+		warn("Could not remove the module index file '%s'", path);
+		modidx_invalidate(db->dir);
+	} else {
+		modidx_update_stamp(db, pre->next_idx);
+	}
+	free(path);
+}
 
-	const size_t len = strlen(dst);
-	const bool has_slash = len == 0 ? false : dst[len - 1] == '/';
+static enum sync_mode
+get_sync_mode(void)
+{
+	const char * const name = getenv("TXN_INSTALL_SYNC");
+	if (name == NULL || strcmp(name, "batch") == 0)
+		return (SYNC_BATCH);
+	else if (strcmp(name, "none") == 0)
+		return (SYNC_NONE);
+	else if (strcmp(name, "always") == 0)
+		return (SYNC_ALWAYS);
+	errx(1, "Invalid TXN_INSTALL_SYNC value '%s', expected 'none', 'batch', or 'always'", name);
+}
 
-	char *full;
-	if (asprintf(&full, "%s%s%s", dst, has_slash ? "" : "/", filename) == -1)
-		err(1, "Could not build a destination pathname");
-	if (strlen(full) < 2)
-		errx(1, "For txn-install's purposes, the destination filename should be at least two characters long");
-	return (full);
+static struct sync_queue *
+sync_queue_new(void)
+{
+	struct sync_queue * const q = malloc(sizeof(*q));
+	if (q == NULL)
+		errx(1, "Out of memory");
+	q->mode = get_sync_mode();
+	q->index = false;
+	FLEXARR_INIT(q->paths, q->count, q->alloc);
+	const int res = pthread_mutex_init(&q->lock, NULL);
+	if (res != 0) {
+		errno = res;
+		err(1, "Could not initialize a mutex");
+	}
+	return (q);
 }
 
+/* Flush a file's data or a directory's entries to stable storage. */
 static bool
-write_db_entry(const struct txn_db * const db, const struct index_line ln)
+sync_now(const char * const path, const bool dir)
 {
-	if (fprintf(db->file, "%06zu %s %s %s\n%06zu\n",
-	    ln.idx, ln.module, index_action_names[ln.action],
-	    ln.filename, ln.idx + 1) < 0 ||
-	    ferror(db->file)) {
-		warn("Could not write to the database index '%s'", db->idx);
+	const int fd = open(path, dir ? O_RDONLY | O_DIRECTORY : O_RDONLY);
+	if (fd == -1) {
+		/* Removed later on by the same command; its directory is queued, too. */
+		if (errno == ENOENT && !dir)
+			return (true);
+		warn("Could not open '%s' to sync it", path);
 		return (false);
 	}
-	if (fflush(db->file) == EOF) {
-		warn("Could not sync a write to the database index '%s'", db->idx);
+	bool res = (dir ? fsync(fd) : fdatasync(fd)) != -1;
+	if (!res)
+		warn("Could not sync '%s'", path);
+	close(fd);
+	return (res);
+}
+
+static bool
+sync_enqueue(struct sync_queue * const q, const char * const path, const bool dir)
+{
+	pthread_mutex_lock(&q->lock);
+	/* Many files are usually installed into the same directory. */
+	if (dir)
+		for (size_t i = q->count; i-- > 0; )
+			if (q->paths[i].dir && strcmp(q->paths[i].path, path) == 0) {
+				pthread_mutex_unlock(&q->lock);
+				return (true);
+			}
+	char * const copy = strdup(path);
+	if (copy == NULL) {
+		pthread_mutex_unlock(&q->lock);
+		warn("Could not allocate memory to sync '%s'", path);
 		return (false);
 	}
+	FLEXARR_ALLOC(q->paths, 1, q->count, q->alloc);
+	q->paths[q->count - 1] = (struct sync_path){
+		.path = copy,
+		.dir = dir,
+	};
+	pthread_mutex_unlock(&q->lock);
 	return (true);
 }
 
+/*
+ * Make sure a file's data reaches the disk: right away in the "always"
+ * mode, at the end of the command in the "batch" one.  The file may
+ * be a temporary one that will be renamed to the final one.
+ */
+static bool
+sync_file(const struct txn_db * const db, const char * const path, const char * const final)
+{
+	switch (db->sync->mode) {
+		case SYNC_ALWAYS:
+			return (sync_now(path, false));
+
+		case SYNC_BATCH:
+			return (sync_enqueue(db->sync, final != NULL ? final : path, false));
+
+		default:
+			return (true);
+	}
+}
+
+/* The same for an open file that may not have a name yet. */
 static bool
-record_install(const char * const src, const char * const orig_dst, const struct txn_db * const db, const size_t line_idx)
+sync_fd(const struct txn_db * const db, const int fd, const char * const final)
+{
+	switch (db->sync->mode) {
+		case SYNC_ALWAYS:
+			if (fdatasync(fd) == -1) {
+				warn("Could not sync '%s'", final);
+				return (false);
+			}
+			return (true);
+
+		case SYNC_BATCH:
+			return (sync_enqueue(db->sync, final, false));
+
+		default:
+			return (true);
+	}
+}
+
+/* Get the name of the directory that a file is in. */
+static char *
+path_dirname(const char * const path)
+{
+	const char * const slash = strrchr(path, '/');
+	char *dir;
+	if (slash == NULL)
+		dir = strdup(".");
+	else if (slash == path)
+		dir = strdup("/");
+	else
+		dir = strndup(path, slash - path);
+	if (dir == NULL)
+		warn("Could not allocate memory for the directory name of '%s'", path);
+	return (dir);
+}
+
+static struct file_key
+file_key_get(const char * const path)
 {
-	const char * const dst = get_destination_filename(src, orig_dst);
+	const char * const slash = strrchr(path, '/');
+	struct file_key key = {
+		.base = slash != NULL ? slash + 1 : path,
+	};
+	char * const dir = path_dirname(path);
 	struct stat sb;
+	if (dir != NULL && stat(dir, &sb) == 0) {
+		key.known = true;
+		key.dev = sb.st_dev;
+		key.ino = sb.st_ino;
+	}
+	free(dir);
+	return (key);
+}
 
-	if (stat(src, &sb) == -1) {
-		warn("Invalid source filename '%s'", src);
+/* Compare two files, the unknown ones first and all equal. */
+static int
+file_key_cmp(const struct file_key * const ka, const struct file_key * const kb)
+{
+	if (ka->known != kb->known)
+		return (ka->known ? 1 : -1);
+	if (!ka->known)
+		return (0);
+	if (ka->dev != kb->dev)
+		return (ka->dev < kb->dev ? -1 : 1);
+	if (ka->ino != kb->ino)
+		return (ka->ino < kb->ino ? -1 : 1);
+	return (strcmp(ka->base, kb->base));
+}
+
+/* The same for the directory entry of a created, renamed, or removed file. */
+static bool
+sync_dir(const struct txn_db * const db, const char * const path)
+{
+	if (db->sync->mode == SYNC_NONE)
+		return (true);
+
+	char * const dir = path_dirname(path);
+	if (dir == NULL)
+		return (false);
+	const bool res = db->sync->mode == SYNC_ALWAYS ?
+	    sync_now(dir, true) : sync_enqueue(db->sync, dir, true);
+	free(dir);
+	return (res);
+}
+
+/* The same for the database index itself. */
+static bool
+sync_index(const struct txn_db * const db)
+{
+	if (db->sync->mode == SYNC_BATCH) {
+		db->sync->index = true;
+	} else if (db->sync->mode == SYNC_ALWAYS &&
+	    (fflush(db->file) == EOF || fdatasync(fileno(db->file)) == -1)) {
+		warn("Could not sync the database index '%s'", db->idx);
 		return (false);
 	}
-	else if (!S_ISREG(sb.st_mode)) {
-		warnx("Not a regular source file: '%s'", src);
+	return (true);
+}
+
+/* Flush the appended artifacts and their locations to stable storage. */
+static bool
+pack_sync(const struct txn_db * const db)
+{
+	struct artifact_pack * const pack = db->pack;
+	pack->dirty = false;
+	if (pack->seg_fd != -1 && fdatasync(pack->seg_fd) == -1) {
+		warn("Could not sync the pack segment '%s'", pack->seg_path);
+		return (false);
+	} else if (fdatasync(pack->loc_fd) == -1) {
+		warn("Could not sync the pack location table in '%s'", pack->dir);
 		return (false);
 	}
+	return (true);
+}
 
-	if (stat(dst, &sb) == -1) {
-		if (errno != ENOENT) {
-			warnx("Could not check for the existence of the destination file '%s'", dst);
-			return (false);
+/*
+ * Sync everything queued up in the "batch" mode: first the files and
+ * their directories, then the pack segments, then the database index.
+ */
+static bool
+sync_commit(const struct txn_db * const db)
+{
+	struct sync_queue * const q = db->sync;
+	bool res = true;
+	for (size_t i = 0; i < q->count; i++) {
+		if (!sync_now(q->paths[i].path, q->paths[i].dir))
+			res = false;
+		free(q->paths[i].path);
+	}
+	q->count = 0;
+	if (db->pack != NULL && db->pack->dirty && !pack_sync(db))
+		res = false;
+	if (q->index) {
+		q->index = false;
+		if (fflush(db->file) == EOF || fdatasync(fileno(db->file)) == -1) {
+			warn("Could not sync the database index '%s'", db->idx);
+			res = false;
 		}
+	}
+	return (res);
+}
 
-		return (write_db_entry(db, (struct index_line){
-			.idx = line_idx,
-			.module = db->module,
-			.action = ACT_CREATE,
-			.filename = dst,
-		}));
+/*
+ * The artifacts (stored patches and removed files) are "txn.<serial>"
+ * files in the database directory or, if the "txn.shards" directory
+ * exists, in its "<serial / 10^6>/<serial / 10^3 % 10^3>" subdirectories,
+ * so that no directory holds more than a thousand or so of them.
+ * If the "txn.blobs" directory exists,
+ * their contents are only stored once: each artifact is a hard link to
+ * a "txn.blobs/<xx>/<sha256>" file named after the digest of its contents,
+ * so a blob's link count, less one, is the number of index entries that
+ * refer to it.  A removed file's metadata is then kept separately:
+ * "txn.<serial>" holds the metadata and "txn.<serial>.data" is the link
+ * to the contents.
+ */
+static bool
+db_has_subdir(const char * const dir, const char * const name)
+{
+	char *path;
+	if (asprintf(&path, "%s/%s", dir, name) < 0)
+		err(1, "Could not allocate memory for the '%s' directory path", name);
+	struct stat sb;
+	bool res = false;
+	if (stat(path, &sb) == 0) {
+		if (!S_ISDIR(sb.st_mode))
+			errx(1, "Not a directory: %s", path);
+		res = true;
+	} else if (errno != ENOENT) {
+		err(1, "Could not check for the existence of '%s'", path);
 	}
+	free(path);
+	return (res);
+}
 
-	/* Is it the same file? */
-	{
-		const pid_t pid = fork();
-		if (pid == -1) {
-			warn("Could not fork for 'cmp %s %s'", src, dst);
-			return (false);
-		} else if (pid == 0) {
-			execlp("cmp", "cmp", "-s", "--", src, dst, NULL);
-			err(3, "Could not execute 'cmp %s %s'", src, dst);
-		}
+static char *
+shard_path(const char * const dir, const char * const shards, const size_t idx, const char * const suffix)
+{
+	char *path;
+	if (asprintf(&path, "%s/%s/%03zu/%03zu/txn.%06zu%s", dir, shards,
+	    idx / SHARD_FANOUT / SHARD_FANOUT, idx / SHARD_FANOUT % SHARD_FANOUT,
+	    idx, suffix) < 0)
+		err(1, "Could not allocate memory for an artifact filename");
+	return (path);
+}
 
-		int stat;
-		if (waitpid(pid, &stat, 0) == -1) {
-			warn("Could not wait for 'cmp %s %s'", src, dst);
-			return (false);
-		} else if (!WIFEXITED(stat)) {
-			warnx("'cmp %s %s' did not exit normally", src, dst);
-			return (false);
-		} else if (WEXITSTATUS(stat) == 0) {
-			/* The files are the same; nothing to do! */
-			return (true);
-		} else if (WEXITSTATUS(stat) != 1) {
-			warnx("'cmp %s %s' exited with an unexpected status of %d", src, dst, WEXITSTATUS(stat));
-			return (false);
-		}
-		/* Phew! */
+static char *
+artifact_path(const struct txn_db * const db, const size_t idx, const char * const suffix)
+{
+	if (db->sharded)
+		return (shard_path(db->dir, SHARDS_DIR, idx, suffix));
+
+	char *path;
+	if (asprintf(&path, "%s/txn.%06zu%s", db->dir, idx, suffix) < 0)
+		err(1, "Could not allocate memory for an artifact filename");
+	return (path);
+}
+
+/* Check whether a filename is that of an artifact and get its serial number. */
+static bool
+artifact_name_parse(const char * const name, size_t * const idx, const char ** const suffix)
+{
+	if (strncmp(name, "txn.", 4) != 0)
+		return (false);
+	const char * const num = name + 4;
+	const size_t digits = strspn(num, "0123456789");
+	if (digits < INDEX_NUM_SIZE ||
+	    (num[digits] != '\0' && strcmp(num + digits, ARTIFACT_DATA_SUFFIX) != 0))
+		return (false);
+	*idx = strtoull(num, NULL, 10);
+	*suffix = num + digits;
+	return (true);
+}
+
+/* Create a directory unless it exists, making sure its entry reaches the disk. */
+static bool
+make_dir(const struct txn_db * const db, const char * const dir)
+{
+	if (mkdir(dir, 0755) == 0)
+		return (sync_dir(db, dir));
+	else if (errno == EEXIST)
+		return (true);
+	warn("Could not create the '%s' directory", dir);
+	return (false);
+}
+
+/* Create the two levels of subdirectories that an artifact file will be in. */
+static bool
+shard_mkdir(const struct txn_db * const db, const char * const path)
+{
+	char * const dir = strdup(path);
+	if (dir == NULL) {
+		warn("Could not allocate memory for an artifact directory name");
+		return (false);
 	}
+	char * const leaf = strrchr(dir, '/');
+	*leaf = '\0';
+	char * const top = strrchr(dir, '/');
+	*top = '\0';
+	bool res = make_dir(db, dir);
+	*top = '/';
+	res = res && make_dir(db, dir);
+	free(dir);
+	return (res);
+}
 
-	/* But is it a text file? */
-	bool is_text;
-	{
-		int fds[2];
-		if (pipe(fds) == -1) {
-			warn("Could not create a pipe for file(1) on '%s'", src);
-			return (false);
-		}
+/* Prepare to store the artifact files for an index entry. */
+static bool
+artifact_mkdir(const struct txn_db * const db, const size_t idx)
+{
+	if (!db->sharded)
+		return (true);
+	char * const path = artifact_path(db, idx, "");
+	const bool res = shard_mkdir(db, path);
+	free(path);
+	return (res);
+}
 
-		const pid_t pid = fork();
-		if (pid == -1) {
-			warn("Could not fork for file(1) on '%s'", src);
-			return (false);
-		} else if (pid == 0) {
-			if (close(fds[0]) == -1)
-				err(1, "Could not close the read end of the pipe for '%s'", src);
-			if (dup2(fds[1], 1) == -1)
-				err(1, "Could not reopen the standard output for '%s'", src);
-			execlp("file", "file", "--", src, NULL);
-			err(1, "Could not execute file(1) on '%s'", src);
-		}
+/*
+ * In the pack mode, the artifacts are appended to "txn.pack/pack.<n>"
+ * segment files, a new one started whenever the last one grows beyond
+ * PACK_SEGMENT_SIZE, and the "txn.pack/locations" table holds a record
+ * at the position of each serial number that says where its artifact is.
+ */
+static char *
+pack_segment_path(const struct artifact_pack * const pack, const long seg)
+{
+	char *path;
+	if (asprintf(&path, "%s/" PACK_SEGMENT_PREFIX "%06ld", pack->dir, seg) < 0)
+		err(1, "Could not allocate memory for a pack segment filename");
+	return (path);
+}
 
-		if (close(fds[1]) == -1) {
-			warn("Could not close the write end of the pipe for '%s'", src);
-			return (false);
+/* Find the numbers of the first and last segments and the number and size of all of them. */
+static bool
+pack_scan(const struct artifact_pack * const pack, long * const first, long * const last, size_t * const count, uintmax_t * const bytes)
+{
+	DIR * const d = opendir(pack->dir);
+	if (d == NULL) {
+		warn("Could not read the pack directory '%s'", pack->dir);
+		return (false);
+	}
+	*first = *last = -1;
+	*count = 0;
+	*bytes = 0;
+	bool res = true;
+	const struct dirent *ent;
+	while (res && (errno = 0, ent = readdir(d)) != NULL) {
+		if (strncmp(ent->d_name, PACK_SEGMENT_PREFIX, strlen(PACK_SEGMENT_PREFIX)) != 0)
+			continue;
+		const char * const num = ent->d_name + strlen(PACK_SEGMENT_PREFIX);
+		if (num[0] == '\0' || strspn(num, "0123456789") != strlen(num))
+			continue;
+		struct stat sb;
+		if (fstatat(dirfd(d), ent->d_name, &sb, 0) == -1) {
+			warn("Could not examine '%s/%s'", pack->dir, ent->d_name);
+			res = false;
+			break;
 		}
-		FILE * const filefile = fdopen(fds[0], "r");
-		if (filefile == NULL) {
-			warn("Could not reopen the read end of the pipe for '%s'", src);
+		const long seg = strtol(num, NULL, 10);
+		if (seg > *last)
+			*last = seg;
+		if (*first == -1 || seg < *first)
+			*first = seg;
+		(*count)++;
+		*bytes += sb.st_size;
+	}
+	if (res && errno != 0) {
+		warn("Could not read the pack directory '%s'", pack->dir);
+		res = false;
+	}
+	closedir(d);
+	return (res);
+}
+
+static struct artifact_pack *
+pack_open(const char * const dir, const bool readonly)
+{
+	if (!db_has_subdir(dir, PACK_DIR))
+		return (NULL);
+	struct artifact_pack * const pack = malloc(sizeof(*pack));
+	if (pack == NULL)
+		errx(1, "Out of memory");
+	*pack = (struct artifact_pack){
+		.seg_fd = -1,
+	};
+	if (asprintf(&pack->dir, "%s/" PACK_DIR, dir) < 0)
+		err(1, "Could not allocate memory for the pack directory path");
+	char *path;
+	if (asprintf(&path, "%s/" PACK_LOCATIONS, pack->dir) < 0)
+		err(1, "Could not allocate memory for the pack location table path");
+	pack->loc_fd = open(path, readonly ? O_RDONLY : O_RDWR | O_CREAT, 0644);
+	if (pack->loc_fd == -1)
+		err(1, "Could not open the pack location table '%s'", path);
+	free(path);
+
+	long first;
+	size_t count;
+	uintmax_t bytes;
+	if (!pack_scan(pack, &first, &pack->last_seg, &count, &bytes))
+		exit(1);
+	return (pack);
+}
+
+/* Find out where an artifact is stored: 1 if it is, 0 if it is not, -1 on error. */
+static int
+pack_location_read(const struct artifact_pack * const pack, const size_t idx, struct binidx_location * const loc)
+{
+	unsigned char buf[BINIDX_LOCATION_SIZE];
+	const ssize_t n = pread(pack->loc_fd, buf, sizeof(buf), (off_t)idx * BINIDX_LOCATION_SIZE);
+	if (n == -1) {
+		warn("Could not read the pack location of artifact %zu", idx);
+		return (-1);
+	}
+	return (n == sizeof(buf) && binidx_decode_location(buf, loc));
+}
+
+/* Record where an artifact is stored or, if loc is NULL, that it is gone. */
+static bool
+pack_location_write(const struct artifact_pack * const pack, const size_t idx, const struct binidx_location * const loc)
+{
+	unsigned char buf[BINIDX_LOCATION_SIZE];
+	if (loc != NULL)
+		binidx_encode_location(buf, loc);
+	else
+		memset(buf, 0, sizeof(buf));
+	if (pwrite(pack->loc_fd, buf, sizeof(buf), (off_t)idx * BINIDX_LOCATION_SIZE) != sizeof(buf)) {
+		warn("Could not record the pack location of artifact %zu", idx);
+		return (false);
+	}
+	return (true);
+}
+
+/* Start appending to a new segment after the last one. */
+static bool
+pack_roll(const struct txn_db * const db)
+{
+	struct artifact_pack * const pack = db->pack;
+	if (pack->seg_fd != -1) {
+		if (pack->dirty && !pack_sync(db))
 			return (false);
-		}
+		close(pack->seg_fd);
+		pack->seg_fd = -1;
+	}
+	free(pack->seg_path);
+	pack->seg_path = pack_segment_path(pack, pack->last_seg + 1);
+	pack->seg_fd = open(pack->seg_path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0600);
+	if (pack->seg_fd == -1) {
+		warn("Could not create the pack segment '%s'", pack->seg_path);
+		return (false);
+	}
+	pack->last_seg++;
+	pack->seg_size = 0;
+	return (sync_dir(db, pack->seg_path));
+}
 
-		char *fline = NULL;
-		size_t len = 0;
-		if (getline(&fline, &len, filefile) == -1) {
-			warn("Could not read a line from the output of file(1) on '%s'", src);
+/* Get ready to append an artifact to the last segment or to a new one. */
+static bool
+pack_append_start(const struct txn_db * const db)
+{
+	struct artifact_pack * const pack = db->pack;
+	if (pack->seg_fd == -1 && pack->last_seg >= 0) {
+		free(pack->seg_path);
+		pack->seg_path = pack_segment_path(pack, pack->last_seg);
+		pack->seg_fd = open(pack->seg_path, O_WRONLY | O_APPEND);
+		struct stat sb;
+		if (pack->seg_fd == -1 || fstat(pack->seg_fd, &sb) == -1) {
+			warn("Could not open the pack segment '%s'", pack->seg_path);
+			if (pack->seg_fd != -1)
+				close(pack->seg_fd);
+			pack->seg_fd = -1;
 			return (false);
 		}
-		fclose(filefile);
+		pack->seg_size = sb.st_size;
+	}
+	if (pack->seg_fd != -1 && pack->seg_size < PACK_SEGMENT_SIZE)
+		return (true);
+	return (pack_roll(db));
+}
+
+static char *
+blob_path(const struct txn_db * const db, const char * const hex)
+{
+	char *path;
+	if (asprintf(&path, "%s/" BLOBS_DIR "/%.2s/%s", db->dir, hex, hex) < 0)
+		err(1, "Could not allocate memory for a blob filename");
+	return (path);
+}
+
+/*
+ * An artifact being written, into a temporary file in the blob store if
+ * enabled or to the end of the last pack segment in the pack mode.
+ */
+struct artifact_writer {
+	const struct txn_db	*db;
+	size_t			idx;
+	const char		*path;
+	char			*temp;
+	int			fd;
+	/* Where the artifact starts in the pack segment and the checksum so far. */
+	off_t			pack_start;
+	uLong			crc;
+	/* The digest and the size of the contents before compression. */
+	struct sha256_ctx	hash;
+	uintmax_t		size;
+	/* Set by artifact_commit() if the contents were already stored. */
+	bool			shared;
+
+	enum compression	codec;
+	z_stream		z;
+	/* The first few bytes, held back until it is known whether a header is needed. */
+	bool			started;
+	char			head[ARTIFACT_CODEC_MAGIC_SIZE];
+	size_t			head_len;
+};
+
+/* An artifact opened for reading: a whole file or a part of a pack segment. */
+struct artifact_file {
+	int			fd;
+	char			*path;
+	off_t			pos;
+	off_t			end;
+	/* The checksum of a packed artifact, verified once its end is reached. */
+	bool			verify;
+	uLong			crc;
+	uLong			want_crc;
+};
 
-		const size_t srclen = strlen(src);
-		if (len < srclen + 2) {
-			warnx("Could not parse the output of file(1) on '%s': line too short: %s", src, fline);
+/* An artifact being read, decompressing it if needed. */
+struct artifact_reader {
+	struct artifact_file	*file;
+	enum compression	codec;
+	z_stream		z;
+	bool			eof;
+	/* The bytes read while looking for a header that was not there. */
+	char			head[ARTIFACT_CODEC_HEADER_SIZE];
+	size_t			head_len;
+	size_t			head_pos;
+	unsigned char		in[ARTIFACT_IO_SIZE];
+};
+
+static enum compression
+get_compression(void)
+{
+	const char * const name = getenv("TXN_INSTALL_COMPRESS");
+	if (name == NULL || strcmp(name, "none") == 0)
+		return (COMPRESS_NONE);
+	else if (strcmp(name, "zlib") == 0)
+		return (COMPRESS_ZLIB);
+	errx(1, "Invalid TXN_INSTALL_COMPRESS value '%s', expected 'none' or 'zlib'", name);
+}
+
+static bool
+artifact_create(struct artifact_writer * const w, const struct txn_db * const db, const size_t idx, const char * const path)
+{
+	*w = (struct artifact_writer){
+		.db = db,
+		.idx = idx,
+		.path = path,
+		.fd = -1,
+		.codec = get_compression(),
+	};
+	if (db->pack != NULL) {
+		if (!pack_append_start(db))
 			return (false);
-		}
-		if (strncmp(fline, src, srclen) != 0 ||
-		    strncmp(fline + srclen, ": ", 2) != 0) {
-			warnx("Could not parse the output of file(1) on '%s': line starts weirdly: %s", src, fline);
+		w->path = db->pack->seg_path;
+		w->fd = db->pack->seg_fd;
+		w->pack_start = db->pack->seg_size;
+		w->crc = crc32(0, Z_NULL, 0);
+		return (true);
+	} else if (!db->dedup) {
+		w->fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (w->fd == -1) {
+			warn("Could not create the '%s' artifact file", path);
 			return (false);
 		}
-
-		const char *p = fline + srclen + 1;
-		is_text = false;
-		while (true) {
-			const char * const ntext = strstr(p + 1, "text");
-			if (ntext == NULL)
-				break;
-			/* Yes, we know there is always a previous character. */
-			if (strchr(" \t", ntext[-1]) != NULL &&
-			    strchr(" \t\n", ntext[4]) != NULL) {
-				is_text = true;
-				break;
-			}
-			p = ntext + 3;
+		if (flock(w->fd, LOCK_EX | LOCK_NB) == -1) {
+			warn("Could not lock the '%s' artifact file", path);
+			close(w->fd);
+			unlink(path);
+			return (false);
 		}
+		return (true);
 	}
 
-	if (!is_text) {
-		return (write_db_entry(db, (struct index_line){
-			.idx = line_idx,
-			.module = db->module,
-			.action = ACT_CREATE,
-			.filename = dst,
-		}));
-	}
-
-	char *patch_filename;
-	if (asprintf(&patch_filename, "%s/txn.%06zu", db->dir, line_idx) < 0) {
-		warn("Could not generate a patch filename for '%s'", dst);
+	if (asprintf(&w->temp, "%s/" BLOBS_DIR "/" BLOBS_TEMP_PREFIX "XXXXXX", db->dir) < 0) {
+		warn("Could not allocate memory for a temporary blob filename");
+		w->temp = NULL;
 		return (false);
 	}
-	const int patch_fd = open(patch_filename, O_RDWR | O_CREAT | O_EXCL, 0600);
-	if (patch_fd == -1) {
-		warn("Could not create the '%s' patch file for '%s'", patch_filename, dst);
+	w->fd = mkstemp(w->temp);
+	if (w->fd == -1) {
+		warn("Could not create a temporary file in '%s/" BLOBS_DIR "'", db->dir);
+		free(w->temp);
 		return (false);
 	}
-	if (flock(patch_fd, LOCK_EX | LOCK_NB) == -1) {
-		warn("Could not lock the '%s' patch file for '%s'", patch_filename, dst);
+	sha256_init(&w->hash);
+	return (true);
+}
+
+static const char *
+artifact_writer_path(const struct artifact_writer * const w)
+{
+	return (w->temp != NULL ? w->temp : w->path);
+}
+
+/* Write some data that is stored as it is before the contents. */
+static bool
+artifact_write_raw(struct artifact_writer * const w, const void * const buf, const size_t len)
+{
+	if (!writen(w->fd, buf, len)) {
+		warn("Could not write to '%s'", artifact_writer_path(w));
 		return (false);
 	}
-	{
-		const pid_t pid = fork();
-		if (pid == -1)
-			err(1, "Could not fork for diff");
-		else if (pid == 0) {
-			if (dup2(patch_fd, 1) == -1)
-				err(1, "Could not reopen the '%s' patch file for '%s' as the standard output", patch_filename, dst);
-			execlp("diff", "diff", "-u", "--", dst, src, NULL);
-			err(1, "Could not run diff");
-		}
-		if (close(patch_fd) == -1) {
-			warn("Could not close the '%s' patch file for '%s'", patch_filename, dst);
-			return (false);
-		}
+	if (w->db->pack != NULL) {
+		w->db->pack->seg_size += len;
+		w->crc = crc32(w->crc, buf, len);
+	}
+	return (true);
+}
+
+/* Compress the contents if needed and write them out. */
+static bool
+artifact_emit(struct artifact_writer * const w, const char * const buf, const size_t len, const bool finish)
+{
+	if (w->codec == COMPRESS_NONE)
+		return (artifact_write_raw(w, buf, len));
+
+	/* Feed zlib in chunks that its counters can hold. */
+	size_t done = 0;
+	do {
+		const size_t chunk = len - done < ARTIFACT_IO_SIZE ? len - done : ARTIFACT_IO_SIZE;
+		const bool last = finish && done + chunk == len;
+		w->z.next_in = (const Bytef *)buf + done;
+		w->z.avail_in = chunk;
+		int res;
+		do {
+			unsigned char out[ARTIFACT_IO_SIZE];
+			w->z.next_out = out;
+			w->z.avail_out = sizeof(out);
+			res = deflate(&w->z, last ? Z_FINISH : Z_NO_FLUSH);
+			if (res == Z_STREAM_ERROR) {
+				warnx("Could not compress the data for '%s'", artifact_writer_path(w));
+				return (false);
+			}
+			if (!artifact_write_raw(w, out, sizeof(out) - w->z.avail_out))
+				return (false);
+		} while (w->z.avail_out == 0 || (last && res != Z_STREAM_END));
+		done += chunk;
+	} while (done < len);
+	return (true);
+}
 
-		int stat;
-		if (waitpid(pid, &stat, 0) == -1) {
-			warn("Could not wait for diff to complete for '%s'", dst);
+/*
+ * Write out the header if the contents are compressed or if they would
+ * look like it, then the bytes held back so far.
+ */
+static bool
+artifact_start(struct artifact_writer * const w)
+{
+	w->started = true;
+	if (w->codec != COMPRESS_NONE ||
+	    (w->head_len == ARTIFACT_CODEC_MAGIC_SIZE &&
+	     memcmp(w->head, ARTIFACT_CODEC_MAGIC, ARTIFACT_CODEC_MAGIC_SIZE) == 0)) {
+		char header[ARTIFACT_CODEC_HEADER_SIZE];
+		memcpy(header, ARTIFACT_CODEC_MAGIC, ARTIFACT_CODEC_MAGIC_SIZE);
+		header[ARTIFACT_CODEC_MAGIC_SIZE] = w->codec;
+		if (!artifact_write_raw(w, header, sizeof(header)))
 			return (false);
-		} else if (!WIFEXITED(stat) || (WEXITSTATUS(stat) != 0 && WEXITSTATUS(stat) != 1)) {
-			warnx("diff failed for '%s' (stat 0x%X", dst, stat);
+	}
+	if (w->codec == COMPRESS_ZLIB) {
+		w->z = (z_stream){ .zalloc = Z_NULL, };
+		if (deflateInit(&w->z, Z_DEFAULT_COMPRESSION) != Z_OK) {
+			warnx("Could not initialize the compression for '%s'", artifact_writer_path(w));
+			w->codec = COMPRESS_NONE;
 			return (false);
 		}
 	}
+	return (w->head_len == 0 || artifact_emit(w, w->head, w->head_len, false));
+}
 
-	return (write_db_entry(db, (struct index_line){
-		.idx = line_idx,
-		.module = db->module,
-		.action = ACT_PATCH,
-		.filename = dst,
-	}));
+static bool
+artifact_write(struct artifact_writer * const w, const void * const buf, const size_t len)
+{
+	if (w->temp != NULL)
+		sha256_update(&w->hash, buf, len);
+	w->size += len;
+
+	const char *data = buf;
+	size_t left = len;
+	if (!w->started) {
+		const size_t n = left < ARTIFACT_CODEC_MAGIC_SIZE - w->head_len ?
+		    left : ARTIFACT_CODEC_MAGIC_SIZE - w->head_len;
+		memcpy(w->head + w->head_len, data, n);
+		w->head_len += n;
+		data += n;
+		left -= n;
+		if (w->head_len < ARTIFACT_CODEC_MAGIC_SIZE)
+			return (true);
+		if (!artifact_start(w))
+			return (false);
+	}
+	return (left == 0 || artifact_emit(w, data, left, false));
 }
 
+static void
+artifact_abort(struct artifact_writer * const w)
+{
+	if (w->started && w->codec == COMPRESS_ZLIB)
+		deflateEnd(&w->z);
+	struct artifact_pack * const pack = w->db->pack;
+	if (pack != NULL) {
+		/* If this fails, db-compact will get rid of the partial data. */
+		if (ftruncate(w->fd, w->pack_start) == 0)
+			pack->seg_size = w->pack_start;
+		return;
+	}
+	if (w->fd != -1)
+		close(w->fd);
+	unlink(artifact_writer_path(w));
+	free(w->temp);
+}
+
+/*
+ * Put the contents into the blob store unless they are already there
+ * and link the artifact to them.  If the blob already has as many links
+ * as the file system allows, keep the artifact as a private copy.
+ */
 static bool
-run_install(char * const argv[])
+blob_store(struct artifact_writer * const w, const char * const blob)
 {
-	const pid_t pid = fork();
-	if (pid == -1) {
-		warn("Could not fork for install(1)");
+	const struct txn_db * const db = w->db;
+	char * const dir = strdup(blob);
+	if (dir == NULL) {
+		warn("Could not allocate memory for a blob directory name");
 		return (false);
-	} else if (pid == 0) {
-		execvp("install", argv);
-		err(1, "Could not run install(1)");
 	}
-
-	int stat;
-	const int res = waitpid(pid, &stat, 0);
-	if (res == -1) {
-		warn("Could not wait for install(1) to complete");
+	*strrchr(dir, '/') = '\0';
+	const bool res = make_dir(db, dir);
+	free(dir);
+	if (!res)
 		return (false);
-	} else if (!WIFEXITED(stat) || WEXITSTATUS(stat) != 0) {
-		warnx("install(1) failed");
+
+	if (link(w->temp, blob) == 0) {
+		if (!sync_file(db, blob, NULL) || !sync_dir(db, blob))
+			return (false);
+	} else if (errno == EEXIST) {
+		w->shared = true;
+	} else {
+		warn("Could not store '%s' as '%s'", w->temp, blob);
 		return (false);
 	}
-	return (true);
+
+	if (link(blob, w->path) == -1) {
+		if (errno != EMLINK || !w->shared) {
+			warn("Could not link the '%s' artifact file to '%s'", w->path, blob);
+			return (false);
+		}
+		if (rename(w->temp, w->path) == -1) {
+			warn("Could not rename '%s' to '%s'", w->temp, w->path);
+			return (false);
+		}
+		w->shared = false;
+		if (!sync_file(db, w->path, NULL) || !sync_dir(db, w->path)) {
+			unlink(w->path);
+			return (false);
+		}
+		return (true);
+	} else if (!sync_dir(db, w->path)) {
+		unlink(w->path);
+		return (false);
+	}
+	return (true);
+}
+
+static bool
+artifact_commit(struct artifact_writer * const w)
+{
+	const struct txn_db * const db = w->db;
+	if ((!w->started && !artifact_start(w)) ||
+	    (w->codec == COMPRESS_ZLIB && !artifact_emit(w, NULL, 0, true))) {
+		artifact_abort(w);
+		return (false);
+	}
+	if (w->codec == COMPRESS_ZLIB) {
+		deflateEnd(&w->z);
+		w->codec = COMPRESS_NONE;
+	}
+
+	struct artifact_pack * const pack = db->pack;
+	if (pack != NULL) {
+		const struct binidx_location loc = {
+			.segment = pack->last_seg,
+			.offset = w->pack_start,
+			.length = pack->seg_size - w->pack_start,
+			.crc = w->crc,
+		};
+		if (!pack_location_write(pack, w->idx, &loc)) {
+			artifact_abort(w);
+			return (false);
+		}
+		if (db->sync->mode == SYNC_ALWAYS)
+			return (pack_sync(db));
+		pack->dirty = db->sync->mode == SYNC_BATCH;
+		return (true);
+	}
+
+	const int fd = w->fd;
+	w->fd = -1;
+	if (close(fd) == -1) {
+		warn("Could not close '%s'", artifact_writer_path(w));
+		artifact_abort(w);
+		return (false);
+	}
+	if (w->temp == NULL) {
+		if (sync_file(db, w->path, NULL) && sync_dir(db, w->path))
+			return (true);
+		unlink(w->path);
+		return (false);
+	}
+
+	unsigned char digest[SHA256_SIZE];
+	char hex[SHA256_HEX_SIZE + 1];
+	sha256_final(&w->hash, digest);
+	sha256_hex(digest, hex);
+	char * const blob = blob_path(db, hex);
+	const bool res = blob_store(w, blob);
+	unlink(w->temp);
+	free(w->temp);
+	free(blob);
+	return (res);
+}
+
+/* Store a removed file's metadata separately from its contents. */
+static bool
+artifact_write_meta(const struct txn_db * const db, const char * const path, const struct stat * const sb)
+{
+	const int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (fd == -1) {
+		warn("Could not create the '%s' artifact file", path);
+		return (false);
+	}
+	if (!writen(fd, ARTIFACT_META_MAGIC, ARTIFACT_META_MAGIC_SIZE) ||
+	    !writen(fd, (const char *)sb, sizeof(*sb))) {
+		warn("Could not write to '%s'", path);
+		close(fd);
+		unlink(path);
+		return (false);
+	}
+	if (close(fd) == -1) {
+		warn("Could not close '%s'", path);
+		unlink(path);
+		return (false);
+	}
+	if (!sync_file(db, path, NULL)) {
+		unlink(path);
+		return (false);
+	}
+	return (true);
+}
+
+/* Open a whole artifact file; errno is preserved on failure. */
+static bool
+artifact_open_path(struct artifact_file * const f, const char * const path)
+{
+	*f = (struct artifact_file){
+		.fd = open(path, O_RDONLY),
+	};
+	if (f->fd == -1)
+		return (false);
+	struct stat sb;
+	if (fstat(f->fd, &sb) == -1) {
+		const int saved = errno;
+		close(f->fd);
+		errno = saved;
+		return (false);
+	}
+	f->path = strdup(path);
+	if (f->path == NULL)
+		err(1, "Could not allocate memory for an artifact filename");
+	f->end = sb.st_size;
+	return (true);
+}
+
+/*
+ * Open the artifact of an index entry, setting errno to ENOENT if there
+ * is none.
+ */
+static bool
+artifact_open(const struct txn_db * const db, const size_t idx, const char * const suffix, struct artifact_file * const f)
+{
+	if (db->pack == NULL) {
+		char * const path = artifact_path(db, idx, suffix);
+		const bool res = artifact_open_path(f, path);
+		const int saved = errno;
+		free(path);
+		errno = saved;
+		return (res);
+	}
+
+	struct binidx_location loc;
+	const int found = pack_location_read(db->pack, idx, &loc);
+	if (found != 1) {
+		errno = found == 0 ? ENOENT : EIO;
+		return (false);
+	}
+	char * const path = pack_segment_path(db->pack, loc.segment);
+	const bool res = artifact_open_path(f, path);
+	const int saved = errno;
+	free(path);
+	if (!res) {
+		/* The location is there, so the segment must be, too. */
+		errno = saved == ENOENT ? EIO : saved;
+		return (false);
+	}
+	f->pos = loc.offset;
+	f->end = loc.offset + loc.length;
+	f->verify = true;
+	f->crc = crc32(0, Z_NULL, 0);
+	f->want_crc = loc.crc;
+	return (true);
+}
+
+/* Read from an artifact, verifying the checksum of a packed one at its end. */
+static ssize_t
+artifact_pread(struct artifact_file * const f, void * const buf, const size_t len)
+{
+	size_t done = 0;
+	while (done < len && f->pos < f->end) {
+		const size_t want = (uintmax_t)(f->end - f->pos) < len - done ?
+		    (size_t)(f->end - f->pos) : len - done;
+		const ssize_t n = pread(f->fd, (char *)buf + done, want, f->pos);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("Could not read from '%s'", f->path);
+			return (-1);
+		} else if (n == 0) {
+			if (!f->verify)
+				break;
+			warnx("Unexpected end of the pack segment '%s'", f->path);
+			return (-1);
+		}
+		if (f->verify)
+			f->crc = crc32(f->crc, (const Bytef *)buf + done, n);
+		done += n;
+		f->pos += n;
+		if (f->verify && f->pos == f->end && f->crc != f->want_crc) {
+			warnx("Checksum mismatch for the artifact ending at offset %jd in '%s'",
+			    (intmax_t)f->end, f->path);
+			return (-1);
+		}
+	}
+	return (done);
+}
+
+static void
+artifact_close(struct artifact_file * const f)
+{
+	close(f->fd);
+	free(f->path);
+}
+
+/*
+ * Start reading the contents of an artifact from the current position,
+ * looking for a compression header.
+ */
+static bool
+artifact_reader_open(struct artifact_reader * const r, struct artifact_file * const f)
+{
+	const char * const path = f->path;
+	r->file = f;
+	r->codec = COMPRESS_NONE;
+	r->eof = false;
+	r->head_pos = 0;
+	const ssize_t n = artifact_pread(f, r->head, sizeof(r->head));
+	if (n == -1)
+		return (false);
+	r->head_len = n;
+	if (r->head_len < ARTIFACT_CODEC_HEADER_SIZE ||
+	    memcmp(r->head, ARTIFACT_CODEC_MAGIC, ARTIFACT_CODEC_MAGIC_SIZE) != 0)
+		return (true);
+
+	r->head_len = 0;
+	const unsigned codec = (unsigned char)r->head[ARTIFACT_CODEC_MAGIC_SIZE];
+	switch (codec) {
+		case COMPRESS_NONE:
+			return (true);
+
+		case COMPRESS_ZLIB:
+			r->z = (z_stream){ .zalloc = Z_NULL, };
+			if (inflateInit(&r->z) != Z_OK) {
+				warnx("Could not initialize the decompression for '%s'", path);
+				return (false);
+			}
+			r->codec = COMPRESS_ZLIB;
+			return (true);
+
+		default:
+			warnx("Unsupported compression method %u in '%s'", codec, path);
+			return (false);
+	}
+}
+
+/* Read and decompress some of the contents; zero means the end of them. */
+static ssize_t
+artifact_read(struct artifact_reader * const r, char * const buf, const size_t len)
+{
+	size_t done = 0;
+	if (r->head_pos < r->head_len) {
+		done = r->head_len - r->head_pos < len ? r->head_len - r->head_pos : len;
+		memcpy(buf, r->head + r->head_pos, done);
+		r->head_pos += done;
+	}
+	if (r->codec == COMPRESS_NONE) {
+		const ssize_t n = artifact_pread(r->file, buf + done, len - done);
+		return (n == -1 ? -1 : (ssize_t)(done + n));
+	}
+
+	r->z.next_out = (Bytef *)buf + done;
+	r->z.avail_out = len - done;
+	while (r->z.avail_out > 0 && !r->eof) {
+		if (r->z.avail_in == 0) {
+			const ssize_t n = artifact_pread(r->file, r->in, sizeof(r->in));
+			if (n == -1) {
+				return (-1);
+			} else if (n == 0) {
+				warnx("Unexpected end of the compressed data in '%s'", r->file->path);
+				return (-1);
+			}
+			r->z.next_in = r->in;
+			r->z.avail_in = n;
+		}
+		const int res = inflate(&r->z, Z_NO_FLUSH);
+		if (res == Z_STREAM_END) {
+			r->eof = true;
+		} else if (res != Z_OK) {
+			warnx("Could not decompress the data in '%s'", r->file->path);
+			return (-1);
+		}
+	}
+	return (len - r->z.avail_out);
+}
+
+static void
+artifact_reader_close(struct artifact_reader * const r)
+{
+	if (r->codec == COMPRESS_ZLIB)
+		inflateEnd(&r->z);
+}
+
+/* Read the whole contents of an artifact into memory. */
+static bool
+artifact_load(struct artifact_file * const f, char ** const data, size_t * const len)
+{
+	struct artifact_reader r;
+	if (!artifact_reader_open(&r, f))
+		return (false);
+	char *buf;
+	size_t used, alloc;
+	FLEXARR_INIT(buf, used, alloc);
+	while (true) {
+		FLEXARR_ALLOC(buf, ARTIFACT_IO_SIZE, used, alloc);
+		const ssize_t n = artifact_read(&r, buf + used - ARTIFACT_IO_SIZE, ARTIFACT_IO_SIZE);
+		if (n == -1) {
+			artifact_reader_close(&r);
+			FLEXARR_FREE(buf, alloc);
+			return (false);
+		}
+		used -= ARTIFACT_IO_SIZE - n;
+		if (n == 0)
+			break;
+	}
+	artifact_reader_close(&r);
+	*data = buf;
+	*len = used;
+	return (true);
+}
+
+/*
+ * Read a removed file's metadata: either a separate metadata file or
+ * the start of the artifact, leaving it positioned at the contents.
+ */
+static bool
+artifact_read_meta(struct artifact_file * const f, struct stat * const sb, bool * const separate)
+{
+	char buf[ARTIFACT_META_MAGIC_SIZE + sizeof(*sb)];
+	if (artifact_pread(f, buf, sizeof(*sb)) != (ssize_t)sizeof(*sb))
+		return (false);
+	*separate = memcmp(buf, ARTIFACT_META_MAGIC, ARTIFACT_META_MAGIC_SIZE) == 0;
+	if (!*separate) {
+		memcpy(sb, buf, sizeof(*sb));
+		return (true);
+	}
+	if (artifact_pread(f, buf + sizeof(*sb), ARTIFACT_META_MAGIC_SIZE) != ARTIFACT_META_MAGIC_SIZE)
+		return (false);
+	memcpy(sb, buf + ARTIFACT_META_MAGIC_SIZE, sizeof(*sb));
+	return (true);
+}
+
+/* Find the blob that an artifact file is a link to. */
+static char *
+artifact_blob(const struct txn_db * const db, const char * const path, const struct stat * const sb)
+{
+	struct artifact_file f;
+	if (!artifact_open_path(&f, path))
+		return (NULL);
+	struct artifact_reader r;
+	if (!artifact_reader_open(&r, &f)) {
+		artifact_close(&f);
+		return (NULL);
+	}
+	struct sha256_ctx hash;
+	sha256_init(&hash);
+	char buf[ARTIFACT_IO_SIZE];
+	ssize_t n;
+	while (n = artifact_read(&r, buf, sizeof(buf)), n > 0)
+		sha256_update(&hash, buf, n);
+	artifact_reader_close(&r);
+	artifact_close(&f);
+	if (n == -1)
+		return (NULL);
+
+	unsigned char digest[SHA256_SIZE];
+	char hex[SHA256_HEX_SIZE + 1];
+	sha256_final(&hash, digest);
+	sha256_hex(digest, hex);
+	char * const blob = blob_path(db, hex);
+	struct stat bsb;
+	if (stat(blob, &bsb) == -1 || bsb.st_dev != sb->st_dev || bsb.st_ino != sb->st_ino) {
+		free(blob);
+		return (NULL);
+	}
+	return (blob);
+}
+
+/*
+ * Remove an artifact file and, if it was the last link to a blob,
+ * the blob itself; any other unreferenced blobs are left for db-compact.
+ * An artifact kept as a private copy because its blob had too many
+ * links has a single link of its own, so it is never taken for one.
+ */
+static bool
+artifact_unlink(const struct txn_db * const db, const char * const path)
+{
+	struct stat sb;
+	char * const blob = db->dedup && stat(path, &sb) == 0 && sb.st_nlink == 2 ?
+	    artifact_blob(db, path, &sb) : NULL;
+	bool res = true;
+	if (unlink(path) == -1 && errno != ENOENT) {
+		warn("Could not remove '%s'", path);
+		res = false;
+	} else if (blob != NULL && unlink(blob) == -1 && errno != ENOENT) {
+		warn("Could not remove '%s'", blob);
+		res = false;
+	}
+	free(blob);
+	return (res);
+}
+
+/* Remove all the files that make up the artifact of an index entry. */
+static bool
+artifact_remove(const struct txn_db * const db, const size_t idx)
+{
+	/* The space taken up in the pack segments is reclaimed by db-compact. */
+	if (db->pack != NULL) {
+		struct binidx_location loc;
+		const int found = pack_location_read(db->pack, idx, &loc);
+		return (found == 0 || (found == 1 && pack_location_write(db->pack, idx, NULL)));
+	}
+
+	char * const data = artifact_path(db, idx, ARTIFACT_DATA_SUFFIX);
+	bool res = artifact_unlink(db, data);
+	free(data);
+	char * const path = artifact_path(db, idx, "");
+	if (!artifact_unlink(db, path))
+		res = false;
+	free(path);
+	return (res);
+}
+
+static void
+index_detect_format(const int fd, const char * const idx, enum index_format * const format, size_t * const num_size)
+{
+	char magic[INDEX_WIDE_HEADER_SIZE];
+	const ssize_t n = pread(fd, magic, sizeof(magic), 0);
+	if (n == -1)
+		err(1, "Could not read the database index '%s'", idx);
+	*format = INDEX_TEXT;
+	*num_size = INDEX_NUM_SIZE;
+	if (n >= BINIDX_MAGIC_SIZE && memcmp(magic, BINIDX_MAGIC, BINIDX_MAGIC_SIZE) == 0) {
+		*format = INDEX_BINARY;
+	} else if (n == sizeof(magic) && memcmp(magic, INDEX_WIDE_HEADER, sizeof(magic)) == 0) {
+		*num_size = INDEX_WIDE_NUM_SIZE;
+	} else if (n >= (ssize_t)strlen(INDEX_VERSION_PREFIX) &&
+	    memcmp(magic, INDEX_VERSION_PREFIX, strlen(INDEX_VERSION_PREFIX)) == 0) {
+		errx(1, "Unsupported version of the database index '%s'", idx);
+	}
+}
+
+/*
+ * How long to wait for another process to unlock the database:
+ * 0 for not at all, -1 for as long as it takes.
+ */
+static long
+get_lock_wait(void)
+{
+	const char * const value = getenv("TXN_INSTALL_WAIT");
+	if (value == NULL)
+		return (0);
+	if (strcmp(value, "forever") == 0)
+		return (-1);
+
+	char *end;
+	errno = 0;
+	const long res = strtol(value, &end, 10);
+	if (*value < '0' || *value > '9' || *end != '\0' || errno != 0)
+		errx(1, "Invalid TXN_INSTALL_WAIT value '%s', expected a number of seconds or 'forever'", value);
+	return (res);
+}
+
+static volatile sig_atomic_t lock_timed_out;
+
+static void
+lock_timeout(const int sig __unused)
+{
+	lock_timed_out = 1;
+}
+
+static double
+elapsed_since(const struct timespec * const start)
+{
+	struct timespec now;
+	if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+		return (0);
+	return ((now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9);
+}
+
+/*
+ * Lock the database index, possibly waiting for another process to
+ * release it; the timer keeps firing after the timeout in case the
+ * first signal arrives before flock(2) starts waiting.  The waiting
+ * processes are not queued in any particular order.
+ */
+static void
+lock_db(const int fd, const char * const idx)
+{
+	if (flock(fd, LOCK_EX | LOCK_NB) == 0)
+		return;
+	if (errno != EWOULDBLOCK)
+		err(1, "Could not lock the database index '%s'", idx);
+	const long wait = get_lock_wait();
+	if (wait == 0) {
+		errno = EWOULDBLOCK;
+		err(1, "Could not lock the database index '%s'", idx);
+	}
+
+	struct timespec start;
+	if (clock_gettime(CLOCK_MONOTONIC, &start) == -1)
+		err(1, "Could not get the current time");
+	struct sigaction sa = {
+		.sa_handler = lock_timeout,
+	}, old_sa;
+	sigemptyset(&sa.sa_mask);
+	lock_timed_out = 0;
+	if (wait > 0) {
+		if (sigaction(SIGALRM, &sa, &old_sa) == -1)
+			err(1, "Could not set up a timeout for locking the database index '%s'", idx);
+		const struct itimerval it = {
+			.it_value = { .tv_sec = wait },
+			.it_interval = { .tv_usec = 100000 },
+		};
+		if (setitimer(ITIMER_REAL, &it, NULL) == -1)
+			err(1, "Could not set up a timeout for locking the database index '%s'", idx);
+	}
+
+	int res;
+	while (res = flock(fd, LOCK_EX), res == -1 && errno == EINTR && !lock_timed_out)
+		;
+	const int save_errno = errno;
+	if (wait > 0) {
+		setitimer(ITIMER_REAL, &(const struct itimerval){ .it_value = { .tv_sec = 0 } }, NULL);
+		sigaction(SIGALRM, &old_sa, NULL);
+	}
+	if (res == -1) {
+		if (lock_timed_out)
+			errx(1, "Timed out after %ld seconds waiting to lock the database index '%s'", wait, idx);
+		errno = save_errno;
+		err(1, "Could not lock the database index '%s'", idx);
+	}
+	warnx("Waited %.3f seconds to lock the database index '%s'", elapsed_since(&start), idx);
+}
+
+static struct txn_db
+do_open_db(const char * const dir, const char * const idx)
+{
+	int fd;
+	for (;;) {
+		fd = open(idx, O_RDWR);
+		if (fd == -1)
+			err(1, "Could not open the database index '%s'", idx);
+		lock_db(fd, idx);
+
+		/* Make sure the index was not replaced before we locked it. */
+		struct stat fsb, psb;
+		if (fstat(fd, &fsb) == -1)
+			err(1, "Could not examine the database index '%s'", idx);
+		if (stat(idx, &psb) == 0 &&
+		    psb.st_dev == fsb.st_dev && psb.st_ino == fsb.st_ino)
+			break;
+		close(fd);
+	}
+
+	enum index_format format;
+	size_t num_size;
+	index_detect_format(fd, idx, &format, &num_size);
+
+	FILE * const file = fdopen(fd, "r+");
+	if (file == NULL)
+		err(1, "Could not reopen the database index '%s'", idx);
+
+	const char * const module = getenv("TXN_INSTALL_MODULE");
+
+	return ((struct txn_db){
+		.dir = dir,
+		.idx = idx,
+		.file = file,
+		.module = module != NULL ? module : "unknown",
+		.format = format,
+		.num_size = num_size,
+		.sync = sync_queue_new(),
+		.dedup = db_has_subdir(dir, BLOBS_DIR),
+		.sharded = db_has_subdir(dir, SHARDS_DIR),
+		.pack = pack_open(dir, false),
+	});
+}
+
+static struct txn_db
+open_db(void)
+{
+	const char * const dir = get_db_dir();
+	const char * const idx = get_db_index(dir);
+	return (do_open_db(dir, idx));
+}
+
+/*
+ * Open the database index for reading without locking it, so that
+ * the read-only commands never have to wait for the ones that make
+ * changes or make them wait; see index_view_snapshot().
+ */
+static struct txn_db
+open_db_snapshot(void)
+{
+	const char * const dir = get_db_dir();
+	const char * const idx = get_db_index(dir);
+	const int fd = open(idx, O_RDONLY);
+	if (fd == -1)
+		err(1, "Could not open the database index '%s'", idx);
+	enum index_format format;
+	size_t num_size;
+	index_detect_format(fd, idx, &format, &num_size);
+	FILE * const file = fdopen(fd, "r");
+	if (file == NULL)
+		err(1, "Could not reopen the database index '%s'", idx);
+
+	return ((struct txn_db){
+		.dir = dir,
+		.idx = idx,
+		.file = file,
+		.module = "unknown",
+		.format = format,
+		.num_size = num_size,
+		.sync = sync_queue_new(),
+		.snapshot = true,
+		.dedup = db_has_subdir(dir, BLOBS_DIR),
+		.sharded = db_has_subdir(dir, SHARDS_DIR),
+		.pack = pack_open(dir, true),
+	});
+}
+
+static bool
+parse_index_format(const char * const name, enum index_format * const format)
+{
+	if (strcmp(name, "text") == 0)
+		*format = INDEX_TEXT;
+	else if (strcmp(name, "binary") == 0)
+		*format = INDEX_BINARY;
+	else
+		return (false);
+	return (true);
+}
+
+/*
+ * Find the records in a view of the database index; for a binary one,
+ * examine the header and load the module names.
+ */
+static struct index_view
+index_view_init(const struct txn_db * const db, struct index_view v)
+{
+	v.format = db->format;
+	if (v.format == INDEX_TEXT) {
+		v.num_size = db->num_size;
+		v.start = v.num_size == INDEX_WIDE_NUM_SIZE ? INDEX_WIDE_HEADER_SIZE : 0;
+		v.end = v.len;
+		return (v);
+	}
+
+	const unsigned char * const data = (const unsigned char *)v.data;
+	struct binidx_header h;
+	if (!binidx_decode_header(data, v.len, &h))
+		errx(1, "Invalid database index '%s': bad binary index header", db->idx);
+	if (h.end > v.len)
+		errx(1, "Invalid database index '%s': truncated binary index", db->idx);
+	v.start = BINIDX_HEADER_SIZE;
+	v.end = h.end;
+	v.header = h;
+	v.module_count = h.module_count;
+	v.modules = calloc(h.module_count + 1, sizeof(*v.modules));
+	if (v.modules == NULL)
+		err(1, "Could not allocate memory for the database index modules");
+
+	uint64_t ofs = h.last_module;
+	for (size_t i = 0; i < h.module_count; i++) {
+		struct binidx_record rec;
+		if (ofs < v.start || ofs >= v.end ||
+		    !binidx_decode_record(data + ofs, v.end - ofs, &rec) ||
+		    rec.type != BINIDX_MODULE || rec.module >= h.module_count ||
+		    v.modules[rec.module].name != NULL || rec.name_len == 0)
+			errx(1, "Invalid database index '%s': bad module definition at %" PRIu64, db->idx, ofs);
+		for (size_t j = 0; j < rec.name_len; j++)
+			if (!index_name_chars[(unsigned char)rec.name[j]])
+				errx(1, "Invalid database index '%s': invalid character in the module name at %" PRIu64, db->idx, ofs);
+		v.modules[rec.module] = (struct intern_name){
+			.name = rec.name,
+			.len = rec.name_len,
+		};
+		ofs = rec.prev;
+	}
+	return (v);
+}
+
+/* Read the whole database index into memory. */
+static char *
+index_read_all(const struct txn_db * const db, size_t * const len)
+{
+	const int fd = fileno(db->file);
+	struct stat sb;
+	if (fstat(fd, &sb) == -1)
+		err(1, "Could not examine the database index '%s'", db->idx);
+	if ((uintmax_t)sb.st_size >= SIZE_MAX)
+		errx(1, "The database index '%s' is too large", db->idx);
+
+	const size_t size = sb.st_size;
+	char * const buf = malloc(size > 0 ? size : 1);
+	if (buf == NULL)
+		err(1, "Could not allocate memory to read the database index '%s'", db->idx);
+	size_t done = 0;
+	while (done < size) {
+		const ssize_t n = pread(fd, buf + done, size - done, done);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "Could not read the database index '%s'", db->idx);
+		} else if (n == 0) {
+			break;
+		}
+		done += n;
+	}
+	*len = done;
+	return (buf);
+}
+
+/*
+ * Check that a copy of the database index read without locking it
+ * does not end in the middle of an update: a text index must end in
+ * a complete "last line" entry, and the header of a binary one (which
+ * is updated after the records are written) must not point past
+ * the end of the data.  If an entry was just removed by overwriting it
+ * with a "last line" one, the records stop there anyway.
+ */
+static bool
+index_snapshot_complete(const struct txn_db * const db, const char * const data, const size_t len)
+{
+	if (db->format == INDEX_BINARY) {
+		struct binidx_header h;
+		return (binidx_decode_header((const unsigned char *)data, len, &h) &&
+		    h.end >= BINIDX_HEADER_SIZE && h.end <= len);
+	}
+
+	const size_t num_size = db->num_size;
+	const size_t first = num_size == INDEX_WIDE_NUM_SIZE ? INDEX_WIDE_HEADER_SIZE : 0;
+	if (len < first + num_size + 1 || data[len - 1] != '\n')
+		return (false);
+	const size_t start = len - num_size - 1;
+	if (start > first && data[start - 1] != '\n')
+		return (false);
+	for (size_t i = start; i < len - 1; i++)
+		if (data[i] < '0' || data[i] > '9')
+			return (false);
+	return (true);
+}
+
+/*
+ * Read a consistent copy of a database index opened without a lock,
+ * retrying if it is being updated right now.  If another process keeps
+ * changing it, wait for a shared lock after all.
+ */
+static struct index_view
+index_view_snapshot(const struct txn_db * const db)
+{
+	size_t len;
+	char *buf;
+	for (unsigned tries = 0; ; tries++) {
+		buf = index_read_all(db, &len);
+		if (index_snapshot_complete(db, buf, len))
+			break;
+		free(buf);
+
+		if (tries == INDEX_SNAPSHOT_TRIES) {
+			const int fd = fileno(db->file);
+			if (flock(fd, LOCK_SH) == -1)
+				err(1, "Could not lock the database index '%s'", db->idx);
+			buf = index_read_all(db, &len);
+			flock(fd, LOCK_UN);
+			if (len == 0)
+				errx(1, "Invalid database index '%s': incomplete line index at EOF", db->idx);
+			break;
+		}
+		nanosleep(&(const struct timespec){ .tv_nsec = 1000000 }, NULL);
+	}
+	return (index_view_init(db, (struct index_view){
+		.base = buf,
+		.data = buf,
+		.len = len,
+		.mapped = false,
+	}));
+}
+
+/*
+ * Get a read-only view of the whole database index: map it into memory
+ * if possible, read it into a buffer otherwise.
+ */
+static struct index_view
+index_view_open(const struct txn_db * const db)
+{
+	if (db->snapshot)
+		return (index_view_snapshot(db));
+	if (fflush(db->file) == EOF)
+		err(1, "Could not sync the database index '%s'", db->idx);
+	const int fd = fileno(db->file);
+	struct stat sb;
+	if (fstat(fd, &sb) == -1)
+		err(1, "Could not examine the database index '%s'", db->idx);
+	if ((uintmax_t)sb.st_size >= SIZE_MAX)
+		errx(1, "The database index '%s' is too large", db->idx);
+
+	const size_t len = sb.st_size;
+	if (len == 0)
+		errx(1, "Invalid database index '%s': incomplete line index at EOF", db->idx);
+	void * const data = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	if (data != MAP_FAILED) {
+		posix_madvise(data, len, POSIX_MADV_SEQUENTIAL);
+		return (index_view_init(db, (struct index_view){
+			.base = data,
+			.data = data,
+			.len = len,
+			.mapped = true,
+		}));
+	}
+
+	size_t done;
+	char * const buf = index_read_all(db, &done);
+	return (index_view_init(db, (struct index_view){
+		.base = buf,
+		.data = buf,
+		.len = done,
+		.mapped = false,
+	}));
+}
+
+static void
+index_view_close(struct index_view * const v)
+{
+	if (v->mapped)
+		munmap(v->base, v->len);
+	else
+		free(v->base);
+	free(v->modules);
+	v->modules = NULL;
+	v->base = NULL;
+	v->data = NULL;
+	v->len = 0;
+}
+
+static bool
+index_parse_action(const char * const name, const size_t len, enum index_action * const act)
+{
+	const bool undone = len > 2 && name[0] == 'u' && name[1] == 'n';
+	const char * const base = undone ? name + 2 : name;
+	const size_t base_len = undone ? len - 2 : len;
+
+	enum index_action res;
+	switch (base[0]) {
+		case 'c':
+			res = ACT_CREATE;
+			break;
+
+		case 'p':
+			res = ACT_PATCH;
+			break;
+
+		case 'r':
+			res = ACT_REMOVE;
+			break;
+
+		default:
+			return (false);
+	}
+	const char * const expected = index_action_names[res];
+	if (base_len != strlen(expected) || memcmp(base, expected, base_len) != 0)
+		return (false);
+	*act = undone ? res + ACT_UNCREATE : res;
+	return (true);
+}
+
+static const char *
+index_scan_name(const char * const start, const char * const end, const char * const db_idx, const char * const what, const size_t idx)
+{
+	const char * const sp = memchr(start, ' ', end - start);
+	if (sp == NULL)
+		errx(1, "Invalid database index '%s': no space after the %s name at %zu", db_idx, what, idx);
+	for (const char *p = start; p < sp; p++)
+		if (!index_name_chars[(unsigned char)*p])
+			errx(1, "Invalid database index '%s': invalid character '%c' in the %s name at %zu", db_idx, *p, what, idx);
+	return (sp);
+}
+
+static bool
+index_next_text(const struct index_view * const v, size_t * const pos, const char * const db_idx, struct index_rec * const rec)
+{
+	const char * const start = v->data + *pos;
+	const char * const vend = v->data + v->len;
+	const char * const nl = memchr(start, '\n', vend - start);
+	const char * const end = nl != NULL ? nl : vend;
+	const size_t num_size = v->num_size;
+
+	/* Read the serial number first */
+	if ((size_t)(end - start) < num_size)
+		errx(1, "Invalid database index '%s': incomplete line index at EOF", db_idx);
+	size_t idx = 0;
+	for (size_t ofs = 0; ofs < num_size; ofs++) {
+		const unsigned char ch = start[ofs];
+		if (ch < '0' || ch > '9')
+			errx(1, "Invalid database index '%s': bad character in the line index", db_idx);
+		idx = idx * 10 + (ch - '0');
+	}
+	rec->idx = idx;
+	rec->offset = *pos;
+
+	/* Is this the "last line" entry? */
+	if ((size_t)(end - start) == num_size) {
+		if (nl == NULL)
+			errx(1, "Invalid database index '%s': no module name at EOF", db_idx);
+		*pos = nl + 1 - v->data;
+		return (false);
+	} else if (start[num_size] != ' ') {
+		errx(1, "Invalid database index '%s': expected a space before the module name at %zu", db_idx, idx);
+	}
+
+	const char * const module = start + num_size + 1;
+	const char * const module_end = index_scan_name(module, end, db_idx, "module", idx);
+	const char * const action = module_end + 1;
+	const char * const action_end = index_scan_name(action, end, db_idx, "action", idx);
+	if (!index_parse_action(action, action_end - action, &rec->action))
+		errx(1, "Invalid database index '%s': invalid action name '%.*s' at %zu", db_idx, (int)(action_end - action), action, idx);
+
+	const char * const filename = action_end + 1;
+	if (filename == end && nl == NULL)
+		errx(1, "Invalid database index '%s': no filename at %zu", db_idx, idx);
+	const char *filename_end = end;
+	while (filename_end > filename && filename_end[-1] == '\r')
+		filename_end--;
+
+	rec->module = module;
+	rec->module_len = module_end - module;
+	rec->filename = filename;
+	rec->filename_len = filename_end - filename;
+	*pos = nl != NULL ? (size_t)(nl + 1 - v->data) : v->len;
+	return (true);
+}
+
+static bool
+index_next_binary(const struct index_view * const v, size_t * const pos, const char * const db_idx, struct index_rec * const rec)
+{
+	const unsigned char * const data = (const unsigned char *)v->data;
+	while (*pos < v->end) {
+		struct binidx_record brec;
+		if (!binidx_decode_record(data + *pos, v->end - *pos, &brec))
+			errx(1, "Invalid database index '%s': bad record at %zu", db_idx, *pos);
+		const size_t offset = *pos;
+		*pos += brec.size;
+		if (brec.type != BINIDX_ENTRY)
+			continue;
+
+		if (brec.module >= v->module_count || v->modules[brec.module].name == NULL)
+			errx(1, "Invalid database index '%s': undefined module at %" PRIu64, db_idx, brec.idx);
+		if (brec.idx > SIZE_MAX)
+			errx(1, "Invalid database index '%s': serial number too large at %zu", db_idx, offset);
+		*rec = (struct index_rec){
+			.idx = brec.idx,
+			.offset = offset,
+			.module = v->modules[brec.module].name,
+			.module_len = v->modules[brec.module].len,
+			.action = brec.action + (brec.status == BINIDX_STATUS_UNDONE ? ACT_UNCREATE : 0),
+			.filename = brec.name,
+			.filename_len = brec.name_len,
+		};
+		return (true);
+	}
+	rec->idx = v->header.next_idx;
+	rec->offset = v->end;
+	return (false);
+}
+
+/*
+ * Parse the index record at the specified position, advance the position
+ * past it, and return true if it was a full record, or false if the end
+ * of the index was reached; the next serial number is then returned.
+ * The returned names point into the view and are not NUL-terminated.
+ */
+static bool
+index_next(const struct index_view * const v, size_t * const pos, const char * const db_idx, struct index_rec * const rec)
+{
+	return (v->format == INDEX_BINARY ?
+	    index_next_binary(v, pos, db_idx, rec) :
+	    index_next_text(v, pos, db_idx, rec));
+}
+
+/*
+ * Parse a record at an offset obtained from somewhere else, e.g. the module
+ * index; return false if there does not seem to be one there.
+ */
+static bool
+index_entry_at(const struct index_view * const v, const size_t ofs, size_t * const next, const char * const db_idx, struct index_rec * const rec)
+{
+	if (ofs < v->start || ofs >= v->end)
+		return (false);
+	*next = ofs;
+	if (v->format == INDEX_TEXT)
+		return ((ofs == 0 || v->data[ofs - 1] == '\n') &&
+		    index_next_text(v, next, db_idx, rec));
+
+	struct binidx_record brec;
+	return (binidx_decode_record((const unsigned char *)v->data + ofs, v->end - ofs, &brec) &&
+	    brec.type == BINIDX_ENTRY && index_next_binary(v, next, db_idx, rec));
+}
+
+/* Get the serial number that the next record will get. */
+static bool
+index_view_next_idx(const struct index_view * const v, const char * const db_idx, size_t * const next_idx)
+{
+	if (v->format == INDEX_BINARY) {
+		*next_idx = v->header.next_idx;
+		return (true);
+	}
+	if (v->len < v->start + v->num_size + 1)
+		return (false);
+	size_t pos = v->len - (v->num_size + 1);
+	struct index_rec rec;
+	if ((pos > 0 && v->data[pos - 1] != '\n') || index_next_text(v, &pos, db_idx, &rec))
+		return (false);
+	*next_idx = rec.idx;
+	return (true);
+}
+
+static void
+index_records_init(struct index_records * const recs)
+{
+	recs->arena = ARENA_INIT;
+	recs->modules = INTERN_INIT(&recs->arena);
+	FLEXARR_INIT(recs->lines, recs->count, recs->alloc);
+}
+
+static void
+index_records_add(struct index_records * const recs, const struct index_rec * const rec)
+{
+	const size_t module_id = intern_id(&recs->modules, rec->module, rec->module_len);
+	FLEXARR_ALLOC(recs->lines, 1, recs->count, recs->alloc);
+	recs->lines[recs->count - 1] = (struct rollback_index_line){
+		.line = {
+			.idx = rec->idx,
+			.module = INTERN_NAME(&recs->modules, module_id),
+			.action = rec->action,
+			/* The filename may be needed after the index has been modified. */
+			.filename = arena_strndup(&recs->arena, rec->filename, rec->filename_len),
+		},
+		.fpos = rec->offset,
+	};
+}
+
+static void
+index_records_free(struct index_records * const recs)
+{
+	FLEXARR_FREE(recs->lines, recs->alloc);
+	intern_free(&recs->modules);
+	arena_free(&recs->arena);
+}
+
+/*
+ * Load the records from the database index into a per-command arena,
+ * keeping a single copy of each module name.  If a module is specified,
+ * only its records are loaded; if live_only is set, the rolled-back
+ * ones are skipped.
+ */
+static void
+index_load(const struct txn_db * const db, struct index_records * const recs, const char * const module, const bool live_only)
+{
+	index_records_init(recs);
+
+	struct index_view view = index_view_open(db);
+	const size_t module_len = module != NULL ? strlen(module) : 0;
+	struct index_rec rec;
+	for (size_t pos = view.start; index_next(&view, &pos, db->idx, &rec); ) {
+		if (module != NULL &&
+		    (rec.module_len != module_len || memcmp(rec.module, module, module_len) != 0))
+			continue;
+		switch (rec.action) {
+			case ACT_CREATE:
+			case ACT_PATCH:
+			case ACT_REMOVE:
+				break;
+
+			case ACT_UNCREATE:
+			case ACT_UNPATCH:
+			case ACT_UNREMOVE:
+				if (live_only)
+					continue;
+				break;
+
+			default:
+				errx(1, "Invalid database index: unexpected action '%d' at %zu", rec.action, rec.idx);
+				/* NOTREACHED */
+		}
+
+		index_records_add(recs, &rec);
+	}
+	index_view_close(&view);
+}
+
+/*
+ * Make sure the module index matches the database index, rebuilding it
+ * if it does not or if the caller found it to be inconsistent.
+ */
+static bool
+modidx_sync(const struct txn_db * const db, const struct index_view * const v, const bool rebuild, struct modidx_stamp * const cur)
+{
+	size_t next_idx;
+	if (!index_view_next_idx(v, db->idx, &next_idx) || !modidx_current(db, next_idx, cur))
+		return (false);
+
+	struct modidx_stamp st;
+	if (!rebuild && modidx_read_stamp(db->dir, &st) && modidx_stamp_equal(&st, cur))
+		return (true);
+	if (!modidx_clear(db->dir))
+		return (false);
+
+	struct arena arena = ARENA_INIT;
+	struct intern modules = INTERN_INIT(&arena);
+	struct modidx_offsets {
+		size_t	*ofs;
+		size_t	count;
+		size_t	alloc;
+	} *mods;
+	size_t mcount, mall;
+	FLEXARR_INIT(mods, mcount, mall);
+	struct index_rec rec;
+	for (size_t pos = v->start; index_next(v, &pos, db->idx, &rec); ) {
+		if (rec.action >= ACT_UNCREATE)
+			continue;
+		const size_t id = intern_id(&modules, rec.module, rec.module_len);
+		if (id == mcount) {
+			FLEXARR_ALLOC(mods, 1, mcount, mall);
+			FLEXARR_INIT(mods[id].ofs, mods[id].count, mods[id].alloc);
+		}
+		FLEXARR_ALLOC(mods[id].ofs, 1, mods[id].count, mods[id].alloc);
+		mods[id].ofs[mods[id].count - 1] = rec.offset;
+	}
+
+	bool res = true;
+	for (size_t id = 0; id < mcount; id++) {
+		if (res) {
+			char * const path = modidx_module_path(db->dir, INTERN_NAME(&modules, id));
+			FILE * const fp = fopen(path, "w");
+			if (fp != NULL) {
+				for (size_t i = 0; i < mods[id].count; i++)
+					fprintf(fp, "%zu\n", mods[id].ofs[i]);
+				if (ferror(fp))
+					res = false;
+				if (fclose(fp) == EOF)
+					res = false;
+			} else {
+				res = false;
+			}
+			if (!res)
+				warn("Could not write the module index file '%s'", path);
+			free(path);
+		}
+		FLEXARR_FREE(mods[id].ofs, mods[id].alloc);
+	}
+	FLEXARR_FREE(mods, mall);
+	intern_free(&modules);
+	arena_free(&arena);
+
+	return (res && modidx_write_stamp(db->dir, cur));
+}
+
+/*
+ * Load a module's live records using the module index.  Return false if
+ * the module index turns out not to match the database index.
+ */
+static bool
+modidx_load(const struct txn_db * const db, const struct index_view * const v, struct index_records * const recs, const char * const module)
+{
+	char * const path = modidx_module_path(db->dir, module);
+	FILE * const fp = fopen(path, "r");
+	free(path);
+	if (fp == NULL)
+		return (errno == ENOENT);
+
+	const size_t module_len = strlen(module);
+	bool res = true;
+	size_t ofs, next = 0;
+	while (res && fscanf(fp, "%zu\n", &ofs) == 1) {
+		struct index_rec rec;
+		size_t pos;
+		if (ofs < next || !index_entry_at(v, ofs, &pos, db->idx, &rec) ||
+		    rec.module_len != module_len || memcmp(rec.module, module, module_len) != 0)
+			res = false;
+		else if (rec.action < ACT_UNCREATE)
+			index_records_add(recs, &rec);
+		next = pos;
+	}
+	if (ferror(fp) || !feof(fp))
+		res = false;
+	fclose(fp);
+	return (res);
+}
+
+/*
+ * Load a module's live records, using the module index if possible so
+ * that only the module's own lines in the database index are parsed.
+ * Return true and describe the state of the database index if the module
+ * index was used and matches it.
+ */
+static bool
+index_load_module(const struct txn_db * const db, struct index_records * const recs, const char * const module, struct modidx_stamp * const stamp)
+{
+	if (index_valid_name(module)) {
+		struct index_view view = index_view_open(db);
+		for (int attempt = 0; attempt < 2; attempt++) {
+			index_records_init(recs);
+			if (modidx_sync(db, &view, attempt > 0, stamp) &&
+			    modidx_load(db, &view, recs, module)) {
+				index_view_close(&view);
+				return (true);
+			}
+			index_records_free(recs);
+		}
+		index_view_close(&view);
+	}
+	index_load(db, recs, module, true);
+	return (false);
+}
+
+/*
+ * Get the size of the artifact (stored patch or removed file) for
+ * an index entry; a missing one counts as zero.
+ */
+static uintmax_t
+get_artifact_file_size(const struct txn_db * const db, const size_t idx, const char * const suffix)
+{
+	if (db->pack != NULL) {
+		struct binidx_location loc;
+		const int found = pack_location_read(db->pack, idx, &loc);
+		if (found == -1)
+			exit(1);
+		return (found == 1 ? loc.length : 0);
+	}
+
+	char * const filename = artifact_path(db, idx, suffix);
+	struct stat sb;
+	uintmax_t size = 0;
+	if (stat(filename, &sb) == 0)
+		size = sb.st_size;
+	else if (errno != ENOENT)
+		err(1, "Could not examine '%s'", filename);
+	free(filename);
+	return (size);
+}
+
+static uintmax_t
+get_artifact_size(const struct txn_db * const db, const size_t idx)
+{
+	const uintmax_t size = get_artifact_file_size(db, idx, "");
+	if (db->pack != NULL)
+		return (size);
+	return (size + get_artifact_file_size(db, idx, ARTIFACT_DATA_SUFFIX));
+}
+
+static int
+cmd_list_modules(const int argc, char * const argv[])
+{
+	bool stats = false;
+	int ch;
+	optind = 0;
+	while (ch = getopt(argc, argv, "s-:"), ch != -1)
+		switch (ch) {
+			case 's':
+				stats = true;
+				break;
+
+			case '-':
+				if (strcmp(optarg, "stats") == 0) {
+					stats = true;
+					break;
+				}
+				warnx("Invalid long option '%s' specified", optarg);
+				usage(true);
+				/* NOTREACHED */
+
+			default:
+				usage(true);
+				/* NOTREACHED */
+		}
+	if (argc > optind)
+		usage(true);
+
+	const struct txn_db db = open_db_snapshot();
+	struct arena arena = ARENA_INIT;
+	struct intern modules = INTERN_INIT(&arena);
+	struct module_stats *mstats;
+	size_t slen, sall;
+	FLEXARR_INIT(mstats, slen, sall);
+
+	struct index_view view = index_view_open(&db);
+	struct index_rec rec;
+	for (size_t pos = view.start; index_next(&view, &pos, db.idx, &rec); ) {
+		switch (rec.action) {
+			case ACT_UNCREATE:
+			case ACT_UNPATCH:
+			case ACT_UNREMOVE:
+				continue;
+
+			default:
+				break;
+		}
+
+		const size_t id = intern_id(&modules, rec.module, rec.module_len);
+		if (!stats)
+			continue;
+		if (id == slen) {
+			FLEXARR_ALLOC(mstats, 1, slen, sall);
+			mstats[id] = (struct module_stats){ .count = { 0 }, };
+		}
+		mstats[id].count[rec.action]++;
+		mstats[id].bytes += get_artifact_size(&db, rec.idx);
+	}
+	index_view_close(&view);
+
+	for (size_t id = 0; id < modules.count; id++)
+		if (stats)
+			printf("%s\t%zu\t%zu\t%zu\t%ju\n", INTERN_NAME(&modules, id),
+			    mstats[id].count[ACT_CREATE], mstats[id].count[ACT_PATCH],
+			    mstats[id].count[ACT_REMOVE], mstats[id].bytes);
+		else
+			puts(INTERN_NAME(&modules, id));
+	FLEXARR_FREE(mstats, sall);
+	intern_free(&modules);
+	arena_free(&arena);
+	if (fclose(db.file) == EOF)
+		err(1, "Could not close the database index '%s'", db.idx);
+	return (0);
+}
+
+/*
+ * Should the records in the view be written out in the wide text format?
+ * Keep a text index's version, use the older one for a binary index if
+ * it would not need to be upgraded soon.
+ */
+static bool
+index_view_wide(const struct index_view * const v)
+{
+	if (v->format == INDEX_TEXT)
+		return (v->num_size == INDEX_WIDE_NUM_SIZE);
+	return (v->header.next_idx >= INDEX_UPGRADE_AT);
+}
+
+/*
+ * Write out the records of the database index in the text format,
+ * optionally skipping the rolled-back ones.
+ */
+static bool
+index_write_text(FILE * const fp, const struct index_view * const v, const char * const db_idx, const bool wide, const bool live_only)
+{
+	const int width = wide ? INDEX_WIDE_NUM_SIZE : INDEX_NUM_SIZE;
+	if (wide)
+		fputs(INDEX_WIDE_HEADER, fp);
+	struct index_rec rec;
+	size_t pos = v->start;
+	while (index_next(v, &pos, db_idx, &rec)) {
+		if (live_only && rec.action >= ACT_UNCREATE)
+			continue;
+		fprintf(fp, "%0*zu ", width, rec.idx);
+		fwrite(rec.module, 1, rec.module_len, fp);
+		fprintf(fp, " %s ", index_action_names[rec.action]);
+		fwrite(rec.filename, 1, rec.filename_len, fp);
+		putc('\n', fp);
+	}
+	fprintf(fp, "%0*zu\n", width, rec.idx);
+	return (!ferror(fp));
+}
+
+/*
+ * Write out the records of the database index in the binary format,
+ * defining each module before its first entry, optionally skipping
+ * the rolled-back ones.
+ */
+static bool
+index_write_binary(FILE * const fp, const struct index_view * const v, const char * const db_idx, const bool live_only)
+{
+	struct binidx_header h = {
+		.version = BINIDX_VERSION,
+		.end = BINIDX_HEADER_SIZE,
+	};
+	unsigned char hbuf[BINIDX_HEADER_SIZE];
+	binidx_encode_header(hbuf, &h);
+	fwrite(hbuf, 1, sizeof(hbuf), fp);
+
+	struct arena arena = ARENA_INIT;
+	struct intern modules = INTERN_INIT(&arena);
+	unsigned char *buf;
+	size_t blen, balloc;
+	FLEXARR_INIT(buf, blen, balloc);
+	bool res = true;
+	struct index_rec rec;
+	size_t pos = v->start;
+	while (res && index_next(v, &pos, db_idx, &rec)) {
+		if (live_only && rec.action >= ACT_UNCREATE)
+			continue;
+		const size_t need = BINIDX_MODULE_SIZE + rec.module_len + BINIDX_ENTRY_SIZE + rec.filename_len;
+		if (need > balloc)
+			FLEXARR_ALLOC(buf, need - blen, blen, balloc);
+
+		const size_t id = intern_id(&modules, rec.module, rec.module_len);
+		size_t len = 0;
+		if (id == h.module_count) {
+			len = binidx_encode_module(buf, id, h.last_module, rec.module, rec.module_len);
+			h.last_module = h.end;
+			h.module_count++;
+		}
+		const bool undone = rec.action >= ACT_UNCREATE;
+		const size_t entry_len = binidx_encode_entry(buf + len,
+		    undone ? BINIDX_STATUS_UNDONE : BINIDX_STATUS_LIVE,
+		    undone ? rec.action - ACT_UNCREATE : rec.action,
+		    id, rec.idx, rec.filename, rec.filename_len);
+		if (entry_len == 0) {
+			warnx("Could not encode the database index entry at %zu", rec.idx);
+			res = false;
+			break;
+		}
+		len += entry_len;
+		fwrite(buf, 1, len, fp);
+		h.end += len;
+		h.count++;
+	}
+	FLEXARR_FREE(buf, balloc);
+	intern_free(&modules);
+	arena_free(&arena);
+	if (!res)
+		return (false);
+
+	h.next_idx = rec.idx;
+	binidx_encode_header(hbuf, &h);
+	return (fflush(fp) != EOF && !ferror(fp) &&
+	    pwrite(fileno(fp), hbuf, sizeof(hbuf), 0) == sizeof(hbuf));
+}
+
+static int
+cmd_db_dump(const int argc, char * const argv[] __unused)
+{
+	if (argc > 1)
+		usage(true);
+
+	const struct txn_db db = open_db_snapshot();
+	struct index_view view = index_view_open(&db);
+	if (!index_write_text(stdout, &view, db.idx, index_view_wide(&view), false) ||
+	    fflush(stdout) == EOF)
+		err(1, "Could not write out the database index");
+	index_view_close(&view);
+	if (fclose(db.file) == EOF)
+		err(1, "Could not close the database index '%s'", db.idx);
+	return (0);
+}
+
+/*
+ * Rewrite the database index in the specified format, writing it out
+ * to a temporary file and then renaming it over the old one.
+ */
+static bool
+index_rewrite(const struct txn_db * const db, const enum index_format format, const bool force_wide, const bool live_only)
+{
+	struct stat sb;
+	if (fstat(fileno(db->file), &sb) == -1)
+		err(1, "Could not examine the database index '%s'", db->idx);
+	char *temp;
+	if (asprintf(&temp, "%s.XXXXXX", db->idx) < 0)
+		err(1, "Could not allocate memory for a temporary filename");
+	const int fd = mkstemp(temp);
+	if (fd == -1)
+		err(1, "Could not create a temporary file for the database index '%s'", db->idx);
+	FILE * const fp = fdopen(fd, "w");
+	if (fp == NULL) {
+		const int save_errno = errno;
+		close(fd);
+		unlink(temp);
+		errno = save_errno;
+		err(1, "Could not reopen the temporary file '%s'", temp);
+	}
+
+	struct index_view view = index_view_open(db);
+	bool res = format == INDEX_BINARY ?
+	    index_write_binary(fp, &view, db->idx, live_only) :
+	    index_write_text(fp, &view, db->idx, force_wide || index_view_wide(&view), live_only);
+	index_view_close(&view);
+	if (!res || fflush(fp) == EOF) {
+		warn("Could not write out the database index to '%s'", temp);
+		res = false;
+	} else if (fchmod(fd, sb.st_mode & 07777) == -1 ||
+	    ((sb.st_uid != geteuid() || sb.st_gid != getegid()) &&
+	     fchown(fd, sb.st_uid, sb.st_gid) == -1)) {
+		warn("Could not set the ownership and mode of '%s'", temp);
+		res = false;
+	} else if (fsync(fd) == -1) {
+		warn("Could not sync '%s'", temp);
+		res = false;
+	}
+	if (fclose(fp) == EOF && res) {
+		warn("Could not close '%s'", temp);
+		res = false;
+	}
+	if (res && rename(temp, db->idx) == -1) {
+		warn("Could not rename '%s' to '%s'", temp, db->idx);
+		res = false;
+	} else if (res) {
+		res = sync_dir(db, db->idx) && sync_commit(db);
+	}
+	if (!res)
+		unlink(temp);
+	free(temp);
+	return (res);
+}
+
+static int
+cmd_db_convert(const int argc, char * const argv[])
+{
+	if (argc != 2)
+		usage(true);
+	enum index_format format;
+	if (!parse_index_format(argv[1], &format))
+		errx(1, "Invalid database index format '%s'", argv[1]);
+
+	const struct txn_db db = open_db();
+	const bool res = db.format == format || index_rewrite(&db, format, false, false);
+	fclose(db.file);
+	return (res ? 0 : 1);
+}
+
+/* Upgrade a version 1 text index to the wide serial numbers format. */
+static int
+cmd_db_upgrade(const int argc, char * const argv[] __unused)
+{
+	if (argc > 1)
+		usage(true);
+
+	const struct txn_db db = open_db();
+	const bool res = db.format != INDEX_TEXT || db.num_size != INDEX_NUM_SIZE ||
+	    index_rewrite(&db, INDEX_TEXT, true, false);
+	fclose(db.file);
+	return (res ? 0 : 1);
+}
+
+static int
+cmp_size(const void * const a, const void * const b)
+{
+	const size_t va = *(const size_t *)a, vb = *(const size_t *)b;
+	return (va < vb ? -1 : va > vb);
+}
+
+/*
+ * Remove the artifact files in a directory that are not referenced by
+ * any of the sorted serial numbers in the live array.
+ */
+static bool
+compact_artifact_dir(const char * const dir, const size_t * const live, const size_t nlive, size_t * const files, uintmax_t * const bytes)
+{
+	DIR * const d = opendir(dir);
+	if (d == NULL) {
+		warn("Could not read the artifact directory '%s'", dir);
+		return (false);
+	}
+	const int dfd = dirfd(d);
+	bool res = true;
+	const struct dirent *ent;
+	while (res && (errno = 0, ent = readdir(d)) != NULL) {
+		size_t idx;
+		const char *suffix;
+		if (!artifact_name_parse(ent->d_name, &idx, &suffix) ||
+		    bsearch(&idx, live, nlive, sizeof(*live), cmp_size) != NULL)
+			continue;
+
+		struct stat sb;
+		if (fstatat(dfd, ent->d_name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+			warn("Could not examine '%s/%s'", dir, ent->d_name);
+			res = false;
+		} else if (unlinkat(dfd, ent->d_name, 0) == -1) {
+			warn("Could not remove '%s/%s'", dir, ent->d_name);
+			res = false;
+		} else {
+			(*files)++;
+			/* The space taken by a blob is only freed along with its last link. */
+			if (sb.st_nlink == 1)
+				*bytes += sb.st_size;
+		}
+	}
+	if (res && errno != 0) {
+		warn("Could not read the artifact directory '%s'", dir);
+		res = false;
+	}
+	closedir(d);
+	return (res);
+}
+
+/*
+ * Call a function for each subdirectory with a numeric name, then try
+ * to remove it in case it was left empty.
+ */
+static bool
+shard_walk(const char * const dir, bool (* const func)(const char *, void *), void * const arg)
+{
+	DIR * const d = opendir(dir);
+	if (d == NULL) {
+		warn("Could not read the artifact directory '%s'", dir);
+		return (false);
+	}
+	bool res = true;
+	const struct dirent *ent;
+	while (res && (errno = 0, ent = readdir(d)) != NULL) {
+		if (ent->d_name[0] == '\0' || strspn(ent->d_name, "0123456789") != strlen(ent->d_name))
+			continue;
+		char *path;
+		if (asprintf(&path, "%s/%s", dir, ent->d_name) < 0)
+			err(1, "Could not allocate memory for an artifact directory name");
+		res = func(path, arg);
+		if (res && rmdir(path) == -1 && errno != ENOTEMPTY && errno != EEXIST) {
+			warn("Could not remove the empty '%s' directory", path);
+			res = false;
+		}
+		free(path);
+		errno = 0;
+	}
+	if (res && errno != 0) {
+		warn("Could not read the artifact directory '%s'", dir);
+		res = false;
+	}
+	closedir(d);
+	return (res);
+}
+
+struct compact_state {
+	const size_t	*live;
+	size_t		nlive;
+	size_t		*files;
+	uintmax_t	*bytes;
+};
+
+static bool
+compact_shard_leaf(const char * const dir, void * const arg)
+{
+	const struct compact_state * const st = arg;
+	return (compact_artifact_dir(dir, st->live, st->nlive, st->files, st->bytes));
+}
+
+static bool
+compact_shard_top(const char * const dir, void * const arg)
+{
+	return (shard_walk(dir, compact_shard_leaf, arg));
+}
+
+/*
+ * Remove the artifact files that are not referenced by any of
+ * the sorted serial numbers in the live array, as well as any
+ * subdirectories of the sharded layout that were left empty.
+ * In the sharded layout, the artifacts left in the database directory
+ * by an interrupted db-shard command are all links to the moved ones.
+ */
+static bool
+compact_artifacts(const struct txn_db * const db, const size_t * const live, const size_t nlive, size_t * const files, uintmax_t * const bytes)
+{
+	if (!compact_artifact_dir(db->dir, live, db->sharded ? 0 : nlive, files, bytes))
+		return (false);
+	if (!db->sharded)
+		return (true);
+
+	char *path;
+	if (asprintf(&path, "%s/" SHARDS_DIR, db->dir) < 0)
+		err(1, "Could not allocate memory for the artifact directory path");
+	struct compact_state st = {
+		.live = live,
+		.nlive = nlive,
+		.files = files,
+		.bytes = bytes,
+	};
+	const bool res = shard_walk(path, compact_shard_top, &st);
+	free(path);
+	return (res);
+}
+
+/*
+ * Remove the blobs that no artifact file is a link to any more, as well
+ * as any temporary files left over in the blob store.
+ */
+static bool
+compact_blobs(const struct txn_db * const db, size_t * const files, uintmax_t * const bytes)
+{
+	char *path;
+	if (asprintf(&path, "%s/" BLOBS_DIR, db->dir) < 0)
+		err(1, "Could not allocate memory for the blob store path");
+	DIR * const d = opendir(path);
+	if (d == NULL) {
+		warn("Could not read the blob store directory '%s'", path);
+		free(path);
+		return (false);
+	}
+	const int dfd = dirfd(d);
+	bool res = true;
+	const struct dirent *ent;
+	while (res && (errno = 0, ent = readdir(d)) != NULL) {
+		const bool temp = strncmp(ent->d_name, BLOBS_TEMP_PREFIX, strlen(BLOBS_TEMP_PREFIX)) == 0;
+		if (temp) {
+			struct stat sb;
+			if (fstatat(dfd, ent->d_name, &sb, AT_SYMLINK_NOFOLLOW) == 0 &&
+			    unlinkat(dfd, ent->d_name, 0) == 0) {
+				(*files)++;
+				*bytes += sb.st_size;
+			}
+			continue;
+		} else if (strlen(ent->d_name) != 2 || strspn(ent->d_name, "0123456789abcdef") != 2) {
+			continue;
+		}
+
+		const int sfd = openat(dfd, ent->d_name, O_RDONLY | O_DIRECTORY);
+		DIR * const sd = sfd == -1 ? NULL : fdopendir(sfd);
+		if (sd == NULL) {
+			warn("Could not read the blob directory '%s/%s'", path, ent->d_name);
+			if (sfd != -1)
+				close(sfd);
+			res = false;
+			break;
+		}
+		const struct dirent *sent;
+		while (res && (errno = 0, sent = readdir(sd)) != NULL) {
+			if (strlen(sent->d_name) != SHA256_HEX_SIZE)
+				continue;
+			struct stat sb;
+			if (fstatat(sfd, sent->d_name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+				warn("Could not examine '%s/%s/%s'", path, ent->d_name, sent->d_name);
+				res = false;
+			} else if (!S_ISREG(sb.st_mode) || sb.st_nlink > 1) {
+				continue;
+			} else if (unlinkat(sfd, sent->d_name, 0) == -1) {
+				warn("Could not remove '%s/%s/%s'", path, ent->d_name, sent->d_name);
+				res = false;
+			} else {
+				(*files)++;
+				*bytes += sb.st_size;
+			}
+		}
+		if (res && errno != 0) {
+			warn("Could not read the blob directory '%s/%s'", path, ent->d_name);
+			res = false;
+		}
+		closedir(sd);
+	}
+	if (res && errno != 0) {
+		warn("Could not read the blob store directory '%s'", path);
+		res = false;
+	}
+	closedir(d);
+	free(path);
+	return (res);
+}
+
+/*
+ * Forget about the packed artifacts that no live entry refers to and
+ * get the total size of the rest.
+ */
+static bool
+compact_pack_locations(const struct txn_db * const db, const size_t * const live, const size_t nlive, uintmax_t * const live_bytes)
+{
+	const struct artifact_pack * const pack = db->pack;
+	unsigned char buf[1024 * BINIDX_LOCATION_SIZE];
+	*live_bytes = 0;
+	for (size_t base = 0; ; base += sizeof(buf) / BINIDX_LOCATION_SIZE) {
+		const ssize_t n = pread(pack->loc_fd, buf, sizeof(buf), (off_t)base * BINIDX_LOCATION_SIZE);
+		if (n == -1) {
+			warn("Could not read the pack location table in '%s'", pack->dir);
+			return (false);
+		}
+		for (size_t i = 0; i < (size_t)n / BINIDX_LOCATION_SIZE; i++) {
+			struct binidx_location loc;
+			if (!binidx_decode_location(buf + i * BINIDX_LOCATION_SIZE, &loc))
+				continue;
+			const size_t idx = base + i;
+			if (bsearch(&idx, live, nlive, sizeof(*live), cmp_size) != NULL)
+				*live_bytes += loc.length;
+			else if (!pack_location_write(pack, idx, NULL))
+				return (false);
+		}
+		if (n < (ssize_t)sizeof(buf))
+			return (true);
+	}
+}
+
+/* Append a part of an old segment to the current one. */
+static bool
+compact_pack_copy(const struct txn_db * const db, const int src_fd, const char * const src, const struct binidx_location * const loc)
+{
+	struct artifact_pack * const pack = db->pack;
+	char buf[ARTIFACT_IO_SIZE];
+	for (uint64_t done = 0; done < loc->length; ) {
+		const size_t want = loc->length - done < sizeof(buf) ? loc->length - done : sizeof(buf);
+		const ssize_t n = pread(src_fd, buf, want, loc->offset + done);
+		if (n <= 0) {
+			if (n == -1)
+				warn("Could not read from '%s'", src);
+			else
+				warnx("Unexpected end of the pack segment '%s'", src);
+			return (false);
+		} else if (!writen(pack->seg_fd, buf, n)) {
+			warn("Could not write to '%s'", pack->seg_path);
+			return (false);
+		}
+		done += n;
+	}
+	pack->seg_size += loc->length;
+	pack->dirty = db->sync->mode != SYNC_NONE;
+	return (true);
+}
+
+struct pack_move {
+	size_t			idx;
+	struct binidx_location	loc;
+};
+
+/*
+ * Copy the live packed artifacts into new segments and remove the old
+ * ones.  The new segments reach the disk before the locations are
+ * updated and the locations before the old segments are removed, so
+ * an interrupted compaction only leaves some data to be dropped later.
+ */
+static bool
+compact_pack(const struct txn_db * const db, const size_t * const live, const size_t nlive, size_t * const files, uintmax_t * const bytes)
+{
+	struct artifact_pack * const pack = db->pack;
+	long first, last;
+	size_t count;
+	uintmax_t old_bytes, live_bytes;
+	if (!pack_scan(pack, &first, &last, &count, &old_bytes) ||
+	    !compact_pack_locations(db, live, nlive, &live_bytes))
+		return (false);
+	if (live_bytes == old_bytes)
+		return (true);
+
+	struct pack_move *moves;
+	size_t nmoves, amoves;
+	FLEXARR_INIT(moves, nmoves, amoves);
+	char *src = NULL;
+	int src_fd = -1;
+	uint32_t src_seg = 0;
+	bool res = true;
+	for (size_t i = 0; res && i < nlive; i++) {
+		struct binidx_location loc;
+		const int found = pack_location_read(pack, live[i], &loc);
+		if (found != 1) {
+			res = found == 0;
+			continue;
+		}
+		if (src_fd == -1 || loc.segment != src_seg) {
+			if (src_fd != -1)
+				close(src_fd);
+			free(src);
+			src = pack_segment_path(pack, loc.segment);
+			src_seg = loc.segment;
+			src_fd = open(src, O_RDONLY);
+			if (src_fd == -1) {
+				warn("Could not open the pack segment '%s'", src);
+				res = false;
+				break;
+			}
+		}
+		if ((pack->seg_fd == -1 || pack->seg_size >= PACK_SEGMENT_SIZE) && !pack_roll(db)) {
+			res = false;
+			break;
+		}
+		FLEXARR_ALLOC(moves, 1, nmoves, amoves);
+		moves[nmoves - 1] = (struct pack_move){
+			.idx = live[i],
+			.loc = {
+				.segment = pack->last_seg,
+				.offset = pack->seg_size,
+				.length = loc.length,
+				.crc = loc.crc,
+			},
+		};
+		res = compact_pack_copy(db, src_fd, src, &loc);
+	}
+	if (src_fd != -1)
+		close(src_fd);
+	free(src);
+
+	res = res && (!pack->dirty || pack_sync(db));
+	for (size_t i = 0; res && i < nmoves; i++)
+		res = pack_location_write(pack, moves[i].idx, &moves[i].loc);
+	FLEXARR_FREE(moves, amoves);
+	res = res && (db->sync->mode == SYNC_NONE || pack_sync(db)) && sync_commit(db);
+	if (!res)
+		return (false);
+
+	for (long seg = first; seg >= 0 && seg <= last; seg++) {
+		char * const path = pack_segment_path(pack, seg);
+		if (unlink(path) == 0) {
+			(*files)++;
+		} else if (errno != ENOENT) {
+			warn("Could not remove the pack segment '%s'", path);
+			res = false;
+		}
+		free(path);
+	}
+	*bytes = old_bytes - live_bytes;
+	return (res && sync_dir(db, pack->dir));
+}
+
+/*
+ * Drop the rolled-back entries from the database index and remove
+ * the artifacts that no live entry refers to.  The serial numbers of
+ * the live entries are kept, so their artifacts need not be renamed.
+ */
+static int
+cmd_db_compact(const int argc, char * const argv[] __unused)
+{
+	if (argc > 1)
+		usage(true);
+
+	const struct txn_db db = open_db();
+	struct stat sb;
+	if (fstat(fileno(db.file), &sb) == -1)
+		err(1, "Could not examine the database index '%s'", db.idx);
+
+	size_t *live, nlive, nall, dead = 0;
+	FLEXARR_INIT(live, nlive, nall);
+	struct index_view view = index_view_open(&db);
+	struct index_rec rec;
+	for (size_t pos = view.start; index_next(&view, &pos, db.idx, &rec); ) {
+		if (rec.action >= ACT_UNCREATE) {
+			dead++;
+		} else {
+			FLEXARR_ALLOC(live, 1, nlive, nall);
+			live[nlive - 1] = rec.idx;
+		}
+	}
+	index_view_close(&view);
+	qsort(live, nlive, sizeof(*live), cmp_size);
+
+	uintmax_t idx_bytes = 0;
+	if (dead > 0) {
+		if (!index_rewrite(&db, db.format, false, true))
+			exit(1);
+		struct stat nsb;
+		if (stat(db.idx, &nsb) == -1)
+			err(1, "Could not examine the database index '%s'", db.idx);
+		idx_bytes = sb.st_size - nsb.st_size;
+	}
+
+	size_t files = 0;
+	uintmax_t art_bytes = 0;
+	bool res = compact_artifacts(&db, live, nlive, &files, &art_bytes);
+	size_t blob_files = 0;
+	uintmax_t blob_bytes = 0;
+	if (res && db.dedup)
+		res = compact_blobs(&db, &blob_files, &blob_bytes);
+	size_t pack_files = 0;
+	uintmax_t pack_bytes = 0;
+	if (res && db.pack != NULL)
+		res = compact_pack(&db, live, nlive, &pack_files, &pack_bytes);
+	FLEXARR_FREE(live, nall);
+	if (!sync_commit(&db))
+		res = false;
+	fclose(db.file);
+
+	printf("index: %zu entries, %ju bytes reclaimed\n", dead, idx_bytes);
+	printf("artifacts: %zu files, %ju bytes reclaimed\n", files, art_bytes);
+	if (db.dedup)
+		printf("blobs: %zu files, %ju bytes reclaimed\n", blob_files, blob_bytes);
+	if (db.pack != NULL)
+		printf("pack: %zu segments, %ju bytes reclaimed\n", pack_files, pack_bytes);
+	return (res ? 0 : 1);
+}
+
+/*
+ * Create a subdirectory of the database directory, e.g. the blob store
+ * one to enable deduplication.
+ */
+static void
+db_subdir_init(const char * const dir, const char * const name)
+{
+	char *path;
+	if (asprintf(&path, "%s/%s", dir, name) < 0)
+		err(1, "Could not allocate memory for the '%s' directory path", name);
+	if (mkdir(path, 0755) == -1 && errno != EEXIST)
+		err(1, "Could not create the '%s' directory", path);
+	free(path);
+}
+
+static bool
+artifact_copy(struct artifact_writer * const w, struct artifact_file * const f)
+{
+	struct artifact_reader r;
+	if (!artifact_reader_open(&r, f))
+		return (false);
+	char buf[ARTIFACT_IO_SIZE];
+	ssize_t n;
+	while (n = artifact_read(&r, buf, sizeof(buf)), n > 0)
+		if (!artifact_write(w, buf, n)) {
+			n = -1;
+			break;
+		}
+	artifact_reader_close(&r);
+	return (n == 0);
+}
+
+/*
+ * Move the contents of an artifact into the blob store, replacing it
+ * atomically with a link or, for a saved file, with its metadata.
+ */
+static bool
+dedup_artifact(const struct txn_db * const db, const size_t idx, const char * const suffix, const bool removal, size_t * const files, uintmax_t * const bytes)
+{
+	char * const path = artifact_path(db, idx, suffix);
+	struct artifact_file f;
+	if (!artifact_open_path(&f, path)) {
+		const bool gone = errno == ENOENT;
+		if (!gone)
+			warn("Could not open '%s'", path);
+		free(path);
+		return (gone);
+	}
+	struct stat sb;
+	if (fstat(f.fd, &sb) == -1) {
+		warn("Could not examine '%s'", path);
+		artifact_close(&f);
+		free(path);
+		return (false);
+	}
+
+	struct stat orig_sb;
+	bool separate = false;
+	if (removal && !artifact_read_meta(&f, &orig_sb, &separate)) {
+		warnx("Could not read the removal metadata from '%s'", path);
+		artifact_close(&f);
+		free(path);
+		return (false);
+	}
+	/* Already converted? */
+	if (!removal && sb.st_nlink > 1) {
+		artifact_close(&f);
+		free(path);
+		return (true);
+	} else if (separate) {
+		/* The contents may still be a plain copy kept apart. */
+		artifact_close(&f);
+		free(path);
+		return (dedup_artifact(db, idx, ARTIFACT_DATA_SUFFIX, false, files, bytes));
+	}
+
+	/* Replace the artifact file via a temporary name in the blob store. */
+	char *temp;
+	if (asprintf(&temp, "%s/" BLOBS_DIR "/" BLOBS_TEMP_PREFIX "%06zu", db->dir, idx) < 0)
+		err(1, "Could not allocate memory for a temporary artifact filename");
+	unlink(temp);
+	char * const data = removal ? artifact_path(db, idx, ARTIFACT_DATA_SUFFIX) : NULL;
+	if (data != NULL)
+		artifact_unlink(db, data);
+
+	struct artifact_writer w;
+	bool res = artifact_create(&w, db, idx, data != NULL ? data : temp);
+	if (res && !artifact_copy(&w, &f)) {
+		artifact_abort(&w);
+		res = false;
+	} else if (res) {
+		res = artifact_commit(&w);
+	}
+	artifact_close(&f);
+	if (res && removal)
+		res = artifact_write_meta(db, temp, &orig_sb);
+	if (res && rename(temp, path) == -1) {
+		warn("Could not rename '%s' to '%s'", temp, path);
+		res = false;
+	}
+	if (res) {
+		(*files)++;
+		if (w.shared)
+			*bytes += w.size;
+		res = sync_dir(db, path);
+	} else {
+		unlink(temp);
+		if (data != NULL)
+			artifact_unlink(db, data);
+	}
+	free(data);
+	free(temp);
+	free(path);
+	return (res);
+}
+
+/*
+ * Enable the blob store for an existing database and move the artifacts
+ * of the live index entries into it.
+ */
+static int
+cmd_db_dedup(const int argc, char * const argv[] __unused)
+{
+	if (argc > 1)
+		usage(true);
+
+	const struct txn_db odb = open_db();
+	if (odb.pack != NULL)
+		errx(1, "The content-addressed store cannot be used in the pack mode");
+	db_subdir_init(odb.dir, BLOBS_DIR);
+	const struct txn_db db = {
+		.dir = odb.dir,
+		.idx = odb.idx,
+		.file = odb.file,
+		.module = odb.module,
+		.format = odb.format,
+		.num_size = odb.num_size,
+		.sync = odb.sync,
+		.dedup = true,
+		.sharded = odb.sharded,
+		.pack = odb.pack,
+	};
+
+	size_t files = 0;
+	uintmax_t bytes = 0;
+	bool res = true;
+	struct index_view view = index_view_open(&db);
+	struct index_rec rec;
+	for (size_t pos = view.start; index_next(&view, &pos, db.idx, &rec); )
+		if (rec.action < ACT_UNCREATE &&
+		    !dedup_artifact(&db, rec.idx, "", rec.action != ACT_PATCH, &files, &bytes))
+			res = false;
+	index_view_close(&view);
+	if (!sync_commit(&db))
+		res = false;
+	fclose(db.file);
+
+	printf("artifacts: %zu files, %ju bytes reclaimed\n", files, bytes);
+	return (res ? 0 : 1);
+}
+
+/*
+ * Link the artifact files in the database directory into the sharded
+ * layout being built in the "txn.shards.new" directory, replacing any
+ * links left over from an interrupted db-shard command.
+ */
+static bool
+shard_link_all(const struct txn_db * const db, size_t * const files)
+{
+	DIR * const d = opendir(db->dir);
+	if (d == NULL) {
+		warn("Could not read the database directory '%s'", db->dir);
+		return (false);
+	}
+	bool res = true;
+	const struct dirent *ent;
+	while (res && (errno = 0, ent = readdir(d)) != NULL) {
+		size_t idx;
+		const char *suffix;
+		if (!artifact_name_parse(ent->d_name, &idx, &suffix))
+			continue;
+		char *src;
+		if (asprintf(&src, "%s/%s", db->dir, ent->d_name) < 0)
+			err(1, "Could not allocate memory for an artifact filename");
+		char * const dst = shard_path(db->dir, SHARDS_NEW_DIR, idx, suffix);
+		if (!shard_mkdir(db, dst)) {
+			res = false;
+		} else {
+			bool linked = link(src, dst) == 0;
+			if (!linked && errno == EEXIST)
+				linked = unlink(dst) == 0 && link(src, dst) == 0;
+			if (!linked) {
+				warn("Could not link '%s' to '%s'", dst, src);
+				res = false;
+			} else {
+				(*files)++;
+				res = sync_dir(db, dst);
+			}
+		}
+		free(dst);
+		free(src);
+		errno = 0;
+	}
+	if (res && errno != 0) {
+		warn("Could not read the database directory '%s'", db->dir);
+		res = false;
+	}
+	closedir(d);
+	return (res);
+}
+
+/*
+ * Remove the artifact files in the database directory after making sure
+ * that they are also in the sharded layout.
+ */
+static bool
+shard_unlink_flat(const struct txn_db * const db)
+{
+	DIR * const d = opendir(db->dir);
+	if (d == NULL) {
+		warn("Could not read the database directory '%s'", db->dir);
+		return (false);
+	}
+	const int dfd = dirfd(d);
+	bool res = true;
+	const struct dirent *ent;
+	while (res && (errno = 0, ent = readdir(d)) != NULL) {
+		size_t idx;
+		const char *suffix;
+		if (!artifact_name_parse(ent->d_name, &idx, &suffix))
+			continue;
+		char * const path = artifact_path(db, idx, suffix);
+		struct stat fsb, ssb;
+		if (fstatat(dfd, ent->d_name, &fsb, AT_SYMLINK_NOFOLLOW) == -1) {
+			warn("Could not examine '%s/%s'", db->dir, ent->d_name);
+			res = false;
+		} else if (lstat(path, &ssb) == -1 ||
+		    fsb.st_dev != ssb.st_dev || fsb.st_ino != ssb.st_ino) {
+			warnx("'%s/%s' was not moved to '%s'", db->dir, ent->d_name, path);
+			res = false;
+		} else if (unlinkat(dfd, ent->d_name, 0) == -1) {
+			warn("Could not remove '%s/%s'", db->dir, ent->d_name);
+			res = false;
+		}
+		free(path);
+		errno = 0;
+	}
+	if (res && errno != 0) {
+		warn("Could not read the database directory '%s'", db->dir);
+		res = false;
+	}
+	closedir(d);
+	return (res && sync_dir(db, db->idx));
+}
+
+/*
+ * Switch an existing database to the sharded layout: link the artifacts
+ * into a new directory tree, put it in place with a single rename, and
+ * only then remove them from the database directory, so that they may
+ * be found at all times.  If interrupted, the command may be run again.
+ */
+static int
+cmd_db_shard(const int argc, char * const argv[] __unused)
+{
+	if (argc > 1)
+		usage(true);
+
+	const struct txn_db odb = open_db();
+	if (odb.pack != NULL)
+		errx(1, "The sharded layout cannot be used in the pack mode");
+	const struct txn_db db = {
+		.dir = odb.dir,
+		.idx = odb.idx,
+		.file = odb.file,
+		.module = odb.module,
+		.format = odb.format,
+		.num_size = odb.num_size,
+		.sync = odb.sync,
+		.dedup = odb.dedup,
+		.sharded = true,
+		.pack = odb.pack,
+	};
+
+	size_t files = 0;
+	bool res = true;
+	if (!odb.sharded) {
+		char *new_dir, *dir;
+		if (asprintf(&new_dir, "%s/" SHARDS_NEW_DIR, db.dir) < 0 ||
+		    asprintf(&dir, "%s/" SHARDS_DIR, db.dir) < 0)
+			err(1, "Could not allocate memory for the artifact directory path");
+		/* The new tree must reach the disk before it is put in place. */
+		res = make_dir(&odb, new_dir) && shard_link_all(&odb, &files) &&
+		    sync_commit(&odb);
+		if (res && rename(new_dir, dir) == -1) {
+			warn("Could not rename '%s' to '%s'", new_dir, dir);
+			res = false;
+		}
+		res = res && sync_dir(&db, dir) && sync_commit(&db);
+		free(dir);
+		free(new_dir);
+	}
+	if (res)
+		res = shard_unlink_flat(&db);
+	if (!sync_commit(&db))
+		res = false;
+	fclose(db.file);
+
+	printf("artifacts: %zu files moved\n", files);
+	return (res ? 0 : 1);
+}
+
+/*
+ * Open the database index to record changes, upgrading a version 1 text
+ * index first if it is about to run out of serial numbers.
+ */
+static struct txn_db
+open_db_for_update(const char * const dir, const char * const idx)
+{
+	const struct txn_db db = do_open_db(dir, idx);
+	if (db.format != INDEX_TEXT || db.num_size != INDEX_NUM_SIZE)
+		return (db);
+
+	struct index_view view = index_view_open(&db);
+	size_t next_idx;
+	const bool upgrade = index_view_next_idx(&view, db.idx, &next_idx) &&
+	    next_idx >= INDEX_UPGRADE_AT;
+	index_view_close(&view);
+	if (!upgrade)
+		return (db);
+
+	if (!index_rewrite(&db, INDEX_TEXT, true, false))
+		exit(1);
+	fclose(db.file);
+	return (do_open_db(dir, idx));
+}
+
+static struct txn_db
+open_or_create_db(const bool may_exist, const enum index_format format)
+{
+	const char * const dir = get_db_dir();
+	const char * const idx = get_db_index(dir);
+	struct stat sb;
+	if (stat(dir, &sb) == -1) {
+		if (errno != ENOENT)
+			err(1, "Could not check for the existence of '%s'", dir);
+		if (mkdir(dir, 0755) == -1)
+			err(1, "Could not create the database directory '%s'", dir);
+	} else if (!S_ISDIR(sb.st_mode)) {
+		errx(1, "Not a directory: %s", dir);
+	} else {
+		if (stat(idx, &sb) == -1) {
+			if (errno != ENOENT)
+				err(1, "Could not check for the existence of '%s'", idx);
+		} else if (!S_ISREG(sb.st_mode)) {
+			errx(1, "Not a regular file: %s", idx);
+		} else if (!may_exist) {
+			errx(1, "The database index '%s' already exists", idx);
+		} else {
+			return (open_db_for_update(dir, idx));
+		}
+	}
+
+	const int fd = open(idx, O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (fd == -1)
+		err(1, "Could not create the database index '%s'", idx);
+	if (format == INDEX_BINARY) {
+		unsigned char buf[BINIDX_HEADER_SIZE];
+		binidx_encode_header(buf, &(struct binidx_header){
+			.version = BINIDX_VERSION,
+			.end = BINIDX_HEADER_SIZE,
+		});
+		if (!writen(fd, (const char *)buf, sizeof(buf)))
+			err(1, "Could not write out an empty database index '%s'", idx);
+	} else if (!writen(fd, INDEX_FIRST, INDEX_NUM_SIZE + 1)) {
+		err(1, "Could not write out an empty database index '%s'", idx);
+	}
+	if (close(fd) == -1)
+		err(1, "Could not close the newly-created database index '%s'", idx);
+	const struct txn_db db = do_open_db(dir, idx);
+	modidx_init(&db);
+	return (db);
+}
+
+static int
+cmd_db_init(const int argc, char * const argv[])
+{
+	enum index_format format = INDEX_TEXT;
+	bool dedup = false, packed = false, sharded = false;
+	int ch;
+	optind = 0;
+	while (ch = getopt(argc, argv, "df:ps-:"), ch != -1)
+		switch (ch) {
+			case 'd':
+				dedup = true;
+				break;
+
+			case 'f':
+				if (!parse_index_format(optarg, &format))
+					errx(1, "Invalid database index format '%s'", optarg);
+				break;
+
+			case 'p':
+				packed = true;
+				break;
+
+			case 's':
+				sharded = true;
+				break;
+
+			case '-':
+				if (strncmp(optarg, "format=", 7) == 0) {
+					if (!parse_index_format(optarg + 7, &format))
+						errx(1, "Invalid database index format '%s'", optarg + 7);
+					break;
+				} else if (strcmp(optarg, "dedup") == 0) {
+					dedup = true;
+					break;
+				} else if (strcmp(optarg, "pack") == 0) {
+					packed = true;
+					break;
+				} else if (strcmp(optarg, "sharded") == 0) {
+					sharded = true;
+					break;
+				}
+				warnx("Invalid long option '%s' specified", optarg);
+				usage(true);
+				/* NOTREACHED */
+
+			default:
+				usage(true);
+				/* NOTREACHED */
+		}
+	if (argc > optind)
+		usage(true);
+	if (packed && (dedup || sharded))
+		errx(1, "The pack mode cannot be combined with the content-addressed store or the sharded layout");
+
+	const struct txn_db db = open_or_create_db(false, format);
+	if (dedup)
+		db_subdir_init(db.dir, BLOBS_DIR);
+	if (sharded)
+		db_subdir_init(db.dir, SHARDS_DIR);
+	if (packed) {
+		db_subdir_init(db.dir, PACK_DIR);
+		/* Create the empty location table. */
+		pack_open(db.dir, false);
+	}
+	return (0);
+}
+
+static const char *
+get_destination_filename(const char * const src, const char * const dst)
+{
+	struct stat sb;
+	if (stat(dst, &sb) == -1) {
+		if (errno != ENOENT)
+			err(1, "Could not check for the existence of %s", dst);
+		else
+			return dst;
+	} else if (!S_ISDIR(sb.st_mode)) {
+		return dst;
+	}
+
+	const char * const last_slash = strrchr(src, '/');
+	const char * const filename = last_slash != NULL ? last_slash + 1 : src;
+
+	const size_t len = strlen(dst);
+	const bool has_slash = len == 0 ? false : dst[len - 1] == '/';
+
+	char *full;
+	if (asprintf(&full, "%s%s%s", dst, has_slash ? "" : "/", filename) == -1)
+		err(1, "Could not build a destination pathname");
+	if (strlen(full) < 2)
+		errx(1, "For txn-install's purposes, the destination filename should be at least two characters long");
+	return (full);
+}
+
+static bool
+write_index_header(const struct txn_db * const db, const struct binidx_header * const h)
+{
+	unsigned char buf[BINIDX_HEADER_SIZE];
+	binidx_encode_header(buf, h);
+	if (fflush(db->file) == EOF ||
+	    pwrite(fileno(db->file), buf, sizeof(buf), 0) != sizeof(buf)) {
+		warn("Could not update the header of the database index '%s'", db->idx);
+		return (false);
+	}
+	return (true);
+}
+
+/*
+ * Look a module up in a binary index by following the chain of module
+ * definitions back from the last one, reading only those records.
+ * Set the module's id, or the next free one if it is not defined yet.
+ */
+static bool
+index_binary_find_module(const struct txn_db * const db, const struct binidx_header * const h, const char * const module, const size_t module_len, size_t * const module_id)
+{
+	const int fd = fileno(db->file);
+	size_t size = BINIDX_MODULE_SIZE + module_len;
+	unsigned char *buf = malloc(size);
+	if (buf == NULL) {
+		warn("Could not allocate memory for a database index module");
+		return (false);
+	}
+
+	uint64_t ofs = h->last_module;
+	for (size_t i = 0; i < h->module_count; i++) {
+		struct binidx_record rec;
+		ssize_t n = -1;
+		if (ofs >= BINIDX_HEADER_SIZE && ofs < h->end)
+			n = pread(fd, buf, BINIDX_MODULE_SIZE, (off_t)ofs);
+		if (n == (ssize_t)BINIDX_MODULE_SIZE) {
+			const size_t rec_size = binidx_record_size(buf);
+			if (rec_size > size && rec_size <= h->end - ofs) {
+				unsigned char * const nbuf = realloc(buf, rec_size);
+				if (nbuf == NULL) {
+					warn("Could not allocate memory for a database index module");
+					free(buf);
+					return (false);
+				}
+				buf = nbuf;
+				size = rec_size;
+			}
+			if (rec_size > BINIDX_MODULE_SIZE && rec_size <= size)
+				n = pread(fd, buf, rec_size, (off_t)ofs);
+		}
+		if (n < (ssize_t)BINIDX_MODULE_SIZE ||
+		    !binidx_decode_record(buf, n, &rec) ||
+		    rec.type != BINIDX_MODULE || rec.module >= h->module_count) {
+			warnx("Invalid database index '%s': bad module definition at %" PRIu64, db->idx, ofs);
+			free(buf);
+			return (false);
+		}
+		if (rec.name_len == module_len && memcmp(rec.name, module, module_len) == 0) {
+			*module_id = rec.module;
+			free(buf);
+			return (true);
+		}
+		ofs = rec.prev;
+	}
+	free(buf);
+	*module_id = h->module_count;
+	return (true);
+}
+
+/*
+ * Append an entry to a binary index, defining its module first if
+ * needed, and then update the header.  Return the entry's offset.
+ */
+static bool
+write_db_entry_binary(const struct txn_db * const db, const struct index_line ln, long * const offset)
+{
+	unsigned char head[BINIDX_HEADER_SIZE];
+	struct binidx_header h;
+	if (fflush(db->file) == EOF) {
+		warn("Could not flush the database index '%s'", db->idx);
+		return (false);
+	}
+	const ssize_t n = pread(fileno(db->file), head, sizeof(head), 0);
+	if (n == -1) {
+		warn("Could not read the header of the database index '%s'", db->idx);
+		return (false);
+	}
+	if (!binidx_decode_header(head, n, &h)) {
+		warnx("Invalid database index '%s': bad binary index header", db->idx);
+		return (false);
+	}
+	const size_t module_len = strlen(ln.module);
+	size_t module_id;
+	if (!index_binary_find_module(db, &h, ln.module, module_len, &module_id))
+		return (false);
+
+	const size_t filename_len = strlen(ln.filename);
+	const bool new_module = module_id == h.module_count;
+	unsigned char * const buf = malloc(BINIDX_MODULE_SIZE + module_len + BINIDX_ENTRY_SIZE + filename_len);
+	if (buf == NULL) {
+		warn("Could not allocate memory for a database index entry");
+		return (false);
+	}
+	size_t len = 0;
+	if (new_module) {
+		len = binidx_encode_module(buf, module_id, h.last_module, ln.module, module_len);
+		h.last_module = h.end;
+		h.module_count++;
+	}
+	const size_t entry_len = binidx_encode_entry(buf + len, BINIDX_STATUS_LIVE, ln.action, module_id, ln.idx, ln.filename, filename_len);
+	if ((new_module && len == 0) || entry_len == 0) {
+		warnx("Could not encode a database index entry for '%s'", ln.filename);
+		free(buf);
+		return (false);
+	}
+	*offset = h.end + len;
+	len += entry_len;
+
+	if (fseek(db->file, h.end, SEEK_SET) == -1 ||
+	    fwrite(buf, 1, len, db->file) != len || fflush(db->file) == EOF) {
+		warn("Could not write to the database index '%s'", db->idx);
+		free(buf);
+		return (false);
+	}
+	free(buf);
+	h.count++;
+	h.next_idx = ln.idx + 1;
+	h.end += len;
+	if (!write_index_header(db, &h))
+		return (false);
+	if (fseek(db->file, h.end, SEEK_SET) == -1) {
+		warn("Could not seek in the database index '%s'", db->idx);
+		return (false);
+	}
+	return (true);
+}
+
+/* The largest serial number that fits into a text index. */
+static size_t
+index_text_max_idx(const size_t num_size)
+{
+	size_t max = 0;
+	for (size_t i = 0; i < num_size; i++)
+		max = max * 10 + 9;
+	return (max);
+}
+
+static bool
+write_db_entry_text(const struct txn_db * const db, const struct index_line ln)
+{
+	if (ln.idx + 1 > index_text_max_idx(db->num_size)) {
+		warnx("The database index '%s' is full, run 'txn db-upgrade'", db->idx);
+		return (false);
+	}
+	const int width = db->num_size;
+	if (fprintf(db->file, "%0*zu %s %s %s\n%0*zu\n",
+	    width, ln.idx, ln.module, index_action_names[ln.action],
+	    ln.filename, width, ln.idx + 1) < 0 ||
+	    ferror(db->file)) {
+		warn("Could not write to the database index '%s'", db->idx);
+		return (false);
+	}
+	if (fflush(db->file) == EOF) {
+		warn("Could not sync a write to the database index '%s'", db->idx);
+		return (false);
+	}
+	/* Get ready to overwrite the last line with the next entry. */
+	if (fseek(db->file, -(long)(db->num_size + 1), SEEK_CUR) == -1) {
+		warn("Could not seek back in the database index '%s'", db->idx);
+		return (false);
+	}
+	return (true);
+}
+
+static bool
+write_db_entry(const struct txn_db * const db, const struct index_line ln)
+{
+	if (!index_valid_name(ln.module)) {
+		warnx("Invalid module name '%s'", ln.module);
+		return (false);
+	}
+	long offset = ftell(db->file);
+	if (offset == -1) {
+		warn("Could not get the position in the database index '%s'", db->idx);
+		return (false);
+	}
+	struct modidx_stamp pre;
+	modidx_current(db, ln.idx, &pre);
+	if (db->format == INDEX_BINARY ?
+	    !write_db_entry_binary(db, ln, &offset) :
+	    !write_db_entry_text(db, ln))
+		return (false);
+	modidx_record(db, &pre, ln.module, offset, ln.idx);
+	return (sync_index(db));
+}
+
+static enum cmp_result
+compare_fds(const int src_fd, const char * const src, const int dst_fd, const char * const dst, const size_t size)
+{
+	/* Try to map both files and let memcmp(3) do the vectorized work. */
+	if (size > 0) {
+		void * const src_map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, src_fd, 0);
+		void * const dst_map = src_map == MAP_FAILED ? MAP_FAILED :
+		    mmap(NULL, size, PROT_READ, MAP_PRIVATE, dst_fd, 0);
+		if (dst_map != MAP_FAILED) {
+			posix_madvise(src_map, size, POSIX_MADV_SEQUENTIAL);
+			posix_madvise(dst_map, size, POSIX_MADV_SEQUENTIAL);
+			const bool same = memcmp(src_map, dst_map, size) == 0;
+			munmap(dst_map, size);
+			munmap(src_map, size);
+			return (same ? CMP_SAME : CMP_DIFFERENT);
+		}
+		if (src_map != MAP_FAILED)
+			munmap(src_map, size);
+	}
+
+	/* No luck; fall back to reading large blocks. */
+	char * const src_buf = malloc(2 * CMP_BUF_SIZE);
+	if (src_buf == NULL) {
+		warn("Could not allocate memory for comparing '%s' and '%s'", src, dst);
+		return (CMP_ERROR);
+	}
+	char * const dst_buf = src_buf + CMP_BUF_SIZE;
+	enum cmp_result res;
+	while (true) {
+		const ssize_t src_n = readn(src_fd, src_buf, CMP_BUF_SIZE);
+		if (src_n == -1) {
+			warn("Could not read from '%s'", src);
+			res = CMP_ERROR;
+			break;
+		}
+		const ssize_t dst_n = readn(dst_fd, dst_buf, CMP_BUF_SIZE);
+		if (dst_n == -1) {
+			warn("Could not read from '%s'", dst);
+			res = CMP_ERROR;
+			break;
+		}
+		if (src_n != dst_n || memcmp(src_buf, dst_buf, src_n) != 0) {
+			res = CMP_DIFFERENT;
+			break;
+		}
+		if (src_n == 0) {
+			res = CMP_SAME;
+			break;
+		}
+	}
+	free(src_buf);
+	return (res);
+}
+
+static enum cmp_result
+compare_files(const char * const src, const char * const dst)
+{
+	const int src_fd = open(src, O_RDONLY);
+	if (src_fd == -1) {
+		warn("Could not open '%s' for comparing", src);
+		return (CMP_ERROR);
+	}
+	const int dst_fd = open(dst, O_RDONLY);
+	if (dst_fd == -1) {
+		warn("Could not open '%s' for comparing", dst);
+		close(src_fd);
+		return (CMP_ERROR);
+	}
+
+	enum cmp_result res;
+	struct stat src_sb, dst_sb;
+	if (fstat(src_fd, &src_sb) == -1) {
+		warn("Could not examine '%s'", src);
+		res = CMP_ERROR;
+	} else if (fstat(dst_fd, &dst_sb) == -1) {
+		warn("Could not examine '%s'", dst);
+		res = CMP_ERROR;
+	} else if (src_sb.st_dev == dst_sb.st_dev && src_sb.st_ino == dst_sb.st_ino) {
+		res = CMP_SAME;
+	} else if (!S_ISREG(src_sb.st_mode) || !S_ISREG(dst_sb.st_mode)) {
+		/* Do not trust the size; compare whatever we can read. */
+		res = compare_fds(src_fd, src, dst_fd, dst, 0);
+	} else if (src_sb.st_size != dst_sb.st_size) {
+		res = CMP_DIFFERENT;
+	} else if ((uintmax_t)src_sb.st_size > SIZE_MAX) {
+		res = compare_fds(src_fd, src, dst_fd, dst, 0);
+	} else {
+		res = compare_fds(src_fd, src, dst_fd, dst, src_sb.st_size);
+	}
+
+	close(dst_fd);
+	close(src_fd);
+	return (res);
+}
+
+static enum classifier
+get_classifier(void)
+{
+	const char * const name = getenv("TXN_INSTALL_CLASSIFY");
+	if (name == NULL || strcmp(name, "builtin") == 0)
+		return (CLASSIFY_BUILTIN);
+	else if (strcmp(name, "file") == 0)
+		return (CLASSIFY_FILE);
+	errx(1, "Invalid TXN_INSTALL_CLASSIFY value '%s', expected 'builtin' or 'file'", name);
+}
+
+/*
+ * Look for the word "text" in the output of file(1), the way txn has
+ * always done it.
+ */
+static bool
+classify_file_magic(const char * const src, bool * const is_text)
+{
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC) == -1) {
+		warn("Could not create a pipe for file(1) on '%s'", src);
+		return (false);
+	}
+
+	const pid_t pid = fork();
+	if (pid == -1) {
+		warn("Could not fork for file(1) on '%s'", src);
+		close(fds[0]);
+		close(fds[1]);
+		return (false);
+	} else if (pid == 0) {
+		/* Other threads may hold the stdio locks; do not touch them. */
+		if (dup2(fds[1], 1) == -1)
+			_exit(127);
+		execlp("file", "file", "--", src, NULL);
+		_exit(127);
+	}
+
+	close(fds[1]);
+	FILE * const filefile = fdopen(fds[0], "r");
+	if (filefile == NULL) {
+		warn("Could not reopen the read end of the pipe for '%s'", src);
+		close(fds[0]);
+		waitpid(pid, NULL, 0);
+		return (false);
+	}
+
+	char *fline = NULL;
+	size_t len = 0;
+	if (getline(&fline, &len, filefile) == -1) {
+		if (ferror(filefile))
+			warn("Could not read a line from the output of file(1) on '%s'", src);
+		else
+			warnx("No output from file(1) on '%s'", src);
+		free(fline);
+		fclose(filefile);
+		waitpid(pid, NULL, 0);
+		return (false);
+	}
+	fclose(filefile);
+	int stat;
+	if (waitpid(pid, &stat, 0) == -1) {
+		warn("Could not wait for file(1) on '%s'", src);
+		free(fline);
+		return (false);
+	}
+
+	const size_t srclen = strlen(src);
+	if (len < srclen + 2) {
+		warnx("Could not parse the output of file(1) on '%s': line too short: %s", src, fline);
+		free(fline);
+		return (false);
+	}
+	if (strncmp(fline, src, srclen) != 0 ||
+	    strncmp(fline + srclen, ": ", 2) != 0) {
+		warnx("Could not parse the output of file(1) on '%s': line starts weirdly: %s", src, fline);
+		free(fline);
+		return (false);
+	}
+
+	const char *p = fline + srclen + 1;
+	*is_text = false;
+	while (true) {
+		const char * const ntext = strstr(p + 1, "text");
+		if (ntext == NULL)
+			break;
+		/* Yes, we know there is always a previous character. */
+		if (strchr(" \t", ntext[-1]) != NULL &&
+		    strchr(" \t\n", ntext[4]) != NULL) {
+			*is_text = true;
+			break;
+		}
+		p = ntext + 3;
+	}
+	free(fline);
+	return (true);
+}
+
+/*
+ * A byte that is not part of a valid UTF-8 sequence may still be
+ * a printable ISO-8859 character; file(1) would call that text, too.
+ */
+static unsigned
+latin1_bad(const unsigned char ch)
+{
+	return (ch < 0xA0);
+}
+
+/*
+ * Decide whether a buffer looks like text: no NUL bytes at all and
+ * very few control characters or malformed UTF-8 sequences.
+ */
+static bool
+is_text_buffer(const unsigned char * const buf, const size_t len)
+{
+	/* Let the C library's vectorized memchr(3) look for NUL bytes. */
+	if (len == 0 || memchr(buf, '\0', len) != NULL)
+		return (false);
+
+	size_t bad = 0;
+	size_t pos = 0;
+	while (pos < len) {
+		/*
+		 * Skip over plain ASCII a machine word at a time, only
+		 * looking at the single bytes of a word that has one below
+		 * 0x20 or a 0x7F one, which may be a control character.
+		 */
+		while (pos + sizeof(uint64_t) <= len) {
+			uint64_t word;
+			memcpy(&word, buf + pos, sizeof(word));
+			if ((word & TEXT_WORD_HIGH) != 0)
+				break;
+			const uint64_t del = word ^ (TEXT_WORD_ONES * 0x7F);
+			if ((((word - TEXT_WORD_ONES * 0x20) | (del - TEXT_WORD_ONES)) &
+			    ~word & TEXT_WORD_HIGH) != 0)
+				for (size_t i = 0; i < sizeof(word); i++)
+					bad += text_ctrl_chars[buf[pos + i]];
+			pos += sizeof(word);
+		}
+		if (pos == len)
+			break;
+
+		const unsigned char ch = buf[pos];
+		if (ch < 0x80) {
+			bad += text_ctrl_chars[ch];
+			pos++;
+			continue;
+		}
+
+		/* A UTF-8 sequence, hopefully. */
+		size_t need;
+		uint32_t cp;
+		if (ch >= 0xC2 && ch <= 0xDF) {
+			need = 1;
+			cp = ch & 0x1F;
+		} else if (ch >= 0xE0 && ch <= 0xEF) {
+			need = 2;
+			cp = ch & 0x0F;
+		} else if (ch >= 0xF0 && ch <= 0xF4) {
+			need = 3;
+			cp = ch & 0x07;
+		} else {
+			bad += latin1_bad(ch);
+			pos++;
+			continue;
+		}
+		if (pos + need >= len) {
+			/* Truncated at the end of the prefix; give it the benefit of the doubt. */
+			break;
+		}
+		size_t i;
+		for (i = 1; i <= need; i++) {
+			if ((buf[pos + i] & 0xC0) != 0x80)
+				break;
+			cp = (cp << 6) | (buf[pos + i] & 0x3F);
+		}
+		if (i <= need ||
+		    (need == 2 && (cp < 0x800 || (cp >= 0xD800 && cp <= 0xDFFF))) ||
+		    (need == 3 && (cp < 0x10000 || cp > 0x10FFFF))) {
+			bad += latin1_bad(ch);
+			pos++;
+			continue;
+		}
+		pos += need + 1;
+	}
+
+	return (bad * TEXT_MAX_BAD_RATIO <= len);
+}
+
+static bool
+classify_builtin(const char * const src, bool * const is_text)
+{
+	const int fd = open(src, O_RDONLY);
+	if (fd == -1) {
+		warn("Could not open '%s' to examine it", src);
+		return (false);
+	}
+	unsigned char * const buf = malloc(TEXT_PREFIX_SIZE);
+	if (buf == NULL) {
+		warn("Could not allocate memory to examine '%s'", src);
+		close(fd);
+		return (false);
+	}
+	const ssize_t n = readn(fd, (char *)buf, TEXT_PREFIX_SIZE);
+	const int save_errno = errno;
+	close(fd);
+	if (n == -1) {
+		free(buf);
+		errno = save_errno;
+		warn("Could not read from '%s' to examine it", src);
+		return (false);
+	}
+
+	*is_text = is_text_buffer(buf, n);
+	free(buf);
+	return (true);
+}
+
+/*
+ * Examine a file about to be installed and, if it is a text one that
+ * differs from the existing destination, prepare the patch to record.
+ * This does not touch the database, so it may run in parallel for
+ * several files.
+ */
+static void
+analyze_install(struct install_item * const item)
+{
+	const char * const src = item->src;
+	const char * const dst = item->dst;
+	struct stat sb;
+
+	item->ok = false;
+	if (stat(src, &sb) == -1) {
+		warn("Invalid source filename '%s'", src);
+		return;
+	}
+	else if (!S_ISREG(sb.st_mode)) {
+		warnx("Not a regular source file: '%s'", src);
+		return;
+	}
+
+	if (stat(dst, &sb) == -1) {
+		if (errno != ENOENT) {
+			warnx("Could not check for the existence of the destination file '%s'", dst);
+			return;
+		}
+		item->ok = true;
+		return;
+	}
+	item->exists = true;
+
+	/* Is it the same file? */
+	switch (compare_files(src, dst)) {
+		case CMP_SAME:
+			/* The files are the same; nothing to do! */
+			item->same = true;
+			item->ok = true;
+			return;
+
+		case CMP_DIFFERENT:
+			/* Phew! */
+			break;
+
+		default:
+			return;
+	}
+
+	/* But is it a text file? */
+	bool is_text;
+	if (!(get_classifier() == CLASSIFY_FILE ?
+	    classify_file_magic(src, &is_text) :
+	    classify_builtin(src, &is_text)))
+		return;
+	if (!is_text) {
+		item->ok = true;
+		return;
+	}
+
+	FILE * const fp = open_memstream(&item->patch, &item->patch_len);
+	if (fp == NULL) {
+		warn("Could not allocate memory for the changes to '%s'", dst);
+		return;
+	}
+	const bool diffed = unidiff_write(fp, dst, src, item->reproducible);
+	if (fclose(fp) == EOF || !diffed) {
+		warnx("Could not compute the changes to '%s'", dst);
+		free(item->patch);
+		item->patch = NULL;
+		return;
+	}
+	item->ok = true;
+}
+
+/* Copy at most len bytes from the current position of one file to another. */
+static bool
+copy_fd_len(const int src_fd, const char * const src, const int dst_fd, const char * const dst, uintmax_t len)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+	/* Let the kernel do the copying if it can. */
+	while (true) {
+		if (len == 0)
+			return (true);
+		const ssize_t n = copy_file_range(src_fd, NULL, dst_fd, NULL,
+		    len < COPY_CHUNK_SIZE ? len : COPY_CHUNK_SIZE, 0);
+		if (n == 0) {
+			return (true);
+		} else if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+			    errno == EOPNOTSUPP || errno == EBADF)
+				break;
+			warn("Could not copy '%s' to '%s'", src, dst);
+			return (false);
+		}
+		len -= n;
+	}
+#endif
+
+	char * const buf = malloc(COPY_BUF_SIZE);
+	if (buf == NULL) {
+		warn("Could not allocate memory to copy '%s' to '%s'", src, dst);
+		return (false);
+	}
+	bool res = true;
+	while (len > 0) {
+		const ssize_t n = readn(src_fd, buf, len < COPY_BUF_SIZE ? len : COPY_BUF_SIZE);
+		if (n == -1) {
+			warn("Could not read from '%s'", src);
+			res = false;
+			break;
+		} else if (n == 0) {
+			break;
+		} else if (!writen(dst_fd, buf, n)) {
+			warn("Could not write to '%s'", dst);
+			res = false;
+			break;
+		}
+		len -= n;
+	}
+	free(buf);
+	return (res);
+}
+
+static bool
+copy_fd(const int src_fd, const char * const src, const int dst_fd, const char * const dst)
+{
+	return (copy_fd_len(src_fd, src, dst_fd, dst, UINTMAX_MAX));
+}
+
+/*
+ * Copy only the data regions of a sparse file, leaving holes in the
+ * destination in place of the source's ones.
+ */
+static bool
+copy_fd_sparse(const int src_fd, const char * const src, const int dst_fd, const char * const dst, const off_t size)
+{
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+	for (off_t pos = 0; pos < size; ) {
+		const off_t start = lseek(src_fd, pos, SEEK_DATA);
+		if (start == -1 && errno == ENXIO)
+			break;
+		const off_t end = start == -1 ? -1 : lseek(src_fd, start, SEEK_HOLE);
+		if (end == -1) {
+			/* Not supported by the file system, so copy it all. */
+			if (pos == 0 && errno == EINVAL && lseek(src_fd, 0, SEEK_SET) == 0)
+				return (copy_fd(src_fd, src, dst_fd, dst));
+			warn("Could not look for the data in '%s'", src);
+			return (false);
+		}
+		if (lseek(src_fd, start, SEEK_SET) == -1) {
+			warn("Could not seek in '%s'", src);
+			return (false);
+		} else if (lseek(dst_fd, start, SEEK_SET) == -1) {
+			warn("Could not seek in '%s'", dst);
+			return (false);
+		} else if (!copy_fd_len(src_fd, src, dst_fd, dst, end - start)) {
+			return (false);
+		}
+		pos = end;
+	}
+	if (ftruncate(dst_fd, size) == -1) {
+		warn("Could not set the size of '%s'", dst);
+		return (false);
+	}
+	return (true);
+#else
+	(void)size;
+	return (copy_fd(src_fd, src, dst_fd, dst));
+#endif
+}
+
+/*
+ * Make the destination share the data blocks of the source if the file
+ * system supports reflinks, or copy the data over otherwise.
+ */
+static bool
+clone_fd(const int src_fd, const char * const src, const int dst_fd, const char * const dst, const struct stat * const sb)
+{
+#ifdef HAVE_FICLONE
+	if (ioctl(dst_fd, FICLONE, src_fd) == 0)
+		return (true);
+#endif
+	if ((uintmax_t)sb->st_blocks * 512 < (uintmax_t)sb->st_size)
+		return (copy_fd_sparse(src_fd, src, dst_fd, dst, sb->st_size));
+	return (copy_fd(src_fd, src, dst_fd, dst));
+}
+
+/*
+ * Store a file's contents as they are in a separate artifact data file.
+ * If the file is about to be removed and it is on the same file system,
+ * simply link it into the database; not if it has other links that it
+ * may still be changed through, if it would keep a set-user-ID or
+ * set-group-ID mode bit in there, if it could not be made to belong to
+ * the database afterwards, or if the name is not that of the examined
+ * file itself, e.g. a symbolic link to it.
+ */
+static bool
+artifact_clone(const struct txn_db * const db, const int src_fd, const char * const src, const struct stat * const sb, const bool move, const char * const path)
+{
+	struct stat lsb;
+	if (move && sb->st_nlink == 1 && (sb->st_mode & (S_ISUID | S_ISGID)) == 0 &&
+	    (geteuid() == 0 || sb->st_uid == geteuid()) &&
+	    lstat(src, &lsb) == 0 && S_ISREG(lsb.st_mode) &&
+	    lsb.st_dev == sb->st_dev && lsb.st_ino == sb->st_ino) {
+		if (link(src, path) == 0) {
+			if (sync_file(db, path, NULL))
+				return (true);
+			unlink(path);
+			return (false);
+		} else if (errno != EXDEV && errno != EPERM && errno != EMLINK) {
+			warn("Could not link '%s' to '%s'", src, path);
+			return (false);
+		}
+	}
+
+	const int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (fd == -1) {
+		warn("Could not create the '%s' artifact file", path);
+		return (false);
+	}
+	bool res = clone_fd(src_fd, src, fd, path, sb);
+	if (close(fd) == -1 && res) {
+		warn("Could not close '%s'", path);
+		res = false;
+	}
+	if (!res || !sync_file(db, path, NULL)) {
+		unlink(path);
+		return (false);
+	}
+	return (true);
+}
+
+/*
+ * Save a copy of a file that is about to be removed or overwritten
+ * along with its metadata into the database.  Unless the contents need
+ * to go into the blob store or the pack or to be compressed, they are
+ * kept apart from the metadata and, where the file system allows it,
+ * share their data blocks with the original file or, if it is about to
+ * be removed (move is set), are the original file itself.
+ */
+static bool
+store_backup(const char * const fname, const struct txn_db * const db, const size_t line_idx, const bool move)
+{
+	const int fd = open(fname, O_RDONLY);
+	if (fd == -1) {
+		warn("Could not open '%s' for reading", fname);
+		return (false);
+	}
+	struct stat sb;
+	if (fstat(fd, &sb) == -1) {
+		warn("Could not examine '%s'", fname);
+		close(fd);
+		return (false);
+	} else if (!artifact_mkdir(db, line_idx)) {
+		close(fd);
+		return (false);
+	}
+
+	/* Contents that look like a compressed artifact must be escaped. */
+	char head[ARTIFACT_CODEC_MAGIC_SIZE];
+	const bool plain = db->pack == NULL && !db->dedup &&
+	    get_compression() == COMPRESS_NONE &&
+	    (pread(fd, head, sizeof(head), 0) != (ssize_t)sizeof(head) ||
+	     memcmp(head, ARTIFACT_CODEC_MAGIC, sizeof(head)) != 0);
+	char * const backup_filename = artifact_path(db, line_idx, "");
+	char * const data_filename = db->dedup || plain ?
+	    artifact_path(db, line_idx, ARTIFACT_DATA_SUFFIX) : backup_filename;
+
+	bool res;
+	if (data_filename != backup_filename && !artifact_write_meta(db, backup_filename, &sb)) {
+		res = false;
+	} else if (plain) {
+		res = artifact_clone(db, fd, fname, &sb, move, data_filename);
+		if (!res)
+			unlink(backup_filename);
+	} else {
+		struct artifact_writer w;
+		res = artifact_create(&w, db, line_idx, data_filename);
+		if (res) {
+			res = db->dedup || artifact_write_raw(&w, &sb, sizeof(sb));
+			char buf[ARTIFACT_IO_SIZE];
+			ssize_t n;
+			while (res && (n = readn(fd, buf, sizeof(buf))) != 0)
+				if (n == -1) {
+					warn("Could not read '%s'", fname);
+					res = false;
+				} else if (!artifact_write(&w, buf, n)) {
+					res = false;
+				}
+			if (!res)
+				artifact_abort(&w);
+			else
+				res = artifact_commit(&w);
+		}
+		if (!res && db->dedup)
+			unlink(backup_filename);
+	}
+	close(fd);
+	if (res && db->pack == NULL && !sync_dir(db, backup_filename)) {
+		artifact_remove(db, line_idx);
+		res = false;
+	}
+	if (!res)
+		warnx("Could not save '%s' into the database", fname);
+
+	if (data_filename != backup_filename)
+		free(data_filename);
+	free(backup_filename);
+	return (res);
+}
+
+/*
+ * A removed file that was linked into the database still has its owner
+ * and permissions; once it is gone from its place, make its data file
+ * look like any other artifact.  The original metadata is kept in the
+ * "txn.<serial>" file and put back by a rollback.
+ */
+static bool
+artifact_disown(const struct txn_db * const db, const size_t idx)
+{
+	if (db->pack != NULL || db->dedup)
+		return (true);
+
+	char * const data = artifact_path(db, idx, ARTIFACT_DATA_SUFFIX);
+	const int fd = open(data, O_RDONLY | O_NOFOLLOW);
+	if (fd == -1) {
+		const bool res = errno == ENOENT;
+		if (!res)
+			warn("Could not open the '%s' artifact file", data);
+		free(data);
+		return (res);
+	}
+	struct stat sb;
+	bool res = fstat(fd, &sb) == 0;
+	if (!res) {
+		warn("Could not examine the '%s' artifact file", data);
+	} else if ((sb.st_uid != geteuid() || sb.st_gid != getegid()) &&
+	    fchown(fd, geteuid(), getegid()) == -1) {
+		warn("Could not set the owner and group of the '%s' artifact file", data);
+		res = false;
+	} else if ((sb.st_mode & 07777) != 0600 && fchmod(fd, 0600) == -1) {
+		warn("Could not set the permissions mode of the '%s' artifact file", data);
+		res = false;
+	}
+	close(fd);
+	free(data);
+	return (res);
+}
+
+/* Record the installation of an examined file in the database. */
+static bool
+record_analyzed(const struct install_item * const item, const struct txn_db * const db, const size_t line_idx, enum index_action * const action)
+{
+	const char * const dst = item->dst;
+
+	*action = ACT_CREATE;
+	if (!item->exists || item->patch == NULL) {
+		/* Keep a copy of an overwritten binary file to restore it. */
+		if (item->exists && !store_backup(dst, db, line_idx, false))
+			return (false);
+		return (write_db_entry(db, (struct index_line){
+			.idx = line_idx,
+			.module = db->module,
+			.action = ACT_CREATE,
+			.filename = dst,
+		}));
+	}
+
+	char * const patch_filename = artifact_path(db, line_idx, "");
+	struct artifact_writer w;
+	if (!artifact_mkdir(db, line_idx) || !artifact_create(&w, db, line_idx, patch_filename)) {
+		warnx("Could not store the changes to '%s'", dst);
+		free(patch_filename);
+		return (false);
+	}
+	if (!artifact_write(&w, item->patch, item->patch_len)) {
+		artifact_abort(&w);
+		warnx("Could not store the changes to '%s'", dst);
+		free(patch_filename);
+		return (false);
+	} else if (!artifact_commit(&w)) {
+		warnx("Could not store the changes to '%s'", dst);
+		free(patch_filename);
+		return (false);
+	}
+	free(patch_filename);
+
+	*action = ACT_PATCH;
+	return (write_db_entry(db, (struct index_line){
+		.idx = line_idx,
+		.module = db->module,
+		.action = ACT_PATCH,
+		.filename = dst,
+	}));
+}
+
+/* How many files to examine or roll back at the same time. */
+static long
+get_jobs(void)
+{
+	const char * const value = getenv("TXN_INSTALL_JOBS");
+	if (value == NULL) {
+		const long n = sysconf(_SC_NPROCESSORS_ONLN);
+		return (n > 0 ? n : 1);
+	}
+
+	char *end;
+	errno = 0;
+	const long res = strtol(value, &end, 10);
+	if (*value < '0' || *value > '9' || *end != '\0' || errno != 0 || res < 1)
+		errx(1, "Invalid TXN_INSTALL_JOBS value '%s', expected a positive number", value);
+	return (res);
+}
+
+static void *
+pool_worker(void * const arg)
+{
+	struct worker_pool * const pool = arg;
+	while (true) {
+		pthread_mutex_lock(&pool->lock);
+		const size_t i = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+		if (i >= pool->count)
+			return (NULL);
+		pool->func(pool->arg, i);
+	}
+}
+
+/* Run func(arg, 0) to func(arg, count - 1) using a pool of threads. */
+static void
+run_workers(void (* const func)(void *, size_t), void * const arg, const size_t count)
+{
+	long jobs = get_jobs();
+	if ((size_t)jobs > count)
+		jobs = count;
+	struct worker_pool pool = {
+		.func = func,
+		.arg = arg,
+		.count = count,
+	};
+	const int res = pthread_mutex_init(&pool.lock, NULL);
+	if (res != 0) {
+		errno = res;
+		err(1, "Could not initialize a mutex");
+	}
+	pthread_t * const threads = calloc(jobs > 0 ? jobs : 1, sizeof(*threads));
+	if (threads == NULL)
+		errx(1, "Out of memory");
+	/* This thread is a worker, too; run fewer if there are not enough. */
+	long started = 0;
+	while (started < jobs - 1 &&
+	    pthread_create(&threads[started], NULL, pool_worker, &pool) == 0)
+		started++;
+	pool_worker(&pool);
+	for (long i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_mutex_destroy(&pool.lock);
+}
+
+static void
+analyze_install_at(void * const arg, const size_t idx)
+{
+	struct install_item * const item = (struct install_item *)arg + idx;
+	if (!item->deferred)
+		analyze_install(item);
+}
+
+static int
+cmp_install_dst(const void * const a, const void * const b)
+{
+	const struct install_item * const ia = *(const struct install_item * const *)a;
+	const struct install_item * const ib = *(const struct install_item * const *)b;
+	const int res = strcmp(ia->dst, ib->dst);
+	if (res != 0)
+		return (res);
+	return (ia < ib ? -1 : ia > ib);
+}
+
+/*
+ * Examine the files to install using a pool of threads.  A file that
+ * is installed to the same destination as an earlier one can only be
+ * examined after that one has been installed, so defer it.
+ */
+static void
+analyze_install_all(struct install_item * const items, const size_t count)
+{
+	struct install_item ** const sorted = malloc(count * sizeof(*sorted));
+	if (sorted == NULL)
+		errx(1, "Out of memory");
+	for (size_t i = 0; i < count; i++)
+		sorted[i] = &items[i];
+	qsort(sorted, count, sizeof(*sorted), cmp_install_dst);
+	for (size_t i = 1; i < count; i++)
+		if (strcmp(sorted[i]->dst, sorted[i - 1]->dst) == 0)
+			sorted[i]->deferred = true;
+	free(sorted);
+
+	run_workers(analyze_install_at, items, count);
+}
+
+static bool
+record_install(const char * const src, const char * const dst, const struct txn_db * const db, const size_t line_idx, bool * const same, enum index_action * const action)
+{
+	struct install_item item = {
+		.src = src,
+		.dst = dst,
+		.reproducible = db->dedup,
+	};
+	analyze_install(&item);
+	*same = item.same;
+	*action = ACT_CREATE;
+	const bool res = item.ok && (item.same ||
+	    record_analyzed(&item, db, line_idx, action));
+	free(item.patch);
+	return (res);
+}
+
+static bool
+parse_owner(const char * const name, uid_t * const uid)
+{
+	const struct passwd * const pw = getpwnam(name);
+	if (pw != NULL) {
+		*uid = pw->pw_uid;
+		return (true);
+	}
+
+	char *end;
+	errno = 0;
+	const unsigned long val = strtoul(name, &end, 10);
+	if (*name == '\0' || *end != '\0' || errno != 0 || (uid_t)val != val)
+		return (false);
+	*uid = val;
+	return (true);
+}
+
+static bool
+parse_group(const char * const name, gid_t * const gid)
+{
+	const struct group * const gr = getgrnam(name);
+	if (gr != NULL) {
+		*gid = gr->gr_gid;
+		return (true);
+	}
+
+	char *end;
+	errno = 0;
+	const unsigned long val = strtoul(name, &end, 10);
+	if (*name == '\0' || *end != '\0' || errno != 0 || (gid_t)val != val)
+		return (false);
+	*gid = val;
+	return (true);
+}
+
+/*
+ * Parse an octal or a chmod(1)-like symbolic mode; as install(1) does,
+ * apply the symbolic one to an initial mode of 0.
+ */
+static bool
+parse_mode(const char * const str, mode_t * const mode)
+{
+	if (*str >= '0' && *str <= '7') {
+		char *end;
+		const unsigned long val = strtoul(str, &end, 8);
+		if (*end != '\0' || val > 07777)
+			return (false);
+		*mode = val;
+		return (true);
+	}
+
+	mode_t res = 0;
+	const char *p = str;
+	while (true) {
+		mode_t who = 0;
+		for (; strchr("ugoa", *p) != NULL && *p != '\0'; p++)
+			switch (*p) {
+				case 'u':
+					who |= S_ISUID | S_IRWXU;
+					break;
+
+				case 'g':
+					who |= S_ISGID | S_IRWXG;
+					break;
+
+				case 'o':
+					who |= S_IRWXO;
+					break;
+
+				default:
+					who |= S_ISUID | S_ISGID | S_ISVTX | S_IRWXU | S_IRWXG | S_IRWXO;
+					break;
+			}
+		if (who == 0)
+			who = S_ISUID | S_ISGID | S_ISVTX | S_IRWXU | S_IRWXG | S_IRWXO;
+
+		do {
+			const char op = *p++;
+			if (op != '+' && op != '-' && op != '=')
+				return (false);
+			mode_t perm = 0;
+			for (; *p != '\0' && strchr("rwxXst", *p) != NULL; p++)
+				switch (*p) {
+					case 'r':
+						perm |= S_IRUSR | S_IRGRP | S_IROTH;
+						break;
+
+					case 'w':
+						perm |= S_IWUSR | S_IWGRP | S_IWOTH;
+						break;
+
+					case 'x':
+						perm |= S_IXUSR | S_IXGRP | S_IXOTH;
+						break;
+
+					case 'X':
+						if (res & (S_IXUSR | S_IXGRP | S_IXOTH))
+							perm |= S_IXUSR | S_IXGRP | S_IXOTH;
+						break;
+
+					case 's':
+						perm |= S_ISUID | S_ISGID;
+						break;
+
+					default:
+						perm |= S_ISVTX;
+						break;
+				}
+			perm &= who;
+			if (op == '+')
+				res |= perm;
+			else if (op == '-')
+				res &= ~perm;
+			else
+				res = (res & ~who) | perm;
+		} while (*p == '+' || *p == '-' || *p == '=');
+
+		if (*p == '\0')
+			break;
+		else if (*p++ != ',')
+			return (false);
+	}
+	*mode = res;
+	return (true);
+}
+
+/* Set the owner, group, and permissions mode of a file unless already set. */
+static bool
+publish_metadata(const int fd, const char * const dst, const struct install_opts * const opts)
+{
+	struct stat sb;
+	if (fstat(fd, &sb) == -1) {
+		warn("Could not examine the new '%s'", dst);
+		return (false);
+	}
+	const bool chowned = (opts->set_owner && sb.st_uid != opts->owner) ||
+	    (opts->set_group && sb.st_gid != opts->group);
+	if (chowned && fchown(fd, opts->set_owner ? opts->owner : (uid_t)-1,
+	    opts->set_group ? opts->group : (gid_t)-1) == -1) {
+		warn("Could not set the owner and group of '%s'", dst);
+		return (false);
+	}
+	/* Changing the owner may have cleared the set-user-ID bit. */
+	if ((chowned || (sb.st_mode & 07777) != opts->mode) && fchmod(fd, opts->mode) == -1) {
+		warn("Could not set the permissions mode of '%s'", dst);
+		return (false);
+	}
+	return (true);
+}
+
+static bool
+publish_open_named(struct publish_file * const pub, const char * const dst, const bool replace)
+{
+	*pub = (struct publish_file){
+		.dst = dst,
+		.fd = -1,
+		.replace = replace,
+	};
+	if (asprintf(&pub->temp, "%s.XXXXXX", dst) < 0) {
+		warn("Could not allocate memory for the temporary file template");
+		pub->temp = NULL;
+		return (false);
+	}
+	pub->fd = mkstemp(pub->temp);
+	if (pub->fd == -1) {
+		warn("Could not create a temporary file for '%s'", dst);
+		free(pub->temp);
+		return (false);
+	}
+	return (true);
+}
+
+/*
+ * Create a new file to put in place of the destination one.  If the
+ * destination is not to be replaced, try an unnamed O_TMPFILE one that
+ * leaves nothing behind if anything goes wrong, and is then linked into
+ * place unless something else has created the destination meanwhile.
+ */
+static bool
+publish_open(struct publish_file * const pub, const char * const dst, const bool replace)
+{
+#ifdef O_TMPFILE
+	if (!replace) {
+		char * const dir = path_dirname(dst);
+		if (dir == NULL)
+			return (false);
+		*pub = (struct publish_file){
+			.dst = dst,
+			.fd = open(dir, O_TMPFILE | O_RDWR, 0600),
+		};
+		free(dir);
+		/* If the file system does not support it, use a named one. */
+		if (pub->fd != -1)
+			return (true);
+	}
+#endif
+	return (publish_open_named(pub, dst, replace));
+}
+
+static void
+publish_abort(struct publish_file * const pub)
+{
+	if (pub->fd != -1)
+		close(pub->fd);
+	if (pub->temp != NULL) {
+		unlink(pub->temp);
+		free(pub->temp);
+	}
+}
+
+/* Give a name to an unnamed file; errno is preserved on failure. */
+static bool
+publish_link(const int fd, const char * const dst)
+{
+#ifdef O_TMPFILE
+	if (linkat(fd, "", AT_FDCWD, dst, AT_EMPTY_PATH) == 0)
+		return (true);
+	else if (errno == EEXIST)
+		return (false);
+
+	/* Without the CAP_DAC_READ_SEARCH capability, go through /proc. */
+	char proc[sizeof("/proc/self/fd/") + 3 * sizeof(int)];
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+	return (linkat(AT_FDCWD, proc, AT_FDCWD, dst, AT_SYMLINK_FOLLOW) == 0);
+#else
+	(void)fd;
+	(void)dst;
+	errno = ENOTSUP;
+	return (false);
+#endif
+}
+
+/*
+ * Set the owner, group, and permissions mode of a new file and put it
+ * in its place: rename it over the destination file or link it there
+ * if there is none.  The new file is removed if anything goes wrong.
+ */
+static bool
+publish_commit(struct publish_file * const pub, const struct install_opts * const opts, const struct txn_db * const db)
+{
+	const char * const dst = pub->dst;
+	/* The file may have been written by another process by name. */
+	if (pub->fd == -1 && (pub->fd = open(pub->temp, O_RDONLY)) == -1) {
+		warn("Could not reopen the temporary '%s'", pub->temp);
+		publish_abort(pub);
+		return (false);
+	}
+	if (!publish_metadata(pub->fd, dst, opts) || !sync_fd(db, pub->fd, dst)) {
+		publish_abort(pub);
+		return (false);
+	}
+
+	if (pub->temp == NULL) {
+		if (!publish_link(pub->fd, dst)) {
+			if (errno == EEXIST) {
+				warn("Could not create '%s'", dst);
+				publish_abort(pub);
+				return (false);
+			}
+
+			/* No way to give it a name here, so copy it to a named one. */
+			struct publish_file named;
+			if (lseek(pub->fd, 0, SEEK_SET) == -1) {
+				warn("Could not rewind the new '%s'", dst);
+				publish_abort(pub);
+				return (false);
+			} else if (!publish_open_named(&named, dst, false)) {
+				publish_abort(pub);
+				return (false);
+			} else if (!copy_fd(pub->fd, dst, named.fd, named.temp)) {
+				publish_abort(&named);
+				publish_abort(pub);
+				return (false);
+			}
+			publish_abort(pub);
+			return (publish_commit(&named, opts, db));
+		}
+		close(pub->fd);
+		return (sync_dir(db, dst));
+	}
+
+	close(pub->fd);
+	pub->fd = -1;
+	if (pub->replace ? rename(pub->temp, dst) == -1 : link(pub->temp, dst) == -1) {
+		warn("Could not %s the temporary '%s' to '%s'",
+		    pub->replace ? "rename" : "link", pub->temp, dst);
+		publish_abort(pub);
+		return (false);
+	}
+	if (!pub->replace)
+		unlink(pub->temp);
+	free(pub->temp);
+	return (sync_dir(db, dst));
+}
+
+/*
+ * Do what install(1) would: copy the file to a temporary one in the same
+ * directory as the destination, set its metadata, and rename it.
+ */
+static bool
+install_file(const char * const src, const char * const dst, const struct install_opts * const opts, const bool same, const struct txn_db * const db)
+{
+	const int src_fd = open(src, O_RDONLY);
+	if (src_fd == -1) {
+		warn("Could not open '%s' for reading", src);
+		return (false);
+	}
+	struct install_opts exact_opts;
+	const struct install_opts *use_opts = opts;
+	if (opts->exact) {
+		struct stat sb;
+		if (fstat(src_fd, &sb) == -1) {
+			warn("Could not examine '%s'", src);
+			close(src_fd);
+			return (false);
+		}
+		exact_opts = (struct install_opts){
+			.set_owner = true,
+			.owner = sb.st_uid,
+			.set_group = true,
+			.group = sb.st_gid,
+			.mode = sb.st_mode & 03777,
+		};
+		use_opts = &exact_opts;
+	}
+
+	/* Same contents?  Only update the metadata if needed. */
+	if (same) {
+		close(src_fd);
+		struct stat sb;
+		if (stat(dst, &sb) == -1) {
+			warn("Could not examine '%s'", dst);
+			return (false);
+		}
+		if (((use_opts->set_owner && sb.st_uid != use_opts->owner) ||
+		    (use_opts->set_group && sb.st_gid != use_opts->group)) &&
+		    chown(dst, use_opts->set_owner ? use_opts->owner : (uid_t)-1,
+		    use_opts->set_group ? use_opts->group : (gid_t)-1) == -1) {
+			warn("Could not set the owner and group of '%s'", dst);
+			return (false);
+		}
+		if ((sb.st_mode & 07777) != use_opts->mode && chmod(dst, use_opts->mode) == -1) {
+			warn("Could not set the permissions mode of '%s'", dst);
+			return (false);
+		}
+		return (true);
+	}
+
+	struct publish_file pub;
+	if (!publish_open(&pub, dst, true)) {
+		close(src_fd);
+		return (false);
+	}
+	const bool copied = copy_fd(src_fd, src, pub.fd, pub.temp);
+	close(src_fd);
+	if (!copied) {
+		publish_abort(&pub);
+		return (false);
+	}
+	return (publish_commit(&pub, use_opts, db));
+}
+
+static void
+rollback_install(const long pos, const struct txn_db * const db, const size_t line_idx)
+{
+	struct modidx_stamp pre;
+	modidx_current(db, line_idx + 1, &pre);
+	if (db->format == INDEX_BINARY) {
+		/* Forget about any module defined along with the entry. */
+		struct index_view view = index_view_open(db);
+		struct binidx_header h = view.header;
+		while (h.module_count > 0 && h.last_module >= (uint64_t)pos) {
+			struct binidx_record rec;
+			if (!binidx_decode_record((const unsigned char *)view.data + h.last_module, view.end - h.last_module, &rec))
+				errx(1, "Invalid database index '%s': bad module definition at %" PRIu64, db->idx, h.last_module);
+			h.last_module = rec.prev;
+			h.module_count--;
+		}
+		for (uint64_t ofs = pos; ofs < h.end; ) {
+			struct binidx_record rec;
+			if (!binidx_decode_record((const unsigned char *)view.data + ofs, view.end - ofs, &rec))
+				errx(1, "Invalid database index '%s': bad record at %" PRIu64, db->idx, ofs);
+			if (rec.type == BINIDX_ENTRY)
+				h.count--;
+			ofs += rec.size;
+		}
+		h.end = pos;
+		h.next_idx = line_idx;
+		index_view_close(&view);
+		if (!write_index_header(db, &h))
+			exit(1);
+		if (ftruncate(fileno(db->file), pos) == -1)
+			err(1, "Could not truncate the database index '%s' after removing a just-added entry", db->idx);
+		if (fseek(db->file, pos, SEEK_SET) == -1)
+			err(1, "Could not rewind the database index '%s'", db->idx);
+		modidx_unrecord(db, &pre, db->module, pos, line_idx);
+		if (!sync_index(db))
+			exit(1);
+		return;
+	}
+
+	if (fseek(db->file, pos, SEEK_SET) == -1)
+		err(1, "Could not rewind the database index '%s'", db->idx);
+	fprintf(db->file, "%0*zu\n", (int)db->num_size, line_idx);
+	if (ferror(db->file))
+		err(1, "Could not remove a just-added entry in the database index '%s'", db->idx);
+	if (fflush(db->file) == EOF)
+		err(1, "Could not write out the removal of a just-added entry in the database index '%s'", db->idx);
+	if (ftruncate(fileno(db->file), pos + db->num_size + 1) == -1)
+		err(1, "Could not truncate the database index '%s' after removing a just-added entry", db->idx);
+	modidx_unrecord(db, &pre, db->module, pos, line_idx);
+	if (!sync_index(db))
+		exit(1);
+}
+
+/*
+ * Flush the index entries recorded for some files to be installed and
+ * their artifacts, then install the files.  If one of them cannot be
+ * installed, drop its entry and the ones after it and then, once that
+ * is on the disk, the artifacts up to the next serial number.
+ */
+static bool
+install_publish(const struct install_item * const items, const size_t first, const size_t last, const struct install_opts * const opts, const struct txn_db * const db, const size_t next_idx)
+{
+	if (first == last)
+		return (true);
+	size_t i = first;
+	if (sync_commit(db))
+		while (i < last && install_file(items[i].src, items[i].dst, opts, items[i].same, db))
+			i++;
+	if (i == last)
+		return (true);
+
+	rollback_install(items[i].pos, db, items[i].idx);
+	if (sync_commit(db))
+		for (size_t idx = items[i].idx; idx < next_idx; idx++)
+			artifact_remove(db, idx);
+	return (false);
+}
+
+static struct index_line
+read_last_index(const struct txn_db * const db)
+{
+	if (db->format == INDEX_BINARY) {
+		unsigned char buf[BINIDX_HEADER_SIZE];
+		struct binidx_header h;
+		const ssize_t n = pread(fileno(db->file), buf, sizeof(buf), 0);
+		if (n == -1)
+			err(1, "Could not read the header of the database index '%s'", db->idx);
+		if (!binidx_decode_header(buf, n, &h))
+			errx(1, "Invalid database index '%s': bad binary index header", db->idx);
+		if (h.next_idx > SIZE_MAX)
+			errx(1, "Invalid database index '%s': serial number too large", db->idx);
+		if (fseek(db->file, h.end, SEEK_SET) == -1)
+			err(1, "Could not seek to the end of the database index '%s'", db->idx);
+		return ((struct index_line){
+			.idx = h.next_idx,
+		});
+	}
+
+	const size_t num_size = db->num_size;
+	if (fseek(db->file, -(long)(num_size + 1), SEEK_END) == -1)
+		err(1, "Could not seek almost to the end of the database index '%s'", db->idx);
+	char buf[INDEX_WIDE_NUM_SIZE + 1];
+	if (fread(buf, 1, num_size + 1, db->file) != num_size + 1) {
+		if (ferror(db->file))
+			err(1, "Could not read the last line of the database index '%s'", db->idx);
+		errx(1, "Invalid database index '%s': incomplete line index at EOF", db->idx);
+	}
+
+	size_t idx = 0;
+	for (size_t ofs = 0; ofs < num_size; ofs++) {
+		if (buf[ofs] < '0' || buf[ofs] > '9')
+			errx(1, "Internal error, the last line of the database index should really be a last one...");
+		idx = idx * 10 + (buf[ofs] - '0');
+	}
+	if (buf[num_size] != '\n')
+		errx(1, "Internal error, the last line of the database index should really be a last one...");
+
+	if (fseek(db->file, -(long)(num_size + 1), SEEK_CUR) == -1)
+		err(1, "Could not seek back in the database index '%s'", db->idx);
+	return ((struct index_line){
+		.idx = idx,
+	});
+}
+
+/*
+ * Parse the install(1)-like options of an install or install-exact
+ * command; return the index of the first positional argument.
+ */
+static bool
+parse_install_opts(const bool exact, const int argc, char * const argv[], struct install_opts * const opts, int * const first)
+{
+	*opts = (struct install_opts){
+		.exact = exact,
+		.mode = 0755,
+	};
+	if (!exact) {
+		int ch;
+		optind = 0;
+		while (ch = getopt(argc, argv, "cg:m:o:"), ch != -1)
+			switch (ch) {
+				case 'c':
+					/* Always copying anyway. */
+					break;
+
+				case 'g':
+					if (!parse_group(optarg, &opts->group)) {
+						warnx("Invalid group '%s'", optarg);
+						return (false);
+					}
+					opts->set_group = true;
+					break;
+
+				case 'm':
+					if (!parse_mode(optarg, &opts->mode)) {
+						warnx("Invalid mode '%s'", optarg);
+						return (false);
+					}
+					break;
+
+				case 'o':
+					if (!parse_owner(optarg, &opts->owner)) {
+						warnx("Invalid user '%s'", optarg);
+						return (false);
+					}
+					opts->set_owner = true;
+					break;
+
+				default:
+					warnx("Unhandled install(1) command-line option");
+					return (false);
+			}
+	} else {
+		/* Still need to run getopt(); what if somebody passed "--"? */
+		optind = 0;
+		if (getopt(argc, argv, "") != -1) {
+			warnx("install-exact does not expect any option arguments");
+			return (false);
+		}
+	}
+	*first = optind;
+	return (true);
+}
+
+static int
+do_install(const bool exact, const int argc, char * const argv[])
+{
+	struct install_opts opts;
+	int first;
+	if (!parse_install_opts(exact, argc, argv, &opts, &first))
+		exit(1);
+
+	const int pos_argc = argc - first;
+	char * const * const pos_argv = argv + first;
+	if (pos_argc < 2) // FIXME: handle -d
+		usage(true);
+
+	const size_t count = pos_argc - 1;
+	struct install_item * const items = calloc(count, sizeof(*items));
+	if (items == NULL)
+		errx(1, "Out of memory");
+	const char * const destination = pos_argv[pos_argc - 1];
+	for (size_t i = 0; i < count; i++)
+		items[i] = (struct install_item){
+			.src = pos_argv[i],
+			.dst = get_destination_filename(pos_argv[i], destination),
+		};
+
+	const struct txn_db db = open_or_create_db(true, INDEX_TEXT);
+	struct index_line ln = read_last_index(&db);
+	for (size_t i = 0; i < count; i++)
+		items[i].reproducible = db.dedup;
+
+	/*
+	 * Examine the files in parallel, record them in order, flush all
+	 * the records at once, and only then install the files.
+	 */
+	analyze_install_all(items, count);
+	size_t pending = 0;
+	for (size_t i = 0; i < count; i++) {
+		struct install_item * const item = &items[i];
+		if (item->deferred) {
+			/* The same file once more; it must be installed first. */
+			if (!install_publish(items, pending, i, &opts, &db, ln.idx))
+				return (1);
+			pending = i;
+			analyze_install(item);
+		}
+
+		item->pos = ftell(db.file);
+		item->idx = ln.idx;
+		enum index_action action;
+		if (!item->ok ||
+		    (!item->same && !record_analyzed(item, &db, ln.idx, &action))) {
+			/* Still install the files before this one. */
+			rollback_install(item->pos, &db, ln.idx);
+			if (install_publish(items, pending, i, &opts, &db, ln.idx + 1) &&
+			    sync_commit(&db))
+				artifact_remove(&db, ln.idx);
+			return (1);
+		}
+		free(item->patch);
+		item->patch = NULL;
+
+		if (!item->same)
+			ln.idx++;
+	}
+
+	if (!install_publish(items, pending, count, &opts, &db, ln.idx))
+		return (1);
+	return (sync_commit(&db) ? 0 : 1);
+}
+
+static int
+cmd_install(const int argc, char * const argv[])
+{
+	return (do_install(false, argc, argv));
+}
+
+static int
+cmd_install_exact(const int argc, char * const argv[])
+{
+	return (do_install(true, argc, argv));
+}
+
+/* Make sure that a file may be removed. */
+static bool
+check_remove(const char * const fname)
+{
+	if (strlen(fname) < 2) {
+		warnx("For txn-install's purposes, the removed filename should be at least two characters long");
+		return (false);
+	}
+	struct stat sb;
+	if (stat(fname, &sb) == -1) {
+		if (errno != ENOENT)
+			warn("Could not examine '%s'", fname);
+		else
+			warnx("Cannot remove '%s' since it does not exist", fname);
+		return (false);
+	} else if (!S_ISREG(sb.st_mode)) {
+		warnx("Only know how to remove regular files, not '%s'", fname);
+		return (false);
+	}
+	return (true);
+}
+
+/*
+ * Save a copy of a file along with its metadata into the database and
+ * record the removal.  The record must reach the disk before the file
+ * is actually removed by remove_recorded().
+ */
+static bool
+record_remove(const char * const fname, const struct txn_db * const db, const size_t line_idx)
+{
+	return (store_backup(fname, db, line_idx, true) &&
+	    write_db_entry(db, (struct index_line){
+		.idx = line_idx,
+		.module = db->module,
+		.action = ACT_REMOVE,
+		.filename = fname,
+	}));
+}
+
+/*
+ * Remove a file after recording its removal.  If the file could not be
+ * removed, the caller must drop the index entry and then the stored
+ * copy; if it was, the caller must put it back to undo the removal.
+ */
+static bool
+remove_recorded(const char * const fname, const struct txn_db * const db, const size_t line_idx, bool * const removed)
+{
+	*removed = false;
+	if (unlink(fname) == -1) {
+		warn("Could not remove '%s'", fname);
+		return (false);
+	}
+	*removed = true;
+	return (artifact_disown(db, line_idx) && sync_dir(db, fname));
+}
+
+static int
+cmd_remove(const int argc, char * const argv[])
+{
+	if (argc != 2)
+		usage(true);
+
+	const char * const fname = argv[1];
+	if (!check_remove(fname))
+		return (1);
+
+	const struct txn_db db = open_or_create_db(true, INDEX_TEXT);
+	const struct index_line ln = read_last_index(&db);
+	const long rollback_pos = ftell(db.file);
+	bool removed = false;
+	const bool res = record_remove(fname, &db, ln.idx) && sync_commit(&db) &&
+	    remove_recorded(fname, &db, ln.idx, &removed);
+	if (!res && !removed) {
+		rollback_install(rollback_pos, &db, ln.idx);
+		if (sync_commit(&db))
+			artifact_remove(&db, ln.idx);
+		return (1);
+	}
+	return (sync_commit(&db) && res ? 0 : 1);
+}
+
+static enum patcher
+get_patcher(void)
+{
+	const char * const name = getenv("TXN_INSTALL_PATCH");
+	if (name == NULL || strcmp(name, "builtin") == 0)
+		return (PATCHER_BUILTIN);
+	else if (strcmp(name, "patch") == 0)
+		return (PATCHER_PATCH);
+	errx(1, "Invalid TXN_INSTALL_PATCH value '%s', expected 'builtin' or 'patch'", name);
+}
+
+/* Revert the changes recorded in a patch into a new file. */
+static bool
+rollback_patch_temp(const char * const filename, const char * const patch_filename, const char * const patch, const size_t patch_len, struct publish_file * const pub)
+{
+	const char * const temp_filename = pub->temp;
+	if (get_patcher() == PATCHER_BUILTIN) {
+		const int temp_fd = dup(pub->fd);
+		FILE * const temp_file = temp_fd == -1 ? NULL : fdopen(temp_fd, "w");
+		if (temp_file == NULL) {
+			warn("Could not reopen the temporary '%s'", temp_filename);
+			if (temp_fd != -1)
+				close(temp_fd);
+			return (false);
+		}
+		const bool reverted = unidiff_revert(temp_file, patch_filename, patch, patch_len, filename);
+		if (fclose(temp_file) == EOF) {
+			warn("Could not write out the temporary '%s'", temp_filename);
+			return (false);
+		} else if (!reverted) {
+			warnx("Could not revert the changes to '%s' recorded in '%s'", filename, patch_filename);
+			return (false);
+		}
+		return (true);
+	}
+
+	/*
+	 * The patch may have been decompressed, so feed it to patch(1)
+	 * through a pipe from another child process.  The pipe must not
+	 * leak into the patch(1) processes started by the other threads.
+	 * The file will be reopened by name, since patch(1) may replace it.
+	 */
+	close(pub->fd);
+	pub->fd = -1;
+	int pfd[2];
+	if (pipe2(pfd, O_CLOEXEC) == -1) {
+		warn("Could not create a pipe for patching '%s'", filename);
+		return (false);
+	}
+	const pid_t feeder = fork();
+	if (feeder == -1) {
+		warn("Could not fork for patching '%s'", filename);
+		close(pfd[0]);
+		close(pfd[1]);
+		return (false);
+	} else if (feeder == 0) {
+		close(pfd[0]);
+		_exit(writen(pfd[1], patch, patch_len) ? 0 : 1);
+	}
+	close(pfd[1]);
+
+	const pid_t pid = fork();
+	if (pid == -1) {
+		warn("Could not fork for patching '%s'", filename);
+		close(pfd[0]);
+		waitpid(feeder, NULL, 0);
+		return (false);
+	} else if (pid == 0) {
+		if (dup2(pfd[0], 0) == -1)
+			err(1, "Could not reopen standard input from the recorded patch file '%s' for '%s'", patch_filename, filename);
+		execlp("patch", "patch", "-R", "-f", "-s", "-r", "-", "-o", temp_filename, "--", filename, NULL);
+		err(1, "Could not run 'patch' for '%s'", filename);
+	}
+	close(pfd[0]);
+
+	int status;
+	const bool waited = waitpid(pid, &status, 0) != -1;
+	waitpid(feeder, NULL, 0);
+	if (!waited) {
+		warn("Could not wait for 'patch' to process '%s'", temp_filename);
+		return (false);
+	} else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		warnx("Something went wrong with 'patch' for '%s'", temp_filename);
+		return (false);
+	}
+	return (true);
+}
+
+static bool
+rollback_patch(const struct rollback_index_line * const rb, const struct txn_db * const db)
+{
+	const char * const filename = rb->line.filename;
+	const size_t idx = rb->line.idx;
+
+	char * const patch_filename = artifact_path(db, idx, "");
+	struct artifact_file patch_file;
+	if (!artifact_open(db, idx, "", &patch_file)) {
+		const bool gone = errno == ENOENT;
+		if (gone)
+			warnx("Could not roll back a patch to '%s': the recorded patch file '%s' is gone", filename, patch_filename);
+		else
+			warn("Could not open the recorded patch file '%s' for '%s'", patch_filename, filename);
+		free(patch_filename);
+		return (gone);
+	}
+	char *patch;
+	size_t patch_len;
+	const bool loaded = artifact_load(&patch_file, &patch, &patch_len);
+	if (!loaded)
+		warnx("Could not read the recorded patch file '%s' for '%s'", patch_file.path, filename);
+	artifact_close(&patch_file);
+	if (!loaded) {
+		free(patch_filename);
+		return (false);
+	}
+
+	struct stat orig_sb;
+	struct publish_file pub;
+	if (stat(filename, &orig_sb) == -1) {
+		warn("Could not examine the attributes of '%s' before patching it", filename);
+		free(patch);
+		free(patch_filename);
+		return (false);
+	} else if (!publish_open(&pub, filename, true)) {
+		free(patch);
+		free(patch_filename);
+		return (false);
+	}
+
+	bool res = rollback_patch_temp(filename, patch_filename, patch, patch_len, &pub);
+	free(patch);
+	if (!res) {
+		publish_abort(&pub);
+	} else {
+		const struct install_opts opts = {
+			.set_owner = true,
+			.owner = orig_sb.st_uid,
+			.set_group = true,
+			.group = orig_sb.st_gid,
+			.mode = orig_sb.st_mode & 03777,
+		};
+		res = publish_commit(&pub, &opts, db);
+	}
+
+	free(patch_filename);
+	return (res);
+}
+
+/*
+ * Put a plain stored copy of a file back in place if it is on the same
+ * file system: link it there or, if it replaces the current file, link
+ * it next to that one and rename it over it.  The stored copy itself is
+ * only removed once the rollback has been recorded.  Returns 1 if it
+ * was put back, 0 if it needs to be copied, and -1 on error.
+ */
+static int
+restore_move(const struct txn_db * const db, const struct artifact_file * const f, const struct install_opts * const opts, const char * const dst, const bool replace)
+{
+	char * const dir = path_dirname(dst);
+	if (dir == NULL)
+		return (-1);
+	struct stat sb, dsb;
+	const bool same_fs = fstat(f->fd, &sb) == 0 && sb.st_nlink == 1 &&
+	    stat(dir, &dsb) == 0 && sb.st_dev == dsb.st_dev;
+	free(dir);
+	if (!same_fs)
+		return (0);
+
+	if (!publish_metadata(f->fd, dst, opts) || !sync_fd(db, f->fd, dst))
+		return (-1);
+
+	char *temp = NULL;
+	if (replace) {
+		struct publish_file pub;
+		if (!publish_open_named(&pub, dst, true))
+			return (-1);
+		close(pub.fd);
+		unlink(pub.temp);
+		temp = pub.temp;
+	}
+	if (link(f->path, temp != NULL ? temp : dst) == -1) {
+		const int saved = errno;
+		free(temp);
+		/* Somebody else took the temporary name; make a copy instead. */
+		if (saved == EXDEV || (saved == EEXIST && replace))
+			return (0);
+		errno = saved;
+		warn("Could not link '%s' to '%s'", f->path, dst);
+		return (-1);
+	}
+	if (temp != NULL) {
+		if (rename(temp, dst) == -1) {
+			warn("Could not rename '%s' to '%s'", temp, dst);
+			unlink(temp);
+			free(temp);
+			return (-1);
+		}
+		free(temp);
+	}
+	return (sync_dir(db, dst) ? 1 : -1);
+}
+
+/*
+ * Copy the stored contents of a file into a new one and put it in place,
+ * letting the kernel do it for a plain copy.
+ */
+static bool
+restore_copy(const struct txn_db * const db, struct artifact_file * const f, const bool plain, const struct install_opts * const opts, const char * const dst, const bool replace)
+{
+	struct publish_file pub;
+	if (!publish_open(&pub, dst, replace))
+		return (false);
+
+	bool res;
+	if (plain) {
+		struct stat sb;
+		res = fstat(f->fd, &sb) == 0;
+		if (!res)
+			warn("Could not examine '%s'", f->path);
+		else
+			res = clone_fd(f->fd, f->path, pub.fd, dst, &sb);
+	} else {
+		struct artifact_reader r;
+		res = artifact_reader_open(&r, f);
+		char buf[ARTIFACT_IO_SIZE];
+		ssize_t n;
+		while (res && (n = artifact_read(&r, buf, sizeof(buf))) != 0)
+			if (n == -1) {
+				warnx("Could not read from '%s' to copy it for recreating", f->path);
+				res = false;
+			} else if (!writen(pub.fd, buf, n)) {
+				warn("Could not copy '%s' for recreating '%s'", f->path, dst);
+				res = false;
+			}
+		artifact_reader_close(&r);
+	}
+	if (!res) {
+		publish_abort(&pub);
+		return (false);
+	} else if (!publish_commit(&pub, opts, db)) {
+		warnx("Could not recreate '%s'", dst);
+		return (false);
+	}
+	return (true);
+}
+
+/*
+ * Put back a file saved into the database when it was removed or, if
+ * replace is set, overwritten by a binary file.
+ */
+static bool
+rollback_restore(const struct rollback_index_line * const rb, const struct txn_db * const db, const bool replace)
+{
+	const char * const filename = rb->line.filename;
+	const size_t idx = rb->line.idx;
+	const char * const change = replace ? "an overwrite" : "a removal";
+	const char * const kind = replace ? "backup" : "removal";
+
+	char * const rmv_filename = artifact_path(db, idx, "");
+	struct artifact_file rmv_file;
+	if (!artifact_open(db, idx, "", &rmv_file)) {
+		const bool gone = errno == ENOENT;
+		if (gone)
+			warnx("Could not roll back %s of '%s': the recorded file '%s' is gone", change, filename, rmv_filename);
+		else
+			warn("Could not open the recorded %s file '%s' for '%s'", kind, rmv_filename, filename);
+		free(rmv_filename);
+		return (gone);
+	}
+
+	if (!replace) {
+		struct stat sb;
+		if (stat(filename, &sb) == 0) {
+			warnx("Could not roll back a removal of '%s': it was recreated in the meantime", filename);
+			artifact_close(&rmv_file);
+			free(rmv_filename);
+			return (true);
+		}
+	}
+
+	struct stat orig_sb;
+	bool separate;
+	if (!artifact_read_meta(&rmv_file, &orig_sb, &separate)) {
+		warnx("Could not read the %s metadata from '%s' for '%s'", kind, rmv_file.path, filename);
+		artifact_close(&rmv_file);
+		free(rmv_filename);
+		return (false);
+	}
+	if (separate) {
+		artifact_close(&rmv_file);
+		if (!artifact_open(db, idx, ARTIFACT_DATA_SUFFIX, &rmv_file)) {
+			char * const data_filename = artifact_path(db, idx, ARTIFACT_DATA_SUFFIX);
+			warn("Could not open the recorded %s file '%s' for '%s'", kind, data_filename, filename);
+			free(data_filename);
+			free(rmv_filename);
+			return (false);
+		}
+	}
+	const struct install_opts opts = {
+		.set_owner = true,
+		.owner = orig_sb.st_uid,
+		.set_group = true,
+		.group = orig_sb.st_gid,
+		.mode = orig_sb.st_mode & 03777,
+	};
+
+	/* A plain copy of the contents may be put back as it is. */
+	char head[ARTIFACT_CODEC_MAGIC_SIZE];
+	const bool plain = separate && db->pack == NULL &&
+	    (pread(rmv_file.fd, head, sizeof(head), 0) != (ssize_t)sizeof(head) ||
+	     memcmp(head, ARTIFACT_CODEC_MAGIC, sizeof(head)) != 0);
+	const int moved = plain ? restore_move(db, &rmv_file, &opts, filename, replace) : 0;
+	const bool res = moved == 1 ||
+	    (moved == 0 && restore_copy(db, &rmv_file, plain, &opts, filename, replace));
+	artifact_close(&rmv_file);
+	free(rmv_filename);
+	return (res);
 }
 
+/*
+ * Remove a created file or, if it overwrote a binary file that was
+ * saved into the database, put that one back.
+ */
 static bool
-run_install_exact(char ** const argv)
+rollback_create(const struct rollback_index_line * const rb, const struct txn_db * const db)
 {
-	const char * const filename = argv[8];
-	struct stat sb;
-	if (stat(filename, &sb) == -1) {
-		warn("Could not examine '%s'", filename);
+	const char * const filename = rb->line.filename;
+	struct artifact_file f;
+	if (artifact_open(db, rb->line.idx, "", &f)) {
+		artifact_close(&f);
+		return (rollback_restore(rb, db, true));
+	} else if (errno != ENOENT) {
+		char * const backup_filename = artifact_path(db, rb->line.idx, "");
+		warn("Could not open the recorded backup file '%s' for '%s'", backup_filename, filename);
+		free(backup_filename);
 		return (false);
 	}
 
-	if (asprintf(&argv[3], "%d", sb.st_uid) < 0 ||
-	    asprintf(&argv[5], "%d", sb.st_gid) < 0 ||
-	    asprintf(&argv[7], "%o", sb.st_mode & 03777) < 0) {
-		warn("Could not set up an install(1) line for '%s'", filename);
-		return (false);
+	if (unlink(filename) == -1) {
+		if (errno != ENOENT)
+			warn("Could not remove '%s'", filename);
+		return (true);
 	}
-
-	return (run_install(argv));
-}
-
-static void
-rollback_install(const long pos, const struct txn_db * const db, const size_t line_idx)
-{
-	if (fseek(db->file, pos, SEEK_SET) == -1)
-		err(1, "Could not rewind the database index '%s'", db->idx);
-	fprintf(db->file, "%06zu\n", line_idx);
-	if (ferror(db->file))
-		err(1, "Could not remove a just-added entry in the database index '%s'", db->idx);
-	if (fflush(db->file) == EOF)
-		err(1, "Could not write out the removal of a just-added entry in the database index '%s'", db->idx);
-	if (ftruncate(fileno(db->file), pos + INDEX_NUM_SIZE + 1) == -1)
-		err(1, "Could not truncate the database index '%s' after removing a just-added entry", db->idx);
+	return (sync_dir(db, filename));
 }
 
-static struct index_line
-read_last_index(const struct txn_db * const db)
+/* Revert the change to a single file recorded in an index entry. */
+static bool
+rollback_entry(const struct rollback_index_line * const rb, const struct txn_db * const db)
 {
-	if (fseek(db->file, -(INDEX_NUM_SIZE + 1), SEEK_END) == -1)
-		err(1, "Could not seek almost to the end of the database index '%s'", db->idx);
-	struct index_line ln = INDEX_LINE_INIT;
-	const long fpos = ftell(db->file);
-	if (fpos == -1)
-		err(1, "Could not get the current database index position");
-	ln.read_any = fpos > 0;
-	read_next_index_line(db->file, db->idx, &ln);
-	if (ln.module != NULL)
-		errx(1, "Internal error, the last line of the database index should really be a last one...");
+	switch (rb->line.action) {
+		case ACT_PATCH:
+			return (rollback_patch(rb, db));
 
-	if (fseek(db->file, -(INDEX_NUM_SIZE + 1), SEEK_CUR) == -1)
-		err(1, "Could not seek back in the database index '%s'", db->idx);
-	return (ln);
-}
+		case ACT_CREATE:
+			return (rollback_create(rb, db));
 
-static int
-do_install(const bool exact, const int argc, char * const argv[])
-{
-	if (!exact) {
-		int ch;
-		optind = 0;
-		while (ch = getopt(argc, argv, "cg:m:o:"), ch != -1)
-			switch (ch) {
-				case 'c':
-				case 'g':
-				case 'm':
-				case 'o':
-					break;
+		case ACT_REMOVE:
+			return (rollback_restore(rb, db, false));
 
-				default:
-					errx(1, "Unhandled install(1) command-line option");
-					/* NOTREACHED */
-			}
-	} else {
-		/* Still need to run getopt(); what if somebody passed "--"? */
-		optind = 0;
-		if (getopt(argc, argv, "") != -1)
-			errx(1, "install-exact does not expect any option arguments");
+		default:
+			errx(1, "Internal error: should not have tried to roll back a '%s' action", index_action_names[rb->line.action]);
+			/* NOTREACHED */
 	}
+}
 
-	const int pos_argc = argc - optind;
-	char * const * const pos_argv = argv + optind;
-	if (pos_argc < 2) // FIXME: handle -d
-		usage(true);
-
-	const struct txn_db db = open_or_create_db(true);
-	struct index_line ln = read_last_index(&db);
-
-	const size_t install_argc = exact
-		? 10 /* whee, magic numbers! */
-		: argc;
-	char ** const install_argv = malloc((install_argc + 1) * sizeof(*install_argv));
-	install_argv[0] = strdup("install");
-	if (!exact) {
-		for (int i = 1; i < argc; i++)
-			install_argv[i] = argv[i];
-	} else {
-		install_argv[1] = strdup("-c");
-		install_argv[2] = strdup("-o");
-		//install_argv[3] = strdup("root");
-		install_argv[4] = strdup("-g");
-		//install_argv[5] = strdup("wheel");
-		install_argv[6] = strdup("-m");
-		//install_argv[7] = strdup("755");
-		//install_argv[8] = strdup("source");
-		install_argv[9] = argv[argc - 1];
-	}
-	install_argv[install_argc] = NULL;
-
-	const char * const destination = pos_argv[pos_argc - 1];
-	for (int i = 0; i < pos_argc - 1; i++) {
-		const long rollback_pos = ftell(db.file);
-
-		if (!record_install(pos_argv[i], destination, &db, ln.idx)) {
-			rollback_install(rollback_pos, &db, ln.idx);
-			return (1);
-		}
-
-		install_argv[install_argc - 2] = pos_argv[i];
-		const bool res = exact
-			? run_install_exact(install_argv)
-			: run_install(install_argv);
-		if (!res) {
-			rollback_install(rollback_pos, &db, ln.idx);
-			return (1);
-		}
-
-		ln.idx++;
-	}
+/* An index entry and the file it refers to, however it was named. */
+struct rollback_target {
+	const struct rollback_index_line	*rb;
+	struct file_key				key;
+};
 
-	return (0);
-}
+/*
+ * The changes to a single file, newest first; they must be reverted
+ * in that order, but independently of the ones to other files.  All
+ * the changes to unknown files form a single chain.
+ */
+struct rollback_chains {
+	const struct txn_db			*db;
+	const struct rollback_index_line	*lines;
+	struct rollback_target			*sorted;
+	size_t					count;
+	size_t					*starts;
+	size_t					nchains;
+	bool					*undone;
+};
 
 static int
-cmd_install(const int argc, char * const argv[])
+cmp_rollback_chain(const void * const a, const void * const b)
 {
-	return (do_install(false, argc, argv));
+	const struct rollback_target * const ta = a;
+	const struct rollback_target * const tb = b;
+	const int res = file_key_cmp(&ta->key, &tb->key);
+	if (res != 0)
+		return (res);
+	return (ta->rb > tb->rb ? -1 : ta->rb < tb->rb);
 }
 
-static int
-cmd_install_exact(const int argc, char * const argv[])
+static void
+rollback_chain(void * const arg, const size_t idx)
 {
-	return (do_install(true, argc, argv));
+	const struct rollback_chains * const c = arg;
+	const size_t end = idx + 1 < c->nchains ? c->starts[idx + 1] : c->count;
+	for (size_t i = c->starts[idx]; i < end; i++) {
+		const struct rollback_index_line * const rb = c->sorted[i].rb;
+		/* The older changes depend on this one being undone. */
+		if (!rollback_entry(rb, c->db))
+			return;
+		c->undone[rb - c->lines] = true;
+	}
 }
 
 static int
-cmd_remove(const int argc, char * const argv[])
+cmd_rollback(const int argc, char * const argv[])
 {
 	if (argc != 2)
 		usage(true);
 
-	const char * const fname = argv[1];
-	if (strlen(fname) < 2)
-		errx(1, "For txn-install's purposes, the removed filename should be at least two characters long");
-	struct stat sb;
-	if (stat(fname, &sb) == -1) {
-		if (errno != ENOENT)
-			err(1, "Could not examine '%s'", fname);
-		else
-			errx(1, "Cannot remove '%s' since it does not exist", fname);
-	} else if (!S_ISREG(sb.st_mode)) {
-		errx(1, "Only know how to remove regular files, not '%s'", fname);
-	}
+	const char * const module = argv[1];
+	const struct txn_db db = open_or_create_db(true, INDEX_TEXT);
 
-	const struct txn_db db = open_or_create_db(true);
-	struct index_line ln = read_last_index(&db);
+	struct index_records recs;
+	struct modidx_stamp stamp;
+	const bool have_stamp = index_load_module(&db, &recs, module, &stamp);
+	const struct rollback_index_line * const lines = recs.lines;
+	const size_t lcount = recs.count;
 
-	FILE * const fp = fopen(fname, "r");
-	if (fp == NULL)
-		err(1, "Could not open '%s' for reading", fname);
-
-	char *backup_filename;
-	if (asprintf(&backup_filename, "%s/txn.%06zu", db.dir, ln.idx) < 0)
-		err(1, "Could not generate a patch filename for '%s'", fname);
-	const int backup_fd = open(backup_filename, O_RDWR | O_CREAT | O_EXCL, 0600);
-	if (backup_fd == -1)
-		err(1, "Could not create the '%s' patch file for '%s'", backup_filename, fname);
-	if (flock(backup_fd, LOCK_EX | LOCK_NB) == -1)
-		err(1, "Could not lock the '%s' patch file for '%s'", backup_filename, fname);
-	FILE * const backup = fdopen(backup_fd, "w");
-	if (backup == NULL) {
-		const int save_errno = errno;
-		close(backup_fd);
-		unlink(backup_filename);
-		errno = save_errno;
-		err(1, "Could not reopen the '%s' patch file for '%s'", backup_filename, fname);
+	/* Nothing to do? */
+	if (lcount == 0) {
+		index_records_free(&recs);
+		fclose(db.file);
+		return (0);
 	}
 
-	{
-		const size_t wr = fwrite(&sb, 1, sizeof(sb), backup);
-		if (wr != sizeof(sb)) {
-			const int save_errno = errno;
-			close(backup_fd);
-			unlink(backup_filename);
-			errno = save_errno;
+	/* Check the settings before any of the worker threads do. */
+	get_patcher();
 
-			if (ferror(backup))
-				err(1, "Could not save the metadata of '%s' to '%s'", fname, backup_filename);
-			else
-				errx(1, "Something went wrong saving the metadata of '%s' to '%s', only wrote %zu of %zu bytes", fname, backup_filename, wr, sizeof(sb));
+	struct rollback_chains chains = {
+		.db = &db,
+		.lines = lines,
+		.sorted = malloc(lcount * sizeof(*chains.sorted)),
+		.count = lcount,
+		.starts = malloc(lcount * sizeof(*chains.starts)),
+		.undone = calloc(lcount, sizeof(*chains.undone)),
+	};
+	if (chains.sorted == NULL || chains.starts == NULL || chains.undone == NULL)
+		errx(1, "Out of memory");
+	for (size_t i = 0; i < lcount; i++)
+		chains.sorted[i] = (struct rollback_target){
+			.rb = &lines[i],
+			.key = file_key_get(lines[i].line.filename),
+		};
+	qsort(chains.sorted, lcount, sizeof(*chains.sorted), cmp_rollback_chain);
+	for (size_t i = 0; i < lcount; i++)
+		if (i == 0 || file_key_cmp(&chains.sorted[i].key, &chains.sorted[i - 1].key) != 0)
+			chains.starts[chains.nchains++] = i;
+	run_workers(rollback_chain, &chains, chains.nchains);
+
+	/* Mark the undone actions in a single pass over the index. */
+	bool all_undone = true;
+	for (size_t i = 0; i < lcount; i++) {
+		if (!chains.undone[i]) {
+			all_undone = false;
+			continue;
 		}
-	}
 
-	char buf[8192];
-	size_t n;
-	while (n = fread(buf, 1, sizeof(buf), fp), n > 0) {
-		const size_t wr = fwrite(buf, 1, n, backup);
-		if (wr < n) {
-			const int save_errno = errno;
-			close(backup_fd);
-			unlink(backup_filename);
-			errno = save_errno;
-
-			if (ferror(backup))
-				err(1, "Could not save '%s' to '%s'", fname, backup_filename);
-			else
-				errx(1, "Something went wrong saving '%s' to '%s', only wrote %zu of %zu bytes", fname, backup_filename, wr, n);
+		const struct rollback_index_line * const rb = &lines[i];
+		const char * const act_name = index_action_names[rb->line.action];
+		if (db.format == INDEX_BINARY) {
+			if (fseek(db.file, rb->fpos + BINIDX_STATUS_OFFSET, SEEK_SET) == -1)
+				err(1, "Could not rewind the index to mark an action as undone");
+			if (fputc(BINIDX_STATUS_UNDONE, db.file) == EOF)
+				err(1, "Could not mark an action as undone in the index");
+		} else {
+			if (fseek(db.file, rb->fpos + db.num_size + 1 + strlen(rb->line.module) + 1, SEEK_SET) == -1)
+				err(1, "Could not rewind the index to mark an action as undone");
+			if (fprintf(db.file, "un%s ", act_name) != (int)strlen(act_name) + 3)
+				err(1, "Could not mark an action as undone in the index");
 		}
 	}
-	if (ferror(fp)) {
-		const int save_errno = errno;
-		close(backup_fd);
-		unlink(backup_filename);
-		errno = save_errno;
-		err(1, "Could not save '%s' to '%s'", fname, backup_filename);
-	}
-
-	if (unlink(fname) == -1) {
-		const int save_errno = errno;
-		close(backup_fd);
-		unlink(backup_filename);
-		errno = save_errno;
-		err(1, "Could not remove '%s'", fname);
+	free(chains.starts);
+	free(chains.sorted);
+	if (fflush(db.file) == EOF)
+		err(1, "Could not write out the database index '%s'", db.idx);
+	if (!sync_index(&db) || !sync_commit(&db))
+		return (1);
+
+	/* The stored copies are no longer needed once that is on the disk. */
+	for (size_t i = 0; i < lcount; i++)
+		if (chains.undone[i])
+			artifact_remove(&db, lines[i].line.idx);
+	free(chains.undone);
+	/* If anything is left over, the module index will be rebuilt. */
+	if (have_stamp && all_undone)
+		modidx_rolled_back(&db, &stamp, module);
+
+	index_records_free(&recs);
+	if (!all_undone) {
+		warnx("Could not roll back all the changes made by the '%s' module", module);
+		return (1);
 	}
-
-	return (write_db_entry(&db, (struct index_line){
-		.idx = ln.idx,
-		.module = db.module,
-		.action = ACT_REMOVE,
-		.filename = fname,
-	}) ? 0 : 1);
+	return (0);
 }
 
 static void
-rollback_patch(const struct rollback_index_line * const rb, const struct txn_db * const db)
+batch_add(struct batch * const b, const struct batch_op op)
 {
-	const char * const filename = rb->line.filename;
-	const size_t idx = rb->line.idx;
-
-	char *patch_filename;
-	if (asprintf(&patch_filename, "%s/txn.%06zu", db->dir, idx) < 0)
-		err(1, "Could not allocate memory for the patch filename");
-	const int patch_fd = open(patch_filename, O_RDONLY);
-	if (patch_fd == -1) {
-		if (errno == ENOENT) {
-			warnx("Could not roll back a patch to '%s': the recorded patch file '%s' is gone", filename, patch_filename);
-			return;
-		} else {
-			err(1, "Could not open the recorded patch file '%s' for '%s'", patch_filename, filename);
-		}
-	}
-
-	struct stat orig_sb;
-	if (stat(filename, &orig_sb) == -1)
-		err(1, "Could not examine the attributes of '%s' before patching it", filename);
-
-	char *temp_filename;
-	if (asprintf(&temp_filename, "%s.XXXXXX", filename) < 0)
-		err(1, "Could not allocate memory for the patched file template");
-	const int temp_fd = mkstemp(temp_filename);
-	if (temp_fd == -1)
-		err(1, "Could not create a temporary file to patch '%s'", filename);
-	struct stat temp_sb;
-	if (fstat(temp_fd, &temp_sb) == -1) {
-		const int save_errno = errno;
-		unlink(temp_filename);
-		errno = save_errno;
-		err(1, "Could not examine the just-created temporary file '%s'", temp_filename);
-	}
-	close(temp_fd);
-
-	{
-		const pid_t pid = fork();
-		if (pid == -1) {
-			const int save_errno = errno;
-			unlink(temp_filename);
-			errno = save_errno;
-			err(1, "Could not fork for patching '%s'", filename);
-		} else if (pid == 0) {
-			if (dup2(patch_fd, 0) == -1)
-				err(1, "Could not reopen standard input from the recorded patch file '%s' for '%s'", patch_filename, filename);
-			execlp("patch", "patch", "-R", "-f", "-s", "-r", "-", "-o", temp_filename, "--", filename, NULL);
-			err(1, "Could not run 'patch' for '%s'", filename);
-		}
-		close(patch_fd);
-
-		int status;
-		if (waitpid(pid, &status, 0) == -1) {
-			const int save_errno = errno;
-			unlink(temp_filename);
-			errno = save_errno;
-			err(1, "Could not wait for 'patch' to process '%s'", temp_filename);
-		} else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
-			unlink(temp_filename);
-			errx(1, "Something went wrong with 'patch' for '%s'", temp_filename);
-		}
-
-		if ((temp_sb.st_uid != orig_sb.st_uid || temp_sb.st_gid != orig_sb.st_gid) &&
-		    chown(temp_filename, orig_sb.st_uid, orig_sb.st_gid) == -1) {
-			const int save_errno = errno;
-			unlink(temp_filename);
-			errno = save_errno;
-			err(1, "Could not set the owner and group of the temporary '%s'", temp_filename);
-		}
-		if ((temp_sb.st_mode & 03777) != (orig_sb.st_mode & 03777) &&
-		    chmod(temp_filename, orig_sb.st_mode & 03777) == -1) {
-			const int save_errno = errno;
-			unlink(temp_filename);
-			errno = save_errno;
-			err(1, "Could not set the permissions mode of the temporary '%s'", temp_filename);
-		}
-		if (rename(temp_filename, filename) == -1) {
-			const int save_errno = errno;
-			unlink(temp_filename);
-			errno = save_errno;
-			err(1, "Could not rename the temporary '%s' to '%s'", temp_filename, filename);
-		}
-	}
-
-	unlink(patch_filename);
-
-	free(temp_filename);
-	free(patch_filename);
+	FLEXARR_ALLOC(b->ops, 1, b->count, b->alloc);
+	b->ops[b->count - 1] = op;
 }
 
-static void
-rollback_remove(const struct rollback_index_line * const rb, const struct txn_db * const db)
+/*
+ * Parse a single line of a batch manifest; the operations keep pointers
+ * into the line, so it must not be freed.
+ */
+static bool
+batch_parse_line(struct batch * const b, char * const line, const char * const fname, const size_t lineno)
 {
-	const char * const filename = rb->line.filename;
-	const size_t idx = rb->line.idx;
+	char **words;
+	size_t nwords, walloc;
+	FLEXARR_INIT(words, nwords, walloc);
+	for (char *w = strtok(line, " \t\n"); w != NULL; w = strtok(NULL, " \t\n")) {
+		FLEXARR_ALLOC(words, 1, nwords, walloc);
+		words[nwords - 1] = w;
+	}
 
-	char *rmv_filename;
-	if (asprintf(&rmv_filename, "%s/txn.%06zu", db->dir, idx) < 0)
-		err(1, "Could not allocate memory for the patch filename");
-	const int rmv_fd = open(rmv_filename, O_RDONLY);
-	if (rmv_fd == -1) {
-		if (errno == ENOENT) {
-			warnx("Could not roll back a removal of '%s': the recorded file '%s' is gone", filename, rmv_filename);
-			return;
+	bool res = true;
+	if (nwords == 0 || words[0][0] == '#') {
+		/* Nothing to do. */
+	} else if (nwords < 2) {
+		warnx("%s:%zu: no module name specified", fname, lineno);
+		res = false;
+	} else if (!index_valid_name(words[1])) {
+		warnx("%s:%zu: invalid module name '%s'", fname, lineno, words[1]);
+		res = false;
+	} else if (strcmp(words[0], "remove") == 0) {
+		if (nwords != 3) {
+			warnx("%s:%zu: 'remove' expects a single filename", fname, lineno);
+			res = false;
 		} else {
-			err(1, "Could not open the recorded removal file '%s' for '%s'", rmv_filename, filename);
+			batch_add(b, (struct batch_op){
+				.line = lineno,
+				.module = words[1],
+				.remove = true,
+				.dst = words[2],
+			});
 		}
-	}
-
-	{
-		struct stat sb;
-		if (stat(filename, &sb) == 0) {
-			warnx("Could not roll back a removal of '%s': it was recreated in the meantime", filename);
-			unlink(rmv_filename);
-			return;
+	} else if (strcmp(words[0], "install") == 0 ||
+	    strcmp(words[0], "install-exact") == 0) {
+		const char * const module = words[1];
+		/* Let getopt(3) see the command name as argv[0]. */
+		words[1] = words[0];
+		const int argc = nwords - 1;
+		char * const * const argv = words + 1;
+		struct install_opts opts;
+		int first;
+		if (!parse_install_opts(strcmp(words[0], "install-exact") == 0, argc, argv, &opts, &first)) {
+			warnx("%s:%zu: invalid '%s' options", fname, lineno, words[0]);
+			res = false;
+		} else if (argc - first < 2) {
+			warnx("%s:%zu: '%s' expects at least a source and a destination", fname, lineno, words[0]);
+			res = false;
+		} else {
+			const char * const destination = argv[argc - 1];
+			for (int i = first; i < argc - 1; i++)
+				batch_add(b, (struct batch_op){
+					.line = lineno,
+					.module = module,
+					.opts = opts,
+					.src = argv[i],
+					.dst = get_destination_filename(argv[i], destination),
+				});
 		}
+	} else {
+		warnx("%s:%zu: unknown command '%s'", fname, lineno, words[0]);
+		res = false;
 	}
+	FLEXARR_FREE(words, walloc);
+	return (res);
+}
 
-	FILE * const rmv_fp = fdopen(rmv_fd, "r");
-	if (rmv_fp == NULL)
-		err(1, "Could not reopen the recorded removal file '%s' for '%s'", rmv_filename, filename);
+/* Check that a batch operation's source file may be installed or removed. */
+static bool
+batch_check(const struct batch_op * const op)
+{
+	if (op->remove)
+		return (check_remove(op->dst));
 
-	struct stat orig_sb;
-	if (fread(&orig_sb, sizeof(orig_sb), 1, rmv_fp) != 1)
-		err(1, "Could not read the removal metadata from '%s' for '%s'", rmv_filename, filename);
-
-	char *temp_filename;
-	if (asprintf(&temp_filename, "%s.XXXXXX", filename) < 0)
-		err(1, "Could not allocate memory for the recreated file template");
-	const int temp_fd = mkstemp(temp_filename);
-	if (temp_fd == -1)
-		err(1, "Could not create a temporary file to recreate '%s'", filename);
-	FILE * const temp_fp = fdopen(temp_fd, "w");
-	if (temp_fp == NULL) {
-		const int save_errno = errno;
-		unlink(temp_filename);
-		errno = save_errno;
-		err(1, "Could not reopen the temporary recreated file '%s'", temp_filename);
+	struct stat sb;
+	if (stat(op->src, &sb) == -1) {
+		warn("Could not examine '%s'", op->src);
+		return (false);
 	}
+	return (true);
+}
 
-	char buf[4096];
-	while (true) {
-		const size_t nread = fread(buf, 1, sizeof(buf), rmv_fp);
-		if (nread == 0) {
-			if (ferror(rmv_fp)) {
-				const int save_errno = errno;
-				unlink(temp_filename);
-				errno = save_errno;
-				err(1, "Could not read from '%s' to copy it for recreating", rmv_filename);
-			} else {
-				break;
-			}
-		}
+/*
+ * Check whether a batch operation looks at a file that one of those
+ * recorded, but not performed yet, will change.
+ */
+static bool
+batch_pending(const struct batch * const b, const size_t first, const size_t last)
+{
+	const struct batch_op * const op = &b->ops[last];
+	struct file_key keys[2] = {
+		op->key,
+	};
+	size_t nkeys = 1;
+	if (!op->remove)
+		keys[nkeys++] = file_key_get(op->src);
+	for (size_t k = 0; k < nkeys; k++)
+		if (!keys[k].known)
+			return (first < last);
+	for (size_t i = first; i < last; i++)
+		for (size_t k = 0; k < nkeys; k++)
+			if (file_key_cmp(&b->ops[i].key, &keys[k]) == 0)
+				return (true);
+	return (false);
+}
 
-		const size_t nwritten = fwrite(buf, 1, nread, temp_fp);
-		if (nwritten < nread) {
-			const int save_errno = errno;
-			unlink(temp_filename);
-			errno = save_errno;
-			err(1, "Could not copy '%s' to '%s' for recreating", rmv_filename, temp_filename);
-		}
-	}
-	fclose(rmv_fp);
-	if (fclose(temp_fp) == EOF) {
-		const int save_errno = errno;
-		unlink(temp_filename);
-		errno = save_errno;
-		err(1, "Could not copy '%s' to '%s' for recreating", filename, temp_filename);
+/* Record a single batch operation in the database index. */
+static bool
+batch_record(struct batch_op * const op, const struct txn_db * const db, const size_t idx)
+{
+	const struct txn_db op_db = {
+		.dir = db->dir,
+		.idx = db->idx,
+		.file = db->file,
+		.module = op->module,
+		.format = db->format,
+		.num_size = db->num_size,
+		.sync = db->sync,
+		.dedup = db->dedup,
+		.sharded = db->sharded,
+		.pack = db->pack,
+	};
+	op->idx = idx;
+
+	if (op->remove) {
+		op->action = ACT_REMOVE;
+		if (!check_remove(op->dst))
+			return (false);
+		op->recorded = true;
+		return (record_remove(op->dst, &op_db, idx));
 	}
 
-	const pid_t pid = fork();
-	if (pid == -1) {
-		const int save_errno = errno;
-		unlink(temp_filename);
-		errno = save_errno;
-		err(1, "Could not fork for recreating '%s'", filename);
-	} else if (pid == 0) {
-		char *owner, *group, *mode;
-		if (asprintf(&owner, "%ld", (long)orig_sb.st_uid) < 0 ||
-		    asprintf(&group, "%ld", (long)orig_sb.st_gid) < 0 ||
-		    asprintf(&mode, "%o", orig_sb.st_mode & 03777) < 0)
-			err(1, "Could not allocate memory for the recreated file's attributes");
+	if (!record_install(op->src, op->dst, &op_db, idx, &op->same, &op->action))
+		return (false);
+	op->recorded = !op->same;
+	return (true);
+}
 
-		execlp("install", "install", "-c", "-o", owner, "-g", group, "-m", mode, "--", temp_filename, filename, NULL);
-		err(1, "Could not execute 'install' to recreate '%s'", filename);
-	}
+/* Perform a single batch operation once its record is on the disk. */
+static bool
+batch_apply(struct batch_op * const op, const struct txn_db * const db)
+{
+	if (op->remove)
+		return (remove_recorded(op->dst, db, op->idx, &op->applied));
+	if (!install_file(op->src, op->dst, &op->opts, op->same, db))
+		return (false);
+	op->applied = !op->same;
+	return (true);
+}
 
-	int status;
-	const int wait_res = waitpid(pid, &status, 0);
-	const int save_errno = errno;
-	unlink(temp_filename);
-	errno = save_errno;
-	if (wait_res == -1)
-		err(1, "Could not wait for 'install' to finish recreating '%s'", filename);
-	else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
-		err(1, "'install' failed to recreate '%s'", filename);
+/*
+ * Flush the records of some batch operations at once, then perform
+ * them; on failure, return the index of the one that failed.
+ */
+static bool
+batch_flush(struct batch * const b, const size_t first, const size_t last, const struct txn_db * const db, size_t * const failed)
+{
+	if (first == last)
+		return (true);
+	*failed = first;
+	if (!sync_commit(db))
+		return (false);
+	for (size_t i = first; i < last; i++)
+		if (!batch_apply(&b->ops[i], db)) {
+			*failed = i;
+			return (false);
+		}
+	return (true);
+}
 
-	unlink(rmv_filename);
+/*
+ * Undo the operations performed up to the last recorded one, remove
+ * their entries from the database index, and then their artifacts.
+ */
+static void
+batch_revert(const struct batch * const b, const size_t last, const struct txn_db * const db, const long pos, const size_t idx)
+{
+	/* A removal may have failed after the file was already gone. */
+	for (size_t i = last + 1; i-- > 0; ) {
+		const struct batch_op * const op = &b->ops[i];
+		if (!op->applied)
+			continue;
+		rollback_entry(&(const struct rollback_index_line){
+			.line = {
+				.idx = op->idx,
+				.module = op->module,
+				.action = op->action,
+				.filename = op->dst,
+			},
+		}, db);
+	}
 
-	free(temp_filename);
-	free(rmv_filename);
+	/* The entries may belong to several modules; rebuild the index. */
+	modidx_invalidate(db->dir);
+	rollback_install(pos, db, idx);
+	if (!sync_commit(db))
+		return;
+	for (size_t i = idx; i <= b->ops[last].idx; i++)
+		artifact_remove(db, i);
 }
 
+/*
+ * Perform all the operations listed in a manifest under a single lock
+ * of the database, undoing all of them if any one fails.
+ */
 static int
-cmd_rollback(const int argc, char * const argv[])
+cmd_batch(const int argc, char * const argv[])
 {
-	if (argc != 2)
+	if (argc > 2)
 		usage(true);
 
-	const char * const module = argv[1];
-	const struct txn_db db = open_or_create_db(true);
-
-	if (fseek(db.file, 0, SEEK_SET) == -1)
-		err(1, "Could not rewind the database index '%s'", db.idx);
-	struct rollback_index_line *lines;
-	size_t lcount, lall;
-	FLEXARR_INIT(lines, lcount, lall);
-	struct index_line ln = INDEX_LINE_INIT;
+	const bool use_stdin = argc < 2 || strcmp(argv[1], "-") == 0;
+	const char * const fname = use_stdin ? "(standard input)" : argv[1];
+	FILE * const fp = use_stdin ? stdin : fopen(fname, "r");
+	if (fp == NULL)
+		err(1, "Could not open the batch manifest '%s'", fname);
+
+	struct batch b;
+	FLEXARR_INIT(b.ops, b.count, b.alloc);
+	size_t lineno = 0;
 	while (true) {
-		const long fpos = ftell(db.file);
-		read_next_index_line(db.file, db.idx, &ln);
-		if (ln.module == NULL)
+		char *line = NULL;
+		size_t len = 0;
+		if (getline(&line, &len, fp) == -1) {
+			free(line);
 			break;
-		if (strcmp(ln.module, module) != 0)
-			continue;
-		switch (ln.action) {
-			case ACT_CREATE:
-			case ACT_PATCH:
-			case ACT_REMOVE:
-				/* Yep, these need to be rolled back. */
-				break;
-
-			case ACT_UNCREATE:
-			case ACT_UNPATCH:
-			case ACT_UNREMOVE:
-				/* Not a second time... */
-				continue;
-
-			default:
-				errx(1, "Invalid database index: unexpected action '%d' for module '%s'", ln.action, module);
-				/* NOTREACHED */
 		}
-
-		FLEXARR_ALLOC(lines, 1, lcount, lall);
-		struct rollback_index_line * const rb = &lines[lcount - 1];
-		rb->line = ln;
-		rb->fpos = fpos;
+		lineno++;
+		if (!batch_parse_line(&b, line, fname, lineno))
+			exit(1);
 	}
-
-	/* Nothing to do? */
-	if (lcount == 0) {
-		fclose(db.file);
+	if (ferror(fp))
+		err(1, "Could not read the batch manifest '%s'", fname);
+	if (!use_stdin)
+		fclose(fp);
+	if (b.count == 0)
 		return (0);
-	}
-
-	for (size_t i = 0; i < lcount; i++) {
-		const struct rollback_index_line * const rb = &lines[lcount - i - 1];
-		const char * const act_name = index_action_names[rb->line.action];
-
-		switch (rb->line.action) {
-			case ACT_PATCH:
-				rollback_patch(rb, &db);
-				break;
 
-			case ACT_CREATE:
-				if (unlink(rb->line.filename) == -1) {
-					if (errno != ENOENT)
-						warn("Could not remove '%s'", rb->line.filename);
-				}
-				break;
-
-			case ACT_REMOVE:
-				rollback_remove(rb, &db);
-				break;
+	const struct txn_db db = open_or_create_db(true, INDEX_TEXT);
 
-			default:
-				errx(1, "Internal error: should not have tried to roll back a '%s' action", act_name);
-				/* NOTREACHED */
+	/* Make sure all the files are there before changing anything. */
+	for (size_t i = 0; i < b.count; i++) {
+		const struct batch_op * const op = &b.ops[i];
+		if (!batch_check(op)) {
+			warnx("%s:%zu: not performing any of the batch operations", fname, op->line);
+			return (1);
 		}
+	}
 
-		if (fseek(db.file, rb->fpos + INDEX_NUM_SIZE + 1 + strlen(rb->line.module) + 1, SEEK_SET) == -1)
-			err(1, "Could not rewind the index to mark an action as undone");
-		if (fprintf(db.file, "un%s ", act_name) != (int)strlen(act_name) + 3)
-			err(1, "Could not mark an action as undone in the index");
+	/*
+	 * Record as many operations as possible, flush all the records at
+	 * once, and only then perform them.  An operation that looks at
+	 * a file changed by one of those waiting must wait for them.
+	 */
+	struct index_line ln = read_last_index(&db);
+	const long start_pos = ftell(db.file);
+	const size_t start_idx = ln.idx;
+	size_t pending = 0, failed;
+	for (size_t i = 0; i < b.count; i++) {
+		struct batch_op * const op = &b.ops[i];
+		op->key = file_key_get(op->dst);
+		if (batch_pending(&b, pending, i)) {
+			if (!batch_flush(&b, pending, i, &db, &failed)) {
+				warnx("%s:%zu: reverting the changes made by the batch", fname, b.ops[failed].line);
+				batch_revert(&b, i - 1, &db, start_pos, start_idx);
+				return (1);
+			}
+			pending = i;
+		}
+		if (!batch_record(op, &db, ln.idx)) {
+			warnx("%s:%zu: reverting the changes made by the batch", fname, op->line);
+			batch_revert(&b, i, &db, start_pos, start_idx);
+			return (1);
+		}
+		if (op->recorded)
+			ln.idx++;
+	}
+	if (!batch_flush(&b, pending, b.count, &db, &failed)) {
+		warnx("%s:%zu: reverting the changes made by the batch", fname, b.ops[failed].line);
+		batch_revert(&b, b.count - 1, &db, start_pos, start_idx);
+		return (1);
 	}
-	
+	if (!sync_commit(&db))
+		return (1);
+	fclose(db.file);
+	FLEXARR_FREE(b.ops, b.alloc);
 	return (0);
 }
 
@@ -1207,7 +6556,14 @@ const struct {
 	const char *name;
 	int (*func)(int argc, char * const argv[]);
 } cmds[] = {
+	{"batch", cmd_batch},
+	{"db-compact", cmd_db_compact},
+	{"db-convert", cmd_db_convert},
+	{"db-dedup", cmd_db_dedup},
+	{"db-dump", cmd_db_dump},
 	{"db-init", cmd_db_init},
+	{"db-shard", cmd_db_shard},
+	{"db-upgrade", cmd_db_upgrade},
 	{"install", cmd_install},
 	{"install-exact", cmd_install_exact},
 	{"list-modules", cmd_list_modules},
@@ -1254,6 +6610,10 @@ main(const int argc, char * const argv[])
 			case '-':
 				if (strcmp(optarg, "features") == 0)
 					listfeatures = true;
+				else if (strcmp(optarg, "wait") == 0)
+					setenv("TXN_INSTALL_WAIT", "forever", 1);
+				else if (strncmp(optarg, "wait=", 5) == 0)
+					setenv("TXN_INSTALL_WAIT", optarg + 5, 1);
 				else if (strcmp(optarg, "help") == 0)
 					hflag = true;
 				else if (strcmp(optarg, "version") == 0)
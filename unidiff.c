@@ -0,0 +1,695 @@
+/*-
+ * Copyright (c) 2026  Peter Pentchev
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "flexarr.h"
+#include "unidiff.h"
+
+struct diff_file {
+	const char	*path;
+	struct stat	 sb;
+	const char	*data;
+	size_t		 len;
+	size_t		 nlines;
+	const char	**lines;
+	size_t		*ids;
+	bool		*changed;
+};
+
+struct diff_class {
+	uint64_t	 hash;
+	const char	*line;
+	size_t		 len;
+};
+
+struct diff_range {
+	ptrdiff_t	xoff, xlim, yoff, ylim;
+};
+
+struct diff_change {
+	size_t		i, j, del, ins;
+};
+
+struct hunk_line {
+	char		 kind;
+	const char	*text;
+	size_t		 len;
+};
+
+struct hunk {
+	size_t		 old_start, old_count;
+	size_t		 new_start, new_count;
+	size_t		 first, count;
+};
+
+static uint64_t
+hash_line(const char * const line, const size_t len)
+{
+	uint64_t h = UINT64_C(14695981039346656037);
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char)line[i];
+		h *= UINT64_C(1099511628211);
+	}
+	return (h);
+}
+
+static void	split_lines(struct arena *arena, struct diff_file *f);
+
+static bool
+load_file(struct arena * const arena, struct diff_file * const f)
+{
+	const int fd = open(f->path, O_RDONLY);
+	if (fd == -1) {
+		warn("Could not open '%s' for comparing", f->path);
+		return (false);
+	}
+	if (fstat(fd, &f->sb) == -1) {
+		warn("Could not examine '%s'", f->path);
+		close(fd);
+		return (false);
+	}
+	if (!S_ISREG(f->sb.st_mode) || (uintmax_t)f->sb.st_size >= SIZE_MAX) {
+		warnx("Not a regular file: '%s'", f->path);
+		close(fd);
+		return (false);
+	}
+
+	const size_t size = f->sb.st_size;
+	char * const data = arena_alloc(arena, size + 1);
+	size_t len = 0;
+	while (len < size) {
+		const ssize_t n = read(fd, data + len, size - len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("Could not read from '%s'", f->path);
+			close(fd);
+			return (false);
+		} else if (n == 0) {
+			break;
+		}
+		len += n;
+	}
+	close(fd);
+	data[len] = '\0';
+	f->data = data;
+	f->len = len;
+	split_lines(arena, f);
+	return (true);
+}
+
+static void
+split_lines(struct arena * const arena, struct diff_file * const f)
+{
+	const char * const data = f->data;
+	const size_t len = f->len;
+	size_t nlines = 0;
+	for (const char *p = data; p < data + len; nlines++) {
+		const char * const nl = memchr(p, '\n', data + len - p);
+		p = nl != NULL ? nl + 1 : data + len;
+	}
+	f->nlines = nlines;
+	f->lines = arena_alloc(arena, (nlines + 1) * sizeof(*f->lines));
+	f->ids = arena_alloc(arena, (nlines + 1) * sizeof(*f->ids));
+	f->changed = arena_alloc(arena, (nlines + 1) * sizeof(*f->changed));
+	const char *p = data;
+	for (size_t i = 0; i < nlines; i++) {
+		f->lines[i] = p;
+		const char * const nl = memchr(p, '\n', data + len - p);
+		p = nl != NULL ? nl + 1 : data + len;
+	}
+	f->lines[nlines] = data + len;
+	memset(f->changed, 0, (nlines + 1) * sizeof(*f->changed));
+}
+
+/*
+ * Give each distinct line a number, so that comparing lines later on
+ * is a matter of comparing two integers.
+ */
+static void
+number_lines(struct arena * const arena, struct diff_file * const files)
+{
+	const size_t total = files[0].nlines + files[1].nlines;
+	size_t tsize = 16;
+	while (tsize < total * 2)
+		tsize *= 2;
+	size_t * const table = arena_alloc(arena, tsize * sizeof(*table));
+	memset(table, 0, tsize * sizeof(*table));
+	struct diff_class * const classes = arena_alloc(arena, (total + 1) * sizeof(*classes));
+	size_t nclasses = 0;
+
+	for (size_t fi = 0; fi < 2; fi++) {
+		struct diff_file * const f = &files[fi];
+		for (size_t i = 0; i < f->nlines; i++) {
+			const char * const line = f->lines[i];
+			const size_t len = f->lines[i + 1] - line;
+			const uint64_t hash = hash_line(line, len);
+			size_t slot = hash & (tsize - 1);
+			while (true) {
+				if (table[slot] == 0) {
+					classes[nclasses] = (struct diff_class){
+						.hash = hash,
+						.line = line,
+						.len = len,
+					};
+					table[slot] = ++nclasses;
+					break;
+				}
+				const struct diff_class * const c = &classes[table[slot] - 1];
+				if (c->hash == hash && c->len == len &&
+				    memcmp(c->line, line, len) == 0)
+					break;
+				slot = (slot + 1) & (tsize - 1);
+			}
+			f->ids[i] = table[slot] - 1;
+		}
+	}
+}
+
+/*
+ * Find the midpoint of the shortest edit script for the specified
+ * ranges, as described in Eugene W. Myers's "An O(ND) Difference
+ * Algorithm and Its Variations".  Give up if that turns out to be
+ * too expensive.
+ */
+static bool
+find_middle_snake(const size_t * const xv, const size_t * const yv,
+    ptrdiff_t * const fd, ptrdiff_t * const bd,
+    const struct diff_range r, ptrdiff_t * const xmid, ptrdiff_t * const ymid)
+{
+	const ptrdiff_t dmin = r.xoff - r.ylim, dmax = r.xlim - r.yoff;
+	const ptrdiff_t fmid = r.xoff - r.yoff, bmid = r.xlim - r.ylim;
+	ptrdiff_t fmin = fmid, fmax = fmid, bmin = bmid, bmax = bmid;
+	const bool odd = (fmid - bmid) & 1;
+
+	fd[fmid] = r.xoff;
+	bd[bmid] = r.xlim;
+	for (size_t cost = 1; cost < UNIDIFF_MAX_COST; cost++) {
+		/* Extend the forward paths by one edit. */
+		if (fmin > dmin)
+			fd[--fmin - 1] = -1;
+		else
+			fmin++;
+		if (fmax < dmax)
+			fd[++fmax + 1] = -1;
+		else
+			fmax--;
+		for (ptrdiff_t d = fmax; d >= fmin; d -= 2) {
+			const ptrdiff_t tlo = fd[d - 1], thi = fd[d + 1];
+			ptrdiff_t x = tlo >= thi ? tlo + 1 : thi;
+			ptrdiff_t y = x - d;
+			while (x < r.xlim && y < r.ylim && xv[x] == yv[y])
+				x++, y++;
+			fd[d] = x;
+			if (odd && bmin <= d && d <= bmax && bd[d] <= x) {
+				*xmid = x;
+				*ymid = y;
+				return (true);
+			}
+		}
+
+		/* And now the backward ones. */
+		if (bmin > dmin)
+			bd[--bmin - 1] = PTRDIFF_MAX;
+		else
+			bmin++;
+		if (bmax < dmax)
+			bd[++bmax + 1] = PTRDIFF_MAX;
+		else
+			bmax--;
+		for (ptrdiff_t d = bmax; d >= bmin; d -= 2) {
+			const ptrdiff_t tlo = bd[d - 1], thi = bd[d + 1];
+			ptrdiff_t x = tlo < thi ? tlo : thi - 1;
+			ptrdiff_t y = x - d;
+			while (x > r.xoff && y > r.yoff && xv[x - 1] == yv[y - 1])
+				x--, y--;
+			bd[d] = x;
+			if (!odd && fmin <= d && d <= fmax && x <= fd[d]) {
+				*xmid = x;
+				*ymid = y;
+				return (true);
+			}
+		}
+	}
+	return (false);
+}
+
+static void
+mark_changed(struct diff_file * const files, const struct diff_range r)
+{
+	for (ptrdiff_t i = r.xoff; i < r.xlim; i++)
+		files[0].changed[i] = true;
+	for (ptrdiff_t i = r.yoff; i < r.ylim; i++)
+		files[1].changed[i] = true;
+}
+
+static void
+compare_lines(struct arena * const arena, struct diff_file * const files)
+{
+	const size_t * const xv = files[0].ids, * const yv = files[1].ids;
+	const size_t ndiags = files[0].nlines + files[1].nlines + 3;
+	ptrdiff_t * const fd = (ptrdiff_t *)arena_alloc(arena, ndiags * sizeof(*fd)) + files[1].nlines + 1;
+	ptrdiff_t * const bd = (ptrdiff_t *)arena_alloc(arena, ndiags * sizeof(*bd)) + files[1].nlines + 1;
+
+	struct diff_range *stack;
+	size_t slen, sall;
+	FLEXARR_INIT(stack, slen, sall);
+	FLEXARR_ALLOC(stack, 1, slen, sall);
+	stack[0] = (struct diff_range){
+		.xoff = 0,
+		.xlim = files[0].nlines,
+		.yoff = 0,
+		.ylim = files[1].nlines,
+	};
+	while (slen > 0) {
+		struct diff_range r = stack[--slen];
+		while (r.xoff < r.xlim && r.yoff < r.ylim && xv[r.xoff] == yv[r.yoff])
+			r.xoff++, r.yoff++;
+		while (r.xoff < r.xlim && r.yoff < r.ylim && xv[r.xlim - 1] == yv[r.ylim - 1])
+			r.xlim--, r.ylim--;
+
+		ptrdiff_t xmid, ymid;
+		if (r.xoff == r.xlim || r.yoff == r.ylim ||
+		    !find_middle_snake(xv, yv, fd, bd, r, &xmid, &ymid)) {
+			mark_changed(files, r);
+			continue;
+		}
+
+		FLEXARR_ALLOC(stack, 2, slen, sall);
+		stack[slen - 2] = (struct diff_range){
+			.xoff = xmid,
+			.xlim = r.xlim,
+			.yoff = ymid,
+			.ylim = r.ylim,
+		};
+		stack[slen - 1] = (struct diff_range){
+			.xoff = r.xoff,
+			.xlim = xmid,
+			.yoff = r.yoff,
+			.ylim = ymid,
+		};
+	}
+	FLEXARR_FREE(stack, sall);
+}
+
+static void
+print_header(FILE * const out, const char * const prefix, const struct diff_file * const f)
+{
+	char stamp[64], zone[16];
+	struct tm tm;
+	if (localtime_r(&f->sb.st_mtim.tv_sec, &tm) == NULL ||
+	    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm) == 0 ||
+	    strftime(zone, sizeof(zone), "%z", &tm) == 0)
+		fprintf(out, "%s %s\n", prefix, f->path);
+	else
+		fprintf(out, "%s %s\t%s.%09ld %s\n", prefix, f->path, stamp, (long)f->sb.st_mtim.tv_nsec, zone);
+}
+
+static void
+print_line(FILE * const out, const char prefix, const struct diff_file * const f, const size_t idx)
+{
+	const char * const line = f->lines[idx];
+	const size_t len = f->lines[idx + 1] - line;
+	putc(prefix, out);
+	fwrite(line, 1, len, out);
+	if (len == 0 || line[len - 1] != '\n')
+		fputs("\n\\ No newline at end of file\n", out);
+}
+
+static void
+print_range(FILE * const out, const char prefix, const size_t start, const size_t count)
+{
+	/* An empty range is denoted by the line just before it. */
+	if (count == 1)
+		fprintf(out, "%c%zu", prefix, start + 1);
+	else
+		fprintf(out, "%c%zu,%zu", prefix, count == 0 ? start : start + 1, count);
+}
+
+static void
+print_hunk(FILE * const out, const struct diff_file * const files,
+    const struct diff_change * const first, const struct diff_change * const last)
+{
+	const size_t pre = first->i < UNIDIFF_CONTEXT ? first->i : UNIDIFF_CONTEXT;
+	const size_t i_start = first->i - pre, j_start = first->j - pre;
+	const size_t i_last = last->i + last->del;
+	const size_t post = files[0].nlines - i_last < UNIDIFF_CONTEXT
+		? files[0].nlines - i_last
+		: UNIDIFF_CONTEXT;
+	const size_t i_end = i_last + post;
+	const size_t j_end = last->j + last->ins + post;
+
+	fputs("@@ ", out);
+	print_range(out, '-', i_start, i_end - i_start);
+	putc(' ', out);
+	print_range(out, '+', j_start, j_end - j_start);
+	fputs(" @@\n", out);
+
+	size_t i = i_start, j = j_start;
+	for (const struct diff_change *c = first; c <= last; c++) {
+		for (; i < c->i; i++, j++)
+			print_line(out, ' ', &files[0], i);
+		for (; i < c->i + c->del; i++)
+			print_line(out, '-', &files[0], i);
+		for (; j < c->j + c->ins; j++)
+			print_line(out, '+', &files[1], j);
+	}
+	for (; i < i_end; i++)
+		print_line(out, ' ', &files[0], i);
+}
+
+static void
+print_diff(FILE * const out, struct diff_file * const files, const bool reproducible)
+{
+	struct diff_change *changes;
+	size_t clen, call;
+	FLEXARR_INIT(changes, clen, call);
+
+	const struct diff_file * const x = &files[0], * const y = &files[1];
+	size_t i = 0, j = 0;
+	while (i < x->nlines || j < y->nlines) {
+		if ((i < x->nlines && x->changed[i]) || (j < y->nlines && y->changed[j])) {
+			const size_t i0 = i, j0 = j;
+			while (i < x->nlines && x->changed[i])
+				i++;
+			while (j < y->nlines && y->changed[j])
+				j++;
+			FLEXARR_ALLOC(changes, 1, clen, call);
+			changes[clen - 1] = (struct diff_change){
+				.i = i0,
+				.j = j0,
+				.del = i - i0,
+				.ins = j - j0,
+			};
+		} else {
+			i++;
+			j++;
+		}
+	}
+
+	if (clen > 0 && reproducible) {
+		fputs("--- old\n+++ new\n", out);
+	} else if (clen > 0) {
+		print_header(out, "---", x);
+		print_header(out, "+++", y);
+	}
+	for (size_t first = 0; first < clen; ) {
+		size_t last = first;
+		while (last + 1 < clen &&
+		    changes[last + 1].i - (changes[last].i + changes[last].del) <= 2 * UNIDIFF_CONTEXT)
+			last++;
+		print_hunk(out, files, &changes[first], &changes[last]);
+		first = last + 1;
+	}
+	FLEXARR_FREE(changes, call);
+}
+
+/*
+ * The result is a valid unified diff that patch(1) applies, but there is
+ * no pass that shifts the changes to the boundaries that diff(1) prefers,
+ * so the hunks may differ from its own when several matches are possible.
+ */
+bool
+unidiff_write(FILE * const out, const char * const old_path, const char * const new_path, const bool reproducible)
+{
+	struct arena arena = ARENA_INIT;
+	struct diff_file files[2] = {
+		{ .path = old_path, },
+		{ .path = new_path, },
+	};
+
+	if (!load_file(&arena, &files[0]) || !load_file(&arena, &files[1])) {
+		arena_free(&arena);
+		return (false);
+	}
+	number_lines(&arena, files);
+	compare_lines(&arena, files);
+	print_diff(out, files, reproducible);
+	arena_free(&arena);
+
+	if (ferror(out)) {
+		warn("Could not write out the differences between '%s' and '%s'", old_path, new_path);
+		return (false);
+	}
+	return (true);
+}
+
+static bool
+parse_range(const char ** const pp, const char prefix, size_t * const start, size_t * const count)
+{
+	const char *p = *pp;
+	if (*p++ != prefix || *p < '0' || *p > '9')
+		return (false);
+	char *end;
+	*start = strtoul(p, &end, 10);
+	if (*end == ',') {
+		p = end + 1;
+		if (*p < '0' || *p > '9')
+			return (false);
+		*count = strtoul(p, &end, 10);
+	} else {
+		*count = 1;
+	}
+	*pp = end;
+	return (true);
+}
+
+/*
+ * Split a unified diff into hunks; only the hunk headers and the lines
+ * within the hunks are examined, anything else is skipped.
+ */
+static bool
+parse_hunks(const struct diff_file * const patch,
+    struct hunk ** const hunks, size_t * const nhunks,
+    struct hunk_line ** const lines, size_t * const nlines)
+{
+	size_t hlen, hall, llen, lall;
+	FLEXARR_INIT(*hunks, hlen, hall);
+	FLEXARR_INIT(*lines, llen, lall);
+
+	size_t idx = 0;
+	while (idx < patch->nlines) {
+		const char *p = patch->lines[idx++];
+		if (strncmp(p, "@@ ", 3) != 0)
+			continue;
+
+		struct hunk h = { .first = llen, };
+		p += 3;
+		if (!parse_range(&p, '-', &h.old_start, &h.old_count) || *p++ != ' ' ||
+		    !parse_range(&p, '+', &h.new_start, &h.new_count) || strncmp(p, " @@", 3) != 0) {
+			warnx("Invalid hunk header at line %zu of '%s'", idx, patch->path);
+			goto fail;
+		}
+
+		size_t old_left = h.old_count, new_left = h.new_count;
+		while (old_left > 0 || new_left > 0 ||
+		    (idx < patch->nlines && patch->lines[idx][0] == '\\')) {
+			if (idx == patch->nlines) {
+				warnx("Truncated hunk at the end of '%s'", patch->path);
+				goto fail;
+			}
+			const char * const line = patch->lines[idx++];
+			const size_t len = patch->lines[idx] - line;
+			char kind = line[0];
+			if (kind == '\\') {
+				/* The previous line did not end with a newline. */
+				if (llen == h.first || (*lines)[llen - 1].len == 0 ||
+				    (*lines)[llen - 1].text[(*lines)[llen - 1].len - 1] != '\n') {
+					warnx("Misplaced end-of-file marker at line %zu of '%s'", idx, patch->path);
+					goto fail;
+				}
+				(*lines)[llen - 1].len--;
+				continue;
+			} else if (kind == '\n') {
+				/* Some tools strip the trailing space of an empty context line. */
+				kind = ' ';
+			}
+
+			if ((kind == ' ' && (old_left == 0 || new_left == 0)) ||
+			    (kind == '-' && old_left == 0) ||
+			    (kind == '+' && new_left == 0) ||
+			    (kind != ' ' && kind != '-' && kind != '+')) {
+				warnx("Unexpected line %zu in a hunk in '%s'", idx, patch->path);
+				goto fail;
+			}
+			if (kind != '+')
+				old_left--;
+			if (kind != '-')
+				new_left--;
+
+			FLEXARR_ALLOC(*lines, 1, llen, lall);
+			(*lines)[llen - 1] = (struct hunk_line){
+				.kind = kind,
+				.text = line[0] == '\n' ? line : line + 1,
+				.len = line[0] == '\n' ? len : len - 1,
+			};
+		}
+
+		h.count = llen - h.first;
+		FLEXARR_ALLOC(*hunks, 1, hlen, hall);
+		(*hunks)[hlen - 1] = h;
+	}
+
+	*nhunks = hlen;
+	*nlines = llen;
+	return (true);
+
+fail:
+	FLEXARR_FREE(*hunks, hall);
+	FLEXARR_FREE(*lines, lall);
+	return (false);
+}
+
+static bool
+hunk_matches(const struct diff_file * const target, const size_t pos,
+    const struct hunk * const h, const struct hunk_line * const lines)
+{
+	size_t tidx = pos;
+	for (size_t i = h->first; i < h->first + h->count; i++) {
+		const struct hunk_line * const hl = &lines[i];
+		if (hl->kind == '-')
+			continue;
+		const char * const tline = target->lines[tidx];
+		const size_t tlen = target->lines[tidx + 1] - tline;
+		if (tlen != hl->len || memcmp(tline, hl->text, tlen) != 0)
+			return (false);
+		tidx++;
+	}
+	return (true);
+}
+
+static void
+print_target_lines(FILE * const out, const struct diff_file * const target, const size_t from, const size_t to)
+{
+	if (to > from)
+		fwrite(target->lines[from], 1, target->lines[to] - target->lines[from], out);
+}
+
+bool
+unidiff_revert(FILE * const out, const char * const patch_path, const char * const patch_data, const size_t patch_len, const char * const target_path)
+{
+	struct arena arena = ARENA_INIT;
+	char * const data = arena_alloc(&arena, patch_len + 1);
+	memcpy(data, patch_data, patch_len);
+	data[patch_len] = '\0';
+	struct diff_file patch = {
+		.path = patch_path,
+		.data = data,
+		.len = patch_len,
+	}, target = { .path = target_path, };
+	split_lines(&arena, &patch);
+	if (!load_file(&arena, &target)) {
+		arena_free(&arena);
+		return (false);
+	}
+
+	struct hunk *hunks;
+	struct hunk_line *lines;
+	size_t nhunks, nlines;
+	if (!parse_hunks(&patch, &hunks, &nhunks, &lines, &nlines)) {
+		arena_free(&arena);
+		return (false);
+	}
+
+	bool res = true;
+	size_t pos = 0;
+	ptrdiff_t offset = 0;
+	for (size_t hi = 0; hi < nhunks; hi++) {
+		const struct hunk * const h = &hunks[hi];
+		if (h->new_count > target.nlines) {
+			warnx("Hunk #%zu of '%s' does not apply to '%s'", hi + 1, patch_path, target_path);
+			res = false;
+			break;
+		}
+
+		/*
+		 * Look for the hunk where it is supposed to be, then try
+		 * further and further away from that, like patch(1) does.
+		 */
+		const size_t last = target.nlines - h->new_count;
+		ptrdiff_t expected = (ptrdiff_t)(h->new_count == 0 ? h->new_start : h->new_start - 1) + offset;
+		if (expected < (ptrdiff_t)pos)
+			expected = pos;
+		else if (expected > (ptrdiff_t)last)
+			expected = last;
+		bool found = false;
+		size_t at = 0;
+		for (size_t dist = 0; !found; dist++) {
+			const bool fwd_ok = (size_t)expected + dist <= last;
+			const bool back_ok = dist > 0 && (size_t)expected >= pos + dist;
+			if (!fwd_ok && !back_ok)
+				break;
+			if (fwd_ok && hunk_matches(&target, expected + dist, h, lines)) {
+				at = expected + dist;
+				found = true;
+			} else if (back_ok && hunk_matches(&target, expected - dist, h, lines)) {
+				at = expected - dist;
+				found = true;
+			}
+		}
+		if (!found) {
+			warnx("Hunk #%zu of '%s' does not apply to '%s'", hi + 1, patch_path, target_path);
+			res = false;
+			break;
+		}
+
+		print_target_lines(out, &target, pos, at);
+		for (size_t i = h->first; i < h->first + h->count; i++)
+			if (lines[i].kind != '+')
+				fwrite(lines[i].text, 1, lines[i].len, out);
+		pos = at + h->new_count;
+		offset = (ptrdiff_t)at - (ptrdiff_t)(h->new_count == 0 ? h->new_start : h->new_start - 1);
+	}
+	if (res)
+		print_target_lines(out, &target, pos, target.nlines);
+
+	FLEXARR_FREE(lines, nlines);
+	FLEXARR_FREE(hunks, nhunks);
+	arena_free(&arena);
+
+	if (res && ferror(out)) {
+		warn("Could not write out the reverted '%s'", target_path);
+		return (false);
+	}
+	return (res);
+}